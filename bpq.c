@@ -2,37 +2,90 @@
 //
 //  • Output verde in alto (soft-wrap wide-safe, scroll PgUp/PgDn/↑/↓/Home/End)
 //  • Barra comandi bianca fissa in basso; cursore sempre lì (wide)
-//  • Reflow al resize (wrap coerente con cols-1)
-//  • Telnet minimal (IAC/DO/DONT/WILL/WONT/SB/SE), cap-safe + TX IAC escaping
+//  • Render incrementale: solo righe cambiate, wscrl in coda, un solo doupdate() per giro
+//  • Wrap lazy (coerente con cols-1): solo righe disegnate, cache righe/larghezza; resize O(altezza)
+//  • Scrollback compatto: 1/2/4 byte per char secondo la riga (+ larghezze solo se non tutte 1), 100000 righe
+//  • Senza log, le righe che escono dal ring passano a blocchi di 256 compressi LZ4 in RAM (--cold N righe,
+//    default 1000000, 0 = niente): PgUp e ricerca li decomprimono al volo, LRU di 4 blocchi decodificati
+//  • Log di sessione su disco (--log-dir DIR): host_port.log + .idx mappati, scrollback illimitato a RAM costante
+//  • Telnet: negoziazione RFC 1143 di BINARY/ECHO/SGA/NAWS (echo remoto = niente echo locale, NAWS al resize),
+//    risposte raccolte in un solo write per chunk RX, SB scartate, TX IAC escaping
 //  • RX: normalizza CR/LF; TX: CRLF (o solo CR con --cr-only)
 //  • Autologin (prompt + cieco); invio automatico “?” dopo sblocco (se abilitato)
+//  • Prompt login/password/sblocco riconosciuti da un automa Aho-Corasick sul flusso RX (ogni byte una volta)
+//  • Trigger utente (--triggers FILE): letterali/regex -> send, beep, highlight, log, exec
 //  • TAB espansi a spazi (tabstop 8) per wrapping corretto
+//  • Colori ANSI: SGR (16/256/truecolor ridotti a 16, grassetto, sottolineato, inverso) tolti dal testo
+//    e salvati come run di attributi accanto alla riga; le altre sequenze CSI si scartano
+//  • Fast path ASCII: blocchi 7 bit riconosciuti e allargati con SIMD (SSE2/AVX2/NEON), wrap senza wcwidth
+//  • Larghezza e classe di taglio da una tabella BMP costruita all'avvio (fuori BMP wcwidth/iswpunct),
+//    salvate una volta per riga logica e riusate da tutti i wrap e i ridisegni
+//  • Connessione non bloccante: DNS in un thread, tentativi IPv6/IPv4 sfalsati di 250 ms (RFC 8305), timeout
+//  • --reconnect: riconnessione con backoff esponenziale + jitter, rifà l'autologin, --post-login CMD
+//  • Trasferimenti fuori dallo scrollback: YAPP in ricezione, 7plus automatico, cattura grezza con F5
+//    (--capture-dir DIR): dritti su file con buffer da 64 KiB, sulla barra solo avanzamento e velocità
+//  • Invio a ritmo di testi lunghi: paste multi-riga (bracketed paste) e --send-file FILE, con budget
+//    --pace-bps N / --pace-lps N o attesa del prompt (--pace-prompt); F6 annulla
+//  • Thread di I/O: legge i socket in anelli SPSC lock-free (sveglia via pipe), il disegno non frena il TCP
+//  • Strumentazione: RX B/s e righe/s, lettura->schermo, tasto->write, tempo per frame, syscall per riga,
+//    RTT del keepalive; F7 HUD sulla barra di stato, SIGUSR1 scrive un JSON in $TMPDIR/bpqchat-PID.json
+//  • --control PATH: socket Unix per script (più client): SUB riceve le righe decodificate, SEND inietta
+//    comandi sullo stesso TX della tastiera; non blocca mai il loop (client lento = chiuso)
+//  • --replay FILE: traffico registrato (telnet compreso) rigiocato nella UI senza connessione;
+//    --bench FILE: stesso percorso RX + wrap/reflow + disegno senza ncurses, stampa righe/s, allocazioni, RSS
 //  • SIGPIPE ignorato, write() robusto
 //  • Local echo: comandi inviati appaiono anche nell’output (disattivabile con --no-local-echo)
-//  • RX accumulator: nessuna riga viene spezzata su confini di pacchetto (righe solo su '\n')
+//  • RX a passata unica: telnet + CR/LF + UTF-8 + TAB in streaming, stato tra una read() e l'altra (righe solo su '\n')
 //  • Ctrl-Z: inviato al nodo come 0x1A (SUB); opzionale sospensione UNIX con --no-pass-ctrl-z
 //  • Keepalive applicativo (TELNET NOP) via --keepalive SECONDS + SO_KEEPALIVE TCP
-//  • History comandi su Freccia Su/Giù (+ backup/ripristino riga corrente)
+//  • History comandi per nodo: file append-only (--history-dir DIR, default ~/.bpqchat) caricato a loop
+//    inattivo, ring da 50000 voci senza duplicati (indice ordinato), ↑/↓ per prefisso, Ctrl-R all'indietro
+//  • Riga di input a gap buffer: ←/→, Ctrl-A/E, parole con Ctrl/Alt-←/→ o Alt-b/f, Canc in avanti,
+//    Ctrl-K/U/W taglia e Ctrl-Y incolla; la finestra visibile scorre col cursore (disegno O(larghezza))
+//  • Ricerca incrementale Ctrl-F (indice Bloom a trigrammi per blocco, anche sul log), evidenziata, n/N
+//  • Multi-sessione: più nodi in un solo processo (separati da --), F2 cambia sessione, F3 split
+//  • Viste filtrate (--filter PATTERN, ripetibile, alternative con |): per filtro un indice degli id
+//    che corrispondono, aggiornato riga per riga; F8 cambia la vista del pane attivo all'istante
 //
-// Build: gcc -O2 -Wall -o bpqchat bpqchat.c -lncursesw
+// Build: gcc -O2 -Wall -pthread -o bpqchat bpqchat.c -lncursesw   (SSE2/NEON di default; -march=native abilita AVX2)
 // Uso  : ./bpqchat <host> <port>
 //        [-u USER -p PASS] [--blind-auto] [--cr-only] [--upper] [--no-auto-help] [--no-local-echo]
-//        [--no-pass-ctrl-z] [--ctrl-z-cr] [--keepalive SECONDS]
-// Opz. : --unlock-delay MS (default 1200), --unlock-quiet MS (default 300)
+//        [--no-pass-ctrl-z] [--ctrl-z-cr] [--keepalive SECONDS] [--log-dir DIR] [--triggers FILE]
+//        [--connect-timeout SECONDS] [--reconnect] [--post-login CMD]... [--capture-dir DIR]
+//        [--send-file FILE] [--pace-bps N] [--pace-lps N] [--pace-prompt] [--history-dir DIR] [--cold N]
+//        [--filter PATTERN]...
+//        [-- <host2> <port2> [opzioni della sessione 2]] ...
+//        ./bpqchat --replay FILE [opzioni]       (al posto di <host> <port>, anche come sessione dopo --)
+//        ./bpqchat --bench FILE [--bench-cols N] [--bench-iter N]
+// Opz. : --unlock-delay MS (default 1200), --unlock-quiet MS (default 300), --connect-timeout (default 10, 0 = nessuno)
+//        --max-fps N (default 30, 0 = nessun limite): l'RX a raffica viene ridisegnato al più N volte/s
+//        --control PATH: socket di controllo (globale)
+//        Le opzioni valgono per la sessione che le precede (--max-fps e --control sono globali).
 
 #define _POSIX_C_SOURCE 200809L
 #include <ncurses.h>
 #include <locale.h>
 #include <errno.h>
 #include <ctype.h>
+#include <fcntl.h>
 #include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <regex.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/select.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <time.h>
 #include <unistd.h>
 #include <wchar.h>
@@ -41,58 +94,417 @@
 #ifdef __linux__
 #include <netinet/tcp.h>
 #endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 /* Telnet */
 enum { IAC=255, DONT=254, DO_=253, WONT=252, WILL=251, SB=250, SE=240, NOP_=241 };
+enum { TO_BINARY=0, TO_ECHO=1, TO_SGA=3, TO_NAWS=31 };
 
 /* UI */
-static int sockfd=-1;
-static WINDOW *win_out=NULL, *win_status=NULL, *win_in=NULL;
+static WINDOW *win_status=NULL, *win_in=NULL;
 static int rows=0, cols=0;
 static const char *PROMPT="> ";
 
-/* Opzioni */
-static int opt_cr_only=0, opt_upper=0, opt_auto_help=1;
-static int opt_local_echo=1;            /* echo locale attivo di default */
-static int opt_pass_ctrl_z=1;           /* default: passa ^Z (0x1A) al nodo */
-static int opt_ctrlz_append_cr=0;       /* dopo ^Z, invia anche EOL se settato */
-static long unlock_delay_ms=1200, unlock_quiet_ms=300;
-
-/* Keepalive */
-static long keepalive_secs = 0;         /* 0 = disabilitato */
-static struct timespec last_tx_ts;      /* ultimo invio verso socket */
+/* Opzioni globali */
+static long opt_max_fps=30;             /* limite frame/s per il ridisegno dell'output (0 = nessuno) */
+static int opt_split=0;                 /* F3: tutte le sessioni a schermo, una sopra l'altra */
 
 /* Colori */
 #define CP_OUT 1  /* verde */
 #define CP_IN  2  /* bianco */
 #define CP_ST  3  /* ciano */
+#define CP_HL  4  /* giallo: righe evidenziate dai trigger */
+#define CP_DYN 8  /* da qui le coppie fg/bg dei colori ANSI, create al primo uso */
+#define KEY_PASTE_BEGIN (KEY_MAX+1)
+#define KEY_PASTE_END   (KEY_MAX+2)
+#define KEY_WORD_LEFT   (KEY_MAX+3)     /* Ctrl/Alt-←, Alt-b */
+#define KEY_WORD_RIGHT  (KEY_MAX+4)     /* Ctrl/Alt-→, Alt-f */
+
+/* Arena a chunk per il testo delle righe logiche: le righe sono FIFO, quindi
+ * i chunk si liberano in blocco (dal più vecchio) man mano che il ring avanza. */
+#define ARENA_CHUNK_BYTES 262144
+typedef struct arena_chunk { struct arena_chunk *next; size_t used, cap; int live; unsigned char data[]; } arena_chunk_t;
+typedef struct { arena_chunk_t *head, *tail; } arena_t;
+static uint64_t n_allocs;               /* malloc/realloc dei buffer di RX e scrollback (bench, statistiche) */
+
+/* n byte allineati a 4 (il testo a 2/4 byte per char si legge senza memcpy) */
+static unsigned char *arena_alloc(arena_t *a, size_t n, arena_chunk_t **owner){
+    n = (n+3) & ~(size_t)3;
+    if (!a->tail || a->tail->cap - a->tail->used < n){
+        size_t cap = n > ARENA_CHUNK_BYTES ? n : ARENA_CHUNK_BYTES;
+        arena_chunk_t *c = (arena_chunk_t*)malloc(sizeof(*c) + cap); n_allocs++;
+        if (!c) return NULL;
+        c->next=NULL; c->used=0; c->cap=cap; c->live=0;
+        if (a->tail) a->tail->next=c; else a->head=c;
+        a->tail=c;
+    }
+    unsigned char *p = a->tail->data + a->tail->used;
+    a->tail->used += n; a->tail->live++;
+    *owner = a->tail;
+    return p;
+}
+static void arena_release(arena_t *a, arena_chunk_t *c){
+    if (c && c->live>0) c->live--;
+    /* libera dalla testa i chunk senza righe vive (il chunk corrente resta) */
+    while (a->head && a->head!=a->tail && a->head->live==0){
+        arena_chunk_t *n = a->head->next; free(a->head); a->head = n;
+    }
+    if (a->tail && a->tail->live==0) a->tail->used=0;
+}
+static void arena_free_all(arena_t *a){
+    while (a->head){ arena_chunk_t *n=a->head->next; free(a->head); a->head=n; }
+    a->tail=NULL;
+}
+
+/* Stato output: archivio righe logiche (testo in arena) in un ring buffer
+ * (head + count): l'eviction della riga più vecchia è O(1). Gli indici logici
+ * 0..count-1 partono sempre dalla riga più vecchia; gli id delle righe sono
+ * assoluti e crescenti (store_first_id = id di indice 0).
+ * Le righe visuali non sono memorizzate: il wrap è lazy, solo per le righe
+ * disegnate, con cache del numero di righe visuali per larghezza (wrap_w/nrows). */
+/* Testo compatto: enc = byte per char (1 se tutti i codepoint < 256, 2 se < 65536, altrimenti 4);
+ * se la riga non è narrow dopo il testo c'è un byte di larghezza per char. Il wide si
+ * ricostruisce solo per i segmenti disegnati. */
+#define STORE_MAX 100000
+typedef struct {
+    unsigned char *txt; arena_chunk_t *chunk;
+    int len, colw, wrap_w, nrows;      /* colw: colonne totali */
+    unsigned char enc, narrow;         /* narrow: tutti i char larghi 1 (niente tabella larghezze) */
+    unsigned char hl;                  /* evidenziata da un trigger */
+    unsigned short nruns;              /* run di attributi ANSI dopo testo e larghezze (0 = monocroma) */
+} line_t;
+/* Attributi SGR in 16 bit: fg/bg 0 = default, 1..16 = colore 0..15; poi grassetto, sottolineato, inverso */
+#define SGR_FG(a)   ((a) & 31)
+#define SGR_BG(a)   (((a)>>5) & 31)
+#define SGR_BOLD    (1u<<10)
+#define SGR_UNDER   (1u<<11)
+#define SGR_REV     (1u<<12)
+typedef struct { uint32_t at; uint16_t attr, pad; } sgr_run_t;   /* da char at in poi vale attr */
+#define STORE_AT(s,i) ((s)->store[((s)->store_head+(i))%STORE_MAX])
+
+/* Render incrementale: per ogni riga del pane cosa c'è a schermo (id, riga visuale).
+ * out_dirty = store o vista cambiati; ui_dirty = wnoutrefresh pendenti (doupdate una volta per giro). */
+#define ROW_NONE ((unsigned long)-1)
+typedef struct { unsigned long id; int row; } scr_row_t;
+static int ui_dirty=0;
+
+/* Coda TX: righe già pronte (IAC raddoppiati + EOL) da spedire insieme con un solo write */
+typedef struct { unsigned char *buf; size_t len, cap; } txbuf_t;
+
+/* Telnet / autologin */
+/* Buffer wide riusabile (cresce e basta): niente malloc per riga */
+typedef struct { wchar_t *buf; size_t cap; } wbuf_t;
+static int wbuf_reserve(wbuf_t *b, size_t n){
+    if (n <= b->cap) return 1;
+    size_t nc = b->cap ? b->cap : 256;
+    while (nc < n) nc *= 2;
+    wchar_t *t = (wchar_t*)realloc(b->buf, sizeof(wchar_t)*nc); n_allocs++;
+    if (!t) return 0;
+    b->buf=t; b->cap=nc; return 1;
+}
+static wbuf_t wb_row;                   /* segmento di riga in wide per il disegno */
+static wbuf_t wb_disk, wb_idx, wb_echo; /* righe UTF-8 decodificate: lette dal log, indicizzate, in eco locale */
+
+/* Decoder RX in streaming: telnet, CR/LF, sequenze UTF-8 e riga in costruzione
+ * sopravvivono ai confini di read(); ogni byte viene visto una volta sola. */
+typedef struct {
+    int tstate; unsigned char tcmd;     /* telnet: 0 dati, 1 IAC, 2 opzione, 3 SB, 4 SB+IAC */
+    int cr;                             /* ultimo byte CR: un LF subito dopo chiude la stessa riga */
+    int u8_need; unsigned u8_cp, u8_min;/* sequenza UTF-8 parziale */
+    wbuf_t ln; size_t len; int col;     /* riga in costruzione (TAB già espansi) + colonne occupate */
+    int wide;                           /* la riga ha char con larghezza != 1 */
+    int enq;                            /* visto ENQ: con SOH dopo è un Send_Init YAPP */
+    int esc; int np; unsigned par[16];  /* sequenza ESC: 1 dopo ESC, 2 dentro CSI (parametri), 3 CSI privata */
+    uint16_t attr;                      /* attributi SGR correnti (restano da una riga all'altra) */
+    sgr_run_t *runs; size_t nruns, rcap;/* run della riga in costruzione */
+} rx_dec_t;
+typedef struct { int enabled; int state; char user[128]; char pass[128]; } autologin_prompt_t;
+typedef struct { int enabled; int stage; struct timespec t0, t_pass; long du_ms, dp_ms; char user[128]; char pass[128]; } autologin_blind_t;
+
+/* Opzioni per sessione */
+#define POST_LOGIN_MAX 16
+typedef struct {
+    int cr_only, upper, auto_help;
+    int local_echo;                     /* echo locale attivo di default */
+    int pass_ctrl_z;                    /* default: passa ^Z (0x1A) al nodo */
+    int ctrlz_append_cr;                /* dopo ^Z, invia anche EOL se settato */
+    long unlock_delay_ms, unlock_quiet_ms;
+    long keepalive_secs;                /* 0 = disabilitato */
+    const char *log_dir;                /* NULL = nessun log su disco */
+    const char *triggers;               /* file delle regole, NULL = nessuna */
+    long connect_timeout_ms;            /* DNS + connect, 0 = nessun limite */
+    int reconnect;                      /* caduta/fallimento: si riprova invece di chiudere */
+    const char *post_login[POST_LOGIN_MAX]; int npost;  /* comandi dopo ogni login */
+    const char *capture_dir;            /* file di YAPP/7plus/F5, NULL = log_dir o "." */
+    const char *send_file;              /* inviato a ritmo dopo il primo login */
+    long pace_bps, pace_lps;            /* budget dell'invio a ritmo, 0 = nessun limite */
+    int pace_prompt;                    /* dopo ogni riga aspetta un prompt (o PACE_PROMPT_MS) */
+    const char *replay;                 /* traffico registrato al posto della connessione */
+    const char *history_dir;            /* NULL = ~/.bpqchat, "" = history solo in memoria */
+    long cold_lines;                    /* righe tenute compresse oltre il ring (senza log), 0 = nessuna */
+} sess_opts_t;
+
+/* RX dal thread di I/O: anello di byte single-producer (thread I/O) / single-consumer (UI).
+ * head/tail crescono senza modulo; eof: 0, -1 = chiusura del peer, >0 = errno di read() */
+#define RXRING_SIZE (1u<<20)
+typedef struct {
+    unsigned char *buf;
+    _Atomic size_t head, tail;
+    _Atomic int eof, full;              /* full: il thread I/O ha smesso di leggere, va svegliato */
+    _Atomic uint64_t t_arrive;          /* ns del primo byte non ancora preso dalla UI (0 = nessuno) */
+    int fd; unsigned gen;               /* socket letto dal thread I/O (sotto io_mx) */
+} rxring_t;
+
+/* Invio a ritmo: testo UTF-8 in righe '\n', spedito dal loop nei limiti del budget; le righe
+ * pronte nello stesso giro partono con un solo write */
+#define UPL_BATCH 16384                 /* byte al più per giro del loop (senza limiti la UI resta viva) */
+#define PACE_PROMPT_MS 10000            /* --pace-prompt: se il prompt non arriva si va avanti */
+typedef struct {
+    unsigned char *buf; size_t len, cap, off;   /* off = inizio della prossima riga */
+    int lines, sent;
+    struct timespec t_next;             /* budget: prima ora in cui può partire la prossima riga */
+    int wait_prompt; struct timespec t_wait;
+} upl_t;
+
+/* Trasferimento in corso: i byte RX (dopo il telnet) vanno su file e non nello scrollback */
+#define XFER_BUF 65536
+enum { XF_NONE, XF_RAW, XF_7PLUS, XF_YAPP };
+enum { Y_TYPE, Y_LEN, Y_BODY, Y_ARG };  /* YAPP: tipo pacchetto, lunghezza, corpo, byte dopo ETX/EOT/ENQ */
+typedef struct {
+    int mode, fd;
+    char path[512];
+    unsigned char *buf; size_t len;
+    uint64_t bytes, total;              /* scritti, attesi (YAPP: dimensione dall'header) */
+    struct timespec t0;
+    int pend7;                          /* visto "go_7+.": si passa in 7plus a fine byte/blocco */
+    int cr;                             /* ultimo byte scritto = CR (fuori da BINARY il NUL dopo va tolto) */
+    int stop_st, stop_seen;             /* 7plus: "stop_7+." riconosciuto, si chiude a fine riga */
+    int ystate, ytype, yneed, ylen;
+    unsigned char ybody[256];
+} xfer_t;
+
+/* Connessione: getaddrinfo gira in un thread (avvisa il loop con il puntatore del job sulla
+ * dns_pipe), poi tentativi non bloccanti alternando le famiglie, uno nuovo ogni CONN_STAGGER_MS
+ * o appena il precedente fallisce; vince il primo che si completa. */
+#define CONN_MAX_ADDR 8
+#define CONN_STAGGER_MS 250
+/* --reconnect: attesa 1 s, 2 s, 4 s ... fino a 60 s, metà fissa + metà casuale; una connessione
+ * rimasta su almeno RECONN_STABLE_MS riparte da 1 s */
+#define RECONN_BASE_MS 1000
+#define RECONN_MAX_MS 60000
+#define RECONN_STABLE_MS 30000
+enum { CS_IDLE, CS_DNS, CS_CONNECTING, CS_UP, CS_FAIL, CS_WAIT };
+typedef struct dns_job_s dns_job_t;
+typedef struct {
+    int state;
+    dns_job_t *job;                     /* risoluzione in corso */
+    struct addrinfo *res, *addr[CONN_MAX_ADDR];
+    int naddr, next;                    /* indirizzi in ordine di tentativo, prossimo da provare */
+    int fd[CONN_MAX_ADDR];              /* tentativi in corso (-1 = nessuno) */
+    int err;                            /* errno dell'ultimo tentativo fallito */
+    struct timespec t0, t_next;         /* inizio connessione, prossimo tentativo sfalsato */
+    int retries, ever_up;
+    struct timespec t_up, t_retry;      /* connessione riuscita, prossima riconnessione */
+    char cur[64];                       /* ultimo indirizzo tentato (per la barra di stato) */
+} conn_t;
+
+/* Trigger: i letterali (e il letterale obbligatorio di ogni regex, se estraibile) stanno in
+ * un unico automa Aho-Corasick sul flusso RX; le regex si valutano a fine riga solo se il
+ * loro letterale è comparso nella riga (o sempre, se non ne hanno uno). */
+enum { TR_LIT, TR_RE };
+enum { TA_SEND, TA_BEEP, TA_HIGHLIGHT, TA_LOG, TA_EXEC };
+typedef struct {
+    int kind, action;
+    char *pat, *arg;                    /* arg: testo da inviare, file di log o comando */
+    int log_fd;
+    regex_t re; int has_pre;            /* has_pre: la regex ha un letterale nell'automa */
+} trigger_t;
+typedef struct ac_s ac_t;
+typedef struct {
+    trigger_t *r; int n;
+    ac_t *ac; int *ac_rule;             /* pattern dell'automa -> regola */
+    unsigned char *u8; size_t u8cap;    /* riga in UTF-8 per regex, log ed exec */
+} trigset_t;
+
+/* Log su disco: .log = righe UTF-8 terminate da '\n', .idx = offset uint64 di inizio riga.
+ * L'id di una riga è la sua posizione nel log: le righe uscite dal ring restano leggibili
+ * dalla mappa del file. Scritture bufferizzate, un write per giro del loop. */
+typedef struct {
+    int fd, ifd;                        /* -1 = log disattivato */
+    uint64_t size;                      /* byte del .log (compresi quelli ancora nel buffer) */
+    unsigned long nlines;
+    unsigned char *wbuf; size_t wlen, wcap;
+    uint64_t *ibuf; size_t ilen, icap;
+    unsigned char *map; size_t map_len; /* mmap .log */
+    uint64_t *imap; size_t imap_len;    /* mmap .idx (byte) */
+} slog_t;
+
+/* History comandi del nodo: ring di id assoluti (ring[id % CMDHIST_MAX], NULL = voce ripetuta
+ * più avanti); sugli slot delle voci vive un hash per testo (dedup) e un albero AVL ordinato per
+ * testo (ricerche per prefisso): inserire ed eliminare non spostano memoria */
+#define CMDHIST_MAX 50000
+#define CMDHIST_HS (1u<<17)             /* slot dell'hash, potenza di 2 > 2*CMDHIST_MAX */
+typedef struct { int32_t l, r, ht; } chnode_t;
+typedef struct {
+    wchar_t **ring; unsigned long first, end;
+    int32_t *hs;                        /* slot+1 delle voci vive, 0 = vuoto (indirizzamento aperto) */
+    chnode_t *tn; int32_t root;         /* tn[slot]: nodo della voce in ring[slot], -1 = nessuno */
+    size_t nlive; int bulk;             /* bulk: caricamento, l'albero si costruisce alla fine */
+    unsigned long gen;                  /* cambia a ogni ch_add */
+    int fd, loaded;
+} cmdhist_t;
+static inline const wchar_t *ch_at(const cmdhist_t *h, unsigned long id){ return h->ring[id % CMDHIST_MAX]; }
+static struct {
+    int on, found;
+    wchar_t q[128]; size_t qlen;
+    unsigned long hit;
+} hrs;                                  /* Ctrl-R sulla history della sessione attiva */
 
-/* Stato output: archivio righe logiche wide + righe visuali wide wrappate */
-#define STORE_MAX 20000
-#define VIS_MAX   200000
-static wchar_t *store[STORE_MAX];  static int store_count=0;
-static wchar_t *visual[VIS_MAX];   static int vis_count=0;
-static int view_top=0; /* indice prima riga visuale mostrata */
+/* Indice di ricerca: un filtro di Bloom sui trigrammi (minuscoli) per blocco di IDX_BLOCK righe */
+#define IDX_BLOCK 256
+#define BLOOM_BITS 16384
+#define IDX_SLOTS 4096                  /* filtri tenuti per sessione: 8 MiB, ~1M righe */
+typedef struct { uint64_t w[BLOOM_BITS/64]; } bloom_t;
+
+/* Righe lette dal log: cache a indirizzamento diretto per id (righe vicine non si scalzano) */
+#define LCACHE_N 512
+typedef struct { unsigned long id; line_t L; size_t cap; } lcache_t;
+
+/* Scrollback freddo: ring di blocchi compressi da COLD_BLOCK righe, LRU dei decompressi */
+#define COLD_BLOCK 256
+#define COLD_LRU 4
+#define COLD_DEFAULT 1000000
+typedef struct { unsigned char *z; uint32_t zlen, raw; unsigned long first; } cold_blk_t;   /* first = id della prima riga */
+typedef struct { unsigned long base; unsigned char *raw; size_t cap; uint64_t used; line_t L[COLD_BLOCK]; } cold_dec_t;
+typedef struct {
+    cold_blk_t *blk; int head, n, cap;  /* il più vecchio a head */
+    unsigned long first_id;             /* id della prima riga di blk[head] (dopo un OOM i blocchi possono non essere contigui) */
+    cold_dec_t *dec; uint64_t tick;
+    unsigned char *raw, *z; size_t rcap, zcap;  /* appoggio di cold_push: blocco in chiaro e compresso */
+    size_t zbytes, rawbytes;
+} cold_t;
+
+/* Vista filtrata: id crescenti delle righe che contengono il pattern */
+#define FILT_MAX 8
+typedef struct {
+    const char *arg; wchar_t *pat; size_t plen;  /* pat: alternative minuscole, ognuna chiusa da L'\0' */
+    unsigned long *ids; size_t off, n, cap;      /* ids[off..n): quelle ancora nello scrollback */
+} filt_t;
+
+/* Sessione = una connessione a un nodo con il suo scrollback e il suo pane */
+typedef struct {
+    const char *host, *port;
+    sess_opts_t opt;
+    int sockfd;
+    conn_t conn;
+
+    /* TX + keepalive */
+    txbuf_t txq;
+    struct timespec last_tx_ts;         /* ultimo invio verso socket */
+
+    /* RX: decoder + stato dell'automa dei prompt */
+    rx_dec_t rx;
+    rxring_t rr;
+    struct { unsigned char *data; size_t len, off; struct timespec t0; uint64_t lines0; } rp;  /* --replay, mappato */
+    uint64_t lat_t0, ka_t0;             /* arrivo del primo byte non ancora a schermo; NOP in attesa di RX */
+    xfer_t xf;
+    upl_t up; int send_file_done;
+    unsigned char tn_us[256], tn_him[256]; /* stato RFC 1143 per opzione (TQ_*), nostro e del nodo */
+    int naws_w, naws_h;                 /* ultima dimensione mandata col NAWS */
+    int ac_st;
+    trigset_t *trig; int trig_st;
+    unsigned char *tr_hit;              /* per regola: pattern visto nella riga corrente */
+    struct timespec last_rx;
+
+    /* Stato login/lock: i prompt di sblocco contano solo a login finito (unlock_armed);
+     * visto un prompt (unlock_seen) l'input si sblocca dopo unlock_quiet_ms di silenzio */
+    autologin_prompt_t alp; autologin_blind_t alb;
+    int input_locked, login_done_flag, auto_help_sent, unlock_armed, unlock_seen, post_login_sent;
+    struct timespec t_login_done;
+
+    /* Scrollback */
+    arena_t arena;
+    line_t *store; int store_head, store_count;
+    unsigned long store_first_id;
+    slog_t log; lcache_t *lcache;
+    cold_t cold;
+    filt_t filt[FILT_MAX]; int nfilt, fv;   /* fv = filtro mostrato nel pane, -1 = tutte le righe */
+    cmdhist_t hist;
+
+    /* Indice di ricerca: il blocco b sta in idx[b % IDX_SLOTS] se idx_tag lo dice, idx_fill = righe
+     * messe; le righe del log precedenti l'avvio (id < idx_hist_end) si indicizzano in background,
+     * idx_bg_id/off = prossima da fare */
+    bloom_t *idx; unsigned long *idx_tag; uint16_t *idx_fill; size_t idx_n;
+    unsigned long idx_bg_id, idx_hist_end; uint64_t idx_bg_off;
+
+    /* Vista: prima riga mostrata = riga visuale view_row della riga logica view_id */
+    unsigned long view_id; int view_row;
+    unsigned long wrap_bg_id; int wrap_bg_dir;
+
+    /* Pane (win==NULL se la sessione non è a schermo) */
+    WINDOW *win, *title; int pane_h;
+    scr_row_t *drawn, *want; int drawn_valid, out_dirty;
+    int activity;                       /* righe nuove mentre non era a schermo */
+} session_t;
+
+#define SESS_MAX 16
+static session_t *sess[SESS_MAX];
+static int nsess=0, cur_sess=0;
+#define CUR (sess[cur_sess])
 
 /* Varie */
 static volatile sig_atomic_t need_resize=0;
 static const int TABSTOP=8;
 
-/* Accumulatore RX (UTF-8) per evitare spezzature di riga tra chunk */
-static char  *rx_acc = NULL;
-static size_t rx_len = 0, rx_cap = 0;
-
 /* Utils di tempo */
 static long since_ms(struct timespec a, struct timespec b){
     return (b.tv_sec-a.tv_sec)*1000 + (b.tv_nsec-a.tv_nsec)/1000000;
 }
+static uint64_t now_ns(void){
+    struct timespec t; clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t)t.tv_sec*1000000000u + (uint64_t)t.tv_nsec;
+}
+
+/* Statistiche: contatori + istogrammi log2 in microsecondi (bucket b = [2^b, 2^(b+1)) µs).
+ * Tutto dal thread principale tranne io_sys, che conta le syscall del thread I/O. */
+#define HIST_N 32
+typedef struct { uint64_t b[HIST_N], n, sum_us, max_us; } hist_t;
+static struct {
+    uint64_t rx_bytes, rx_lines, tx_bytes, sys_main, frames;
+    _Atomic uint64_t io_sys;
+    hist_t lat_screen, lat_key, render, ka_rtt;
+    struct timespec t_start, t_snap;    /* avvio, ultimo campione dell'HUD */
+    uint64_t snap_rx, snap_lines, snap_sys;
+    double bps, lps, sys_per_line;      /* velocità dell'ultimo intervallo */
+} stats;
+static int opt_hud=0;
+static volatile sig_atomic_t need_stats_dump=0;
+static void hist_add(hist_t *h, uint64_t ns){
+    uint64_t us = ns/1000; int b=0;
+    while (b<HIST_N-1 && (us>>(b+1))) b++;
+    h->b[b]++; h->n++; h->sum_us += us; if (us>h->max_us) h->max_us=us;
+}
+/* Percentile p (0..1) come limite superiore del bucket (al più il massimo visto), in µs */
+static uint64_t hist_pct(const hist_t *h, double p){
+    if (!h->n) return 0;
+    uint64_t want = (uint64_t)(p*(double)h->n + 0.5), c=0;
+    if (!want) want=1;
+    for (int b=0;b<HIST_N;b++){ c += h->b[b]; if (c>=want) return ((uint64_t)2<<b) < h->max_us ? (uint64_t)2<<b : h->max_us; }
+    return h->max_us;
+}
 
 /* ---- Low-level I/O ---- */
 static ssize_t write_all(int fd, const void *buf, size_t len){
     const unsigned char *p = (const unsigned char*)buf;
     size_t left = len;
     while (left>0){
-        ssize_t w = write(fd, p, left);
+        ssize_t w = write(fd, p, left); stats.sys_main++;
         if (w<0){
             if (errno==EINTR) continue;
             return -1;
@@ -101,12 +513,66 @@ static ssize_t write_all(int fd, const void *buf, size_t len){
     }
     return (ssize_t)len;
 }
+/* writev completo (ritenta su scritture parziali); consuma l'array iov */
+static ssize_t writev_all(int fd, struct iovec *iov, int cnt){
+    size_t total=0;
+    while (cnt>0){
+        ssize_t w = writev(fd, iov, cnt); stats.sys_main++;
+        if (w<0){
+            if (errno==EINTR) continue;
+            return -1;
+        }
+        total += (size_t)w;
+        while (cnt>0 && (size_t)w >= iov->iov_len){ w -= (ssize_t)iov->iov_len; iov++; cnt--; }
+        if (cnt>0){ iov->iov_base = (char*)iov->iov_base + w; iov->iov_len -= (size_t)w; }
+    }
+    return (ssize_t)total;
+}
+static void history_free_all(void);
+static void ch_free(cmdhist_t *h);
+static void ed_free(void);
+static void ctl_close_all(void);
+static int ctl_nsub;                    /* client del socket di controllo iscritti alle righe */
+static void ctl_line(session_t *s, const wchar_t *w, size_t n);
+static void prompt_matcher_free(void);
+static void slog_close(slog_t *g);
+static void trig_free(trigset_t *t);
+static void xfer_stop(session_t *s, const char *why);
+static void io_detach(session_t *s);
+static void conn_reset(session_t *s);
+static void cold_free(cold_t *c);
+static void filt_free(session_t *s);
+static void sess_free(session_t *s){
+    if (s->xf.mode) xfer_stop(s, NULL);
+    free(s->xf.buf); free(s->up.buf);
+    conn_reset(s);
+    if (s->sockfd>=0){ io_detach(s); close(s->sockfd); }
+    free(s->rr.buf);
+    if (s->rp.data) munmap(s->rp.data, s->rp.len);
+    if (s->win) delwin(s->win);
+    if (s->title) delwin(s->title);
+    arena_free_all(&s->arena);
+    free(s->store); free(s->drawn); free(s->want);
+    free(s->txq.buf); free(s->rx.ln.buf); free(s->rx.runs);
+    slog_close(&s->log);
+    if (s->lcache){ for (int i=0;i<LCACHE_N;i++) free(s->lcache[i].L.txt); free(s->lcache); }
+    cold_free(&s->cold);
+    filt_free(s);
+    free(s->idx); free(s->idx_tag); free(s->idx_fill);
+    trig_free(s->trig); free(s->tr_hit);
+    ch_free(&s->hist);
+    free(s);
+}
+static void paste_mode(int on){ fputs(on ? "\033[?2004h" : "\033[?2004l", stdout); fflush(stdout); }
 static void die_cleanup(const char*fmt, ...) {
-    if (sockfd>=0) close(sockfd);
-    if (win_out || win_status || win_in) endwin();
-    for (int i=0;i<store_count;i++) free(store[i]);
-    for (int i=0;i<vis_count;i++) free(visual[i]);
-    free(rx_acc);
+    if (win_status || win_in){ paste_mode(0); endwin(); }
+    for (int i=0;i<nsess;i++) sess_free(sess[i]);
+    nsess=0;
+    free(wb_row.buf); free(wb_disk.buf); free(wb_idx.buf); free(wb_echo.buf);
+    prompt_matcher_free();
+    history_free_all();
+    ed_free();
+    ctl_close_all();
     if (fmt) {
         va_list ap; va_start(ap, fmt); vfprintf(stderr, fmt, ap); va_end(ap);
         fputc('\n', stderr);
@@ -114,67 +580,975 @@ static void die_cleanup(const char*fmt, ...) {
     }
     exit(EXIT_SUCCESS);
 }
-static void on_winch(int sig){ (void)sig; need_resize=1; }
+/* Self-pipe: SIGWINCH sveglia il poll() del loop principale */
+static int winch_pipe[2]={-1,-1};
+static void on_winch(int sig){
+    (void)sig; need_resize=1;
+    if (winch_pipe[1]>=0){ int e=errno; ssize_t r=write(winch_pipe[1], "w", 1); (void)r; errno=e; }
+}
+static void on_usr1(int sig){
+    (void)sig; need_stats_dump=1;
+    if (winch_pipe[1]>=0){ int e=errno; ssize_t r=write(winch_pipe[1], "u", 1); (void)r; errno=e; }
+}
+static void winch_pipe_init(void){
+    if (pipe(winch_pipe)<0) die_cleanup("pipe: %s", strerror(errno));
+    for (int i=0;i<2;i++){
+        fcntl(winch_pipe[i], F_SETFL, fcntl(winch_pipe[i], F_GETFL) | O_NONBLOCK);
+        fcntl(winch_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+}
+/* Scadenza più vicina per il poll(): wait=-1 (nessuna) oppure ms mancanti */
+static void deadline_min(long *wait, long ms){
+    if (ms<0) ms=0;
+    if (*wait<0 || ms<*wait) *wait=ms;
+}
 
-/* ---------- Telnet minimal cap-safe ---------- */
-typedef struct { int state; unsigned char cmd; } telnet_parser_t;
-static void telnet_send3(unsigned char a,unsigned char b,unsigned char c){
-    unsigned char t[3]={a,b,c}; if (write_all(sockfd,t,3)<0) die_cleanup("write telnet: %s", strerror(errno));
-    clock_gettime(CLOCK_MONOTONIC, &last_tx_ts);
+/* ---------- Sessioni ---------- */
+static session_t *sess_new(const char *host, const char *port){
+    session_t *s = (session_t*)calloc(1, sizeof(*s));
+    if (!s) return NULL;
+    s->store = (line_t*)calloc(STORE_MAX, sizeof(line_t));
+    if (!s->store){ free(s); return NULL; }
+    s->host=host; s->port=port; s->sockfd=-1;
+    s->log.fd=-1; s->log.ifd=-1;
+    s->opt.auto_help=1; s->opt.local_echo=1; s->opt.pass_ctrl_z=1;
+    s->opt.unlock_delay_ms=1200; s->opt.unlock_quiet_ms=300;
+    s->opt.connect_timeout_ms=10000;
+    s->opt.cold_lines=COLD_DEFAULT;
+    s->fv=-1;
+    s->xf.fd=-1; s->rr.fd=-1; s->hist.fd=-1;
+    for (int i=0;i<CONN_MAX_ADDR;i++) s->conn.fd[i]=-1;
+    s->out_dirty=1;
+    return s;
+}
+static int conn_pending(const session_t *s){ return s->conn.state==CS_DNS || s->conn.state==CS_CONNECTING || s->conn.state==CS_WAIT; }
+static int upl_active(const session_t *s){ return s->up.off < s->up.len; }
+/* Sessioni aperte, in connessione o in attesa di riconnettersi (un replay resta aperto) */
+static int sess_open_count(void){
+    int n=0;
+    for (int i=0;i<nsess;i++) if (sess[i]->sockfd>=0 || conn_pending(sess[i]) || sess[i]->rp.data) n++;
+    return n;
 }
-static void telnet_send_nop(void){
+static void add_logical_line_w(session_t *s, const wchar_t *line, int follow);
+static int is_following(session_t *s);
+static unsigned long vid_count(session_t *s);
+static void ui_draw_status(void);
+static void conn_retry_later(session_t *s, const char *why);
+/* Chiusura di una sessione: con --reconnect si riprova; con una sola connessione aperta si
+ * esce come prima, altrimenti la sessione resta (scrollback leggibile) e le altre proseguono. */
+static void sess_fail(session_t *s, const char *fmt, ...){
+    char msg[256];
+    if (fmt){ va_list ap; va_start(ap, fmt); vsnprintf(msg, sizeof msg, fmt, ap); va_end(ap); }
+    if (s->sockfd<0) return;
+    io_detach(s);
+    if (s->opt.reconnect){
+        close(s->sockfd); s->sockfd=-1;
+        conn_retry_later(s, fmt ? msg : "connessione chiusa");
+        return;
+    }
+    if (sess_open_count()<=1){
+        if (fmt) die_cleanup("%s", msg);
+        die_cleanup(NULL);
+    }
+    close(s->sockfd); s->sockfd=-1; s->conn.state=CS_FAIL;
+    if (s->xf.mode) xfer_stop(s, "connessione persa");
+    wchar_t wmsg[300];
+    swprintf(wmsg, sizeof(wmsg)/sizeof(wmsg[0]), L"*** %s:%s: %s", s->host, s->port, fmt ? msg : "connessione chiusa");
+    add_logical_line_w(s, wmsg, is_following(s));
+    ui_draw_status();
+}
+
+/* ---------- Telnet minimal cap-safe ---------- */
+static void telnet_send_nop(session_t *s){
     unsigned char t[2]={IAC, NOP_};
-    if (write_all(sockfd, t, 2)<0) die_cleanup("write telnet NOP: %s", strerror(errno));
-    clock_gettime(CLOCK_MONOTONIC, &last_tx_ts);
+    if (s->sockfd<0) return;
+    if (write_all(s->sockfd, t, 2)<0){ sess_fail(s, "write telnet NOP: %s", strerror(errno)); return; }
+    clock_gettime(CLOCK_MONOTONIC, &s->last_tx_ts);
+    stats.tx_bytes += 2;
+    if (!s->ka_t0) s->ka_t0 = now_ns();    /* RTT: fino al prossimo RX */
 }
-static size_t telnet_filter_and_reply(telnet_parser_t *tp,
-                                      const unsigned char *in, size_t len,
-                                      unsigned char *out, size_t outcap)
-{
-    size_t o=0;
-    for (size_t i=0;i<len;i++){
-        unsigned char ch=in[i];
-        switch (tp->state){
-            case 0:
-                if (ch==IAC) tp->state=1;
-                else if (o<outcap) out[o++]=ch;
+/* Negoziazione (RFC 1143, metodo Q): le risposte vanno in txq e partono con un solo write a
+ * fine chunk RX. Dal nodo accettiamo BINARY, ECHO (echo remoto) e SGA; da parte nostra
+ * BINARY, SGA e NAWS. Il resto si rifiuta, e non si risponde mai a uno stato già in vigore. */
+enum { TQ_NO, TQ_YES, TQ_WANTNO, TQ_WANTYES };
+#define TQ_OPP 4                        /* in coda la richiesta opposta */
+static int txbuf_reserve(txbuf_t *b, size_t n);
+static void tx_flush(session_t *s);
+static int wrap_width(void);
+static void tn_put(session_t *s, const unsigned char *p, size_t n){
+    if (!txbuf_reserve(&s->txq, n)) die_cleanup("OOM TX");
+    memcpy(s->txq.buf + s->txq.len, p, n); s->txq.len += n;
+}
+static void tn_reply(session_t *s, unsigned char cmd, unsigned char opt){
+    unsigned char t[3]={IAC, cmd, opt};
+    tn_put(s, t, 3);
+}
+static int tn_supported(int him, unsigned char opt){
+    return him ? (opt==TO_BINARY || opt==TO_ECHO || opt==TO_SGA) : (opt==TO_BINARY || opt==TO_SGA || opt==TO_NAWS);
+}
+static int sess_local_echo(const session_t *s){ return s->opt.local_echo && (s->tn_him[TO_ECHO]&3)!=TQ_YES; }
+/* NAWS: larghezza di wrap (cols-1) e altezza del pane; solo se cambiate. Accoda, non spedisce. */
+static void tn_queue_naws(session_t *s){
+    int w = wrap_width(), h = s->pane_h>0 ? s->pane_h : 1;
+    if ((s->tn_us[TO_NAWS]&3)!=TQ_YES || (w==s->naws_w && h==s->naws_h)) return;
+    unsigned char t[16]; size_t n=0;
+    unsigned char v[4]={ (unsigned char)(w>>8), (unsigned char)w, (unsigned char)(h>>8), (unsigned char)h };
+    t[n++]=IAC; t[n++]=SB; t[n++]=TO_NAWS;
+    for (int i=0;i<4;i++){ t[n++]=v[i]; if (v[i]==IAC) t[n++]=IAC; }
+    t[n++]=IAC; t[n++]=SE;
+    tn_put(s, t, n);
+    s->naws_w=w; s->naws_h=h;
+}
+/* WILL/WONT (opzione del nodo) o DO/DONT (opzione nostra) ricevuto */
+static void tn_recv(session_t *s, unsigned char cmd, unsigned char opt){
+    int him = (cmd==WILL || cmd==WONT), yes = (cmd==WILL || cmd==DO_);
+    unsigned char *q = him ? &s->tn_him[opt] : &s->tn_us[opt];
+    unsigned char pos = him ? DO_ : WILL, neg = him ? DONT : WONT;
+    int st = *q & 3, opp = *q & TQ_OPP;
+    if (yes) switch (st){
+        case TQ_NO:      if (tn_supported(him, opt)){ st=TQ_YES; tn_reply(s, pos, opt); } else tn_reply(s, neg, opt); break;
+        case TQ_WANTNO:  st = opp ? TQ_YES : TQ_NO; opp=0; break;         /* senza coda: errore del nodo */
+        case TQ_WANTYES: if (opp){ st=TQ_WANTNO; opp=0; tn_reply(s, neg, opt); } else st=TQ_YES; break;
+    } else switch (st){
+        case TQ_YES:     st=TQ_NO; tn_reply(s, neg, opt); break;
+        case TQ_WANTNO:  if (opp){ st=TQ_WANTYES; opp=0; tn_reply(s, pos, opt); } else st=TQ_NO; break;
+        case TQ_WANTYES: st=TQ_NO; opp=0; break;
+    }
+    *q = (unsigned char)(st|opp);
+    if (!him && opt==TO_NAWS){ s->naws_w=s->naws_h=0; tn_queue_naws(s); }
+}
+/* ---------- Fast path ASCII (SIMD) ----------
+ * Il traffico dei nodi è quasi tutto ASCII 7 bit: un blocco di soli stampabili 0x20..0x7E
+ * (quindi niente CR/LF/TAB/IAC né byte UTF-8) si allarga a wchar_t in blocco e occupa
+ * esattamente un byte = una colonna. Il resto passa dal decoder byte per byte. */
+static size_t ascii_run(const unsigned char *p, size_t n){
+    size_t i=0;
+#if defined(__AVX2__)
+    {
+        const __m256i lo=_mm256_set1_epi8(0x1F), hi=_mm256_set1_epi8(0x7F);
+        for (; i+32<=n; i+=32){
+            __m256i v=_mm256_loadu_si256((const __m256i*)(p+i));
+            __m256i ok=_mm256_and_si256(_mm256_cmpgt_epi8(v,lo), _mm256_cmpgt_epi8(hi,v));
+            if ((unsigned)_mm256_movemask_epi8(ok)!=0xFFFFFFFFu) break;
+        }
+    }
+#endif
+#if defined(__SSE2__)
+    {
+        /* confronto con segno: i byte >= 0x80 sono negativi e cadono fuori da ]0x1F,0x7F[ */
+        const __m128i lo=_mm_set1_epi8(0x1F), hi=_mm_set1_epi8(0x7F);
+        for (; i+16<=n; i+=16){
+            __m128i v=_mm_loadu_si128((const __m128i*)(p+i));
+            __m128i ok=_mm_and_si128(_mm_cmpgt_epi8(v,lo), _mm_cmplt_epi8(v,hi));
+            if (_mm_movemask_epi8(ok)!=0xFFFF) break;
+        }
+    }
+#elif defined(__ARM_NEON)
+    {
+        const uint8x16_t lo=vdupq_n_u8(0x20), hi=vdupq_n_u8(0x7E);
+        for (; i+16<=n; i+=16){
+            uint8x16_t v=vld1q_u8(p+i);
+            uint64x2_t ok=vreinterpretq_u64_u8(vandq_u8(vcgeq_u8(v,lo), vcleq_u8(v,hi)));
+            if ((vgetq_lane_u64(ok,0) & vgetq_lane_u64(ok,1)) != ~(uint64_t)0) break;
+        }
+    }
+#endif
+    while (i<n && p[i]>=0x20 && p[i]<0x7F) i++;
+    return i;
+}
+static void ascii_widen(wchar_t *dst, const unsigned char *src, size_t n){
+    size_t i=0;
+#if __SIZEOF_WCHAR_T__ == 4
+#if defined(__AVX2__)
+    for (; i+8<=n; i+=8)
+        _mm256_storeu_si256((__m256i*)(dst+i), _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(src+i))));
+#elif defined(__SSE2__)
+    const __m128i z=_mm_setzero_si128();
+    for (; i+16<=n; i+=16){
+        __m128i v=_mm_loadu_si128((const __m128i*)(src+i));
+        __m128i l=_mm_unpacklo_epi8(v,z), h=_mm_unpackhi_epi8(v,z);
+        _mm_storeu_si128((__m128i*)(dst+i),    _mm_unpacklo_epi16(l,z));
+        _mm_storeu_si128((__m128i*)(dst+i+4),  _mm_unpackhi_epi16(l,z));
+        _mm_storeu_si128((__m128i*)(dst+i+8),  _mm_unpacklo_epi16(h,z));
+        _mm_storeu_si128((__m128i*)(dst+i+12), _mm_unpackhi_epi16(h,z));
+    }
+#elif defined(__ARM_NEON)
+    for (; i+16<=n; i+=16){
+        uint8x16_t v=vld1q_u8(src+i);
+        uint16x8_t l=vmovl_u8(vget_low_u8(v)), h=vmovl_u8(vget_high_u8(v));
+        vst1q_u32((uint32_t*)(dst+i),    vmovl_u16(vget_low_u16(l)));
+        vst1q_u32((uint32_t*)(dst+i+4),  vmovl_u16(vget_high_u16(l)));
+        vst1q_u32((uint32_t*)(dst+i+8),  vmovl_u16(vget_low_u16(h)));
+        vst1q_u32((uint32_t*)(dst+i+12), vmovl_u16(vget_high_u16(h)));
+    }
+#endif
+#endif
+    for (; i<n; i++) dst[i]=(wchar_t)src[i];
+}
+/* Larghezza (bit 0-1) e taglio (WC_BRK) per ogni codepoint BMP, da wcwidth/iswpunct una volta
+ * sola dopo setlocale(); fuori BMP (emoji, CJK ext.) si chiede ancora alla libc. ASCII senza tabella. */
+#define WC_BRK 4
+static unsigned char wc_tab[0x10000];
+static int wc_cols_libc(wchar_t ch){
+    int w = wcwidth(ch);
+    return w<0 ? 1 : w>2 ? 2 : w;       /* non stampabili: considerali 1 */
+}
+static void wc_table_init(void){
+    for (unsigned c=0; c<0x10000; c++){
+        if (c>=0xD800 && c<=0xDFFF){ wc_tab[c]=1; continue; }   /* surrogati: mai nel testo decodificato */
+        wc_tab[c] = (unsigned char)(wc_cols_libc((wchar_t)c) | (iswpunct((wint_t)c) ? WC_BRK : 0));
+    }
+}
+static inline int wc_cols(wchar_t ch){
+    if (ch >= 0x20 && ch < 0x7F) return 1;
+    if ((unsigned)ch < 0x10000) return wc_tab[ch] & 3;
+    return wc_cols_libc(ch);
+}
+static inline int wc_is_break(wchar_t ch){
+    if (ch < 0x80) return ch==L' ' || (ch>0x20 && ch<0x7F && !((ch|0x20)>='a' && (ch|0x20)<='z') && !(ch>='0' && ch<='9'));
+    if ((unsigned)ch < 0x10000) return (wc_tab[ch] & WC_BRK) != 0;
+    return iswpunct((wint_t)ch);
+}
+
+/* ---------- Multi-pattern (Aho-Corasick) ----------
+ * DFA completo (niente salti di fail a runtime) su un alfabeto compresso: i byte che non
+ * compaiono in nessun pattern condividono la classe 0, così la tabella è stati x classi.
+ * Con nocase le maiuscole ASCII hanno la classe delle minuscole. */
+struct ac_s {
+    int ncls, nstates;
+    unsigned char cls[256];
+    int *delta;                         /* nstates*ncls */
+    int *out_off, *out_ids;             /* pattern riconosciuti entrando in ogni stato (CSR) */
+};
+static inline int ac_step(const ac_t *a, int st, unsigned char c){ return a->delta[st*a->ncls + a->cls[c]]; }
+static inline unsigned char ac_fold(unsigned char c, int nocase){ return (nocase && c>='A' && c<='Z') ? (unsigned char)(c+32) : c; }
+static int ac_build(ac_t *a, const char *const *pats, int n, int nocase){
+    memset(a, 0, sizeof *a);
+    size_t total=1;
+    a->ncls=1;
+    for (int i=0;i<n;i++) for (const unsigned char *p=(const unsigned char*)pats[i]; *p; p++){
+        unsigned char c=ac_fold(*p, nocase);
+        if (!a->cls[c]){ if (a->ncls==256) return -1; a->cls[c]=(unsigned char)a->ncls++; }
+        total++;
+    }
+    if (nocase) for (int c='A'; c<='Z'; c++) a->cls[c]=a->cls[c+32];
+    int ncls=a->ncls, nst=1;
+    int *delta=(int*)malloc(sizeof(int)*total*(size_t)ncls), *fail=(int*)calloc(total, sizeof(int));
+    int *order=(int*)malloc(sizeof(int)*total), *own=(int*)malloc(sizeof(int)*(size_t)(n>0?n:1)), *cnt=(int*)calloc(total+1, sizeof(int));
+    if (!delta || !fail || !order || !own || !cnt){ free(delta); free(fail); free(order); free(own); free(cnt); return -1; }
+    for (size_t i=0;i<total*(size_t)ncls;i++) delta[i]=-1;
+    /* trie */
+    for (int i=0;i<n;i++){
+        int st=0;
+        for (const unsigned char *p=(const unsigned char*)pats[i]; *p; p++){
+            int *d=&delta[st*ncls + a->cls[ac_fold(*p, nocase)]];
+            if (*d<0) *d=nst++;
+            st=*d;
+        }
+        own[i]=st; cnt[st]++;
+    }
+    /* BFS: link di fail e transizioni mancanti prese dallo stato di fail */
+    int qh=0, qt=0;
+    order[qt++]=0;
+    for (int c=0;c<ncls;c++){ int v=delta[c]; if (v<0) delta[c]=0; else { fail[v]=0; order[qt++]=v; } }
+    for (qh=1; qh<qt; qh++){
+        int u=order[qh];
+        for (int c=0;c<ncls;c++){
+            int v=delta[u*ncls+c];
+            if (v<0) delta[u*ncls+c]=delta[fail[u]*ncls+c];
+            else { fail[v]=delta[fail[u]*ncls+c]; order[qt++]=v; }
+        }
+    }
+    /* uscite: proprie + quelle dello stato di fail (già complete, in ordine BFS) */
+    int *tot=(int*)calloc((size_t)nst, sizeof(int));
+    a->out_off=(int*)malloc(sizeof(int)*(size_t)(nst+1));
+    if (!tot || !a->out_off){ free(delta); free(fail); free(order); free(own); free(cnt); free(tot); return -1; }
+    for (int k=0;k<qt;k++){ int v=order[k]; tot[v] = cnt[v] + (v ? tot[fail[v]] : 0); }
+    a->out_off[0]=0;
+    for (int v=0; v<nst; v++) a->out_off[v+1]=a->out_off[v]+tot[v];
+    a->out_ids=(int*)malloc(sizeof(int)*(size_t)(a->out_off[nst]>0?a->out_off[nst]:1));
+    if (!a->out_ids){ free(delta); free(fail); free(order); free(own); free(cnt); free(tot); return -1; }
+    for (int k=0;k<qt;k++){
+        int v=order[k], o=a->out_off[v];
+        for (int i=0;i<n;i++) if (own[i]==v) a->out_ids[o++]=i;
+        if (v) for (int j=a->out_off[fail[v]]; j<a->out_off[fail[v]+1]; j++) a->out_ids[o++]=a->out_ids[j];
+    }
+    a->nstates=nst;
+    a->delta=(int*)realloc(delta, sizeof(int)*(size_t)nst*(size_t)ncls);
+    if (!a->delta) a->delta=delta;
+    free(fail); free(order); free(own); free(cnt); free(tot);
+    return 0;
+}
+static void ac_free(ac_t *a){ free(a->delta); free(a->out_off); free(a->out_ids); memset(a, 0, sizeof *a); }
+
+/* Prompt riconosciuti sul flusso RX (senza distinzione maiuscole/minuscole) */
+enum { PK_LOGIN, PK_PASS, PK_UNLOCK, PK_7PLUS };
+static const char *const prompt_pats[] = {
+    "login:", "user:", "callsign:",
+    "password:", "pass:", "pw:", "enter password",
+    "} ", "> ", "# ", ": ", "connected to bbs",
+    " go_7+.",
+};
+static const unsigned char prompt_kind[] = {
+    PK_LOGIN, PK_LOGIN, PK_LOGIN,
+    PK_PASS, PK_PASS, PK_PASS, PK_PASS,
+    PK_UNLOCK, PK_UNLOCK, PK_UNLOCK, PK_UNLOCK, PK_UNLOCK,
+    PK_7PLUS,
+};
+static ac_t ac_prompt;
+static void prompt_matcher_free(void){ ac_free(&ac_prompt); }
+
+static void send_line_utf8_telnet_safe(session_t *s, const char*p);
+static size_t utf8_put(unsigned char *o, wchar_t wc);
+static size_t utf8_decode_buf(const unsigned char *p, size_t n, wbuf_t *b);
+static ssize_t write_all(int fd, const void *buf, size_t len);
+static void sess_prompt_hit(session_t *s, int kind){
+    autologin_prompt_t *al = &s->alp;
+    if (kind==PK_LOGIN && al->enabled && al->state==0){
+        send_line_utf8_telnet_safe(s, al->user); al->state=1;
+    } else if (kind==PK_PASS && al->enabled && al->state==1){
+        send_line_utf8_telnet_safe(s, al->pass); al->state=2;
+        s->login_done_flag=1; clock_gettime(CLOCK_MONOTONIC,&s->t_login_done);
+    } else if (kind==PK_UNLOCK && s->input_locked && s->unlock_armed){
+        s->unlock_seen=1;
+    } else if (kind==PK_UNLOCK && s->up.wait_prompt){
+        s->up.wait_prompt=0;            /* --pace-prompt: via alla prossima riga */
+    } else if (kind==PK_7PLUS && s->xf.mode==XF_NONE){
+        s->xf.pend7=1;                  /* x7_begin controlla che sia a inizio riga */
+    }
+}
+
+/* ---------- Trigger ---------- */
+static void trig_free(trigset_t *t){
+    if (!t) return;
+    for (int i=0;i<t->n;i++){
+        free(t->r[i].pat); free(t->r[i].arg);
+        if (t->r[i].log_fd>=0) close(t->r[i].log_fd);
+        if (t->r[i].kind==TR_RE) regfree(&t->r[i].re);
+    }
+    if (t->ac){ ac_free(t->ac); free(t->ac); }
+    free(t->r); free(t->ac_rule); free(t->u8); free(t);
+}
+/* Letterale più lungo che ogni match della regex deve contenere ("" = nessuno sicuro):
+ * solo caratteri fuori da gruppi, non seguiti da ?, * o {; con | o [ non si rischia */
+static char *re_required_literal(const char *re){
+    size_t n=strlen(re), best=0, cur=0;
+    char *buf=(char*)malloc(n+1), *out=(char*)malloc(n+1);
+    if (!buf || !out){ free(buf); free(out); return NULL; }
+    if (strchr(re, '|')){ out[0]='\0'; free(buf); return out; }
+    int depth=0;
+    for (size_t i=0;i<n;i++){
+        unsigned char c=(unsigned char)re[i], lit=0; int is_lit=0;
+        if (c=='\\' && i+1<n && !isalnum((unsigned char)re[i+1])){ lit=(unsigned char)re[++i]; is_lit=1; }
+        else if (c=='\\'){ i++; }
+        else if (c=='('){ depth++; }
+        else if (c==')'){ if (depth) depth--; }
+        else if (c=='['){ best=0; break; }   /* classi ([]a], [^]a] ...): nessun letterale sicuro */
+        else if (strchr(".^$*+?{}", c)==NULL){ lit=c; is_lit=1; }
+        int opt = i+1<n && (re[i+1]=='?' || re[i+1]=='*' || re[i+1]=='{');
+        if (is_lit && depth==0 && !opt){ buf[cur++]=(char)lit; if (cur>best){ best=cur; memcpy(out, buf, cur); out[cur]='\0'; } }
+        else cur=0;             /* anche '+': il carattere prima resta, la sequenza si interrompe */
+    }
+    if (!best) out[0]='\0';
+    free(buf);
+    return out;
+}
+/* Pattern per l'automa come lo vede il flusso: UTF-8 con i non ASCII in minuscolo (l'ASCII lo piega l'automa) */
+static char *trig_fold(const char *p){
+    wbuf_t wb = {0};
+    size_t n = utf8_decode_buf((const unsigned char*)p, strlen(p), &wb), o=0;
+    char *out = (char*)malloc(4*n+1);
+    if (out) for (size_t i=0;i<n;i++) o += utf8_put((unsigned char*)out+o, wb.buf[i]>=0x80 ? (wchar_t)towlower((wint_t)wb.buf[i]) : wb.buf[i]);
+    if (out) out[o]='\0';
+    free(wb.buf);
+    return out;
+}
+/* Formato: <lit|re> <pattern> => <send|beep|highlight|log|exec> [argomento]
+ * Maiuscole/minuscole indifferenti. '#' a inizio riga = commento. */
+static trigset_t *trig_load(const char *path){
+    FILE *f = fopen(path, "re");
+    if (!f){ fprintf(stderr, "triggers %s: %s\n", path, strerror(errno)); return NULL; }
+    trigset_t *t = (trigset_t*)calloc(1, sizeof(*t));
+    char line[2048]; int lineno=0, cap=0, npre=0;
+    const char **pats=NULL;
+    if (!t) goto oom;
+    while (fgets(line, sizeof line, f)){
+        lineno++;
+        line[strcspn(line, "\r\n")]='\0';
+        char *p=line; while (*p==' '||*p=='\t') p++;
+        if (!*p || *p=='#') continue;
+        char *sep = strstr(p, " => ");
+        int kind = !strncmp(p, "lit ", 4) ? TR_LIT : !strncmp(p, "re ", 3) ? TR_RE : -1;
+        if (kind<0 || !sep){ fprintf(stderr, "triggers %s:%d: atteso \"<lit|re> PATTERN => AZIONE [ARG]\"\n", path, lineno); goto fail; }
+        char *pat = p + (kind==TR_LIT ? 4 : 3); *sep='\0';
+        char *act = sep+4, *arg = act + strcspn(act, " \t");
+        if (*arg){ *arg++='\0'; while (*arg==' '||*arg=='\t') arg++; }
+        static const char *const names[] = { "send", "beep", "highlight", "log", "exec" };
+        int a=-1;
+        for (int k=0;k<5;k++) if (!strcmp(act, names[k])) a=k;
+        if (a<0 || !*pat || ((a==TA_LOG || a==TA_EXEC) && !*arg)){ fprintf(stderr, "triggers %s:%d: azione o argomento non validi\n", path, lineno); goto fail; }
+        if (t->n==cap){
+            cap = cap ? cap*2 : 8;
+            trigger_t *nr = (trigger_t*)realloc(t->r, sizeof(*nr)*(size_t)cap);
+            if (!nr) goto oom;
+            t->r=nr;
+        }
+        trigger_t *r = &t->r[t->n]; memset(r, 0, sizeof *r);
+        r->kind=kind; r->action=a; r->log_fd=-1;
+        r->pat=strdup(pat); r->arg=strdup(arg);
+        if (!r->pat || !r->arg){ free(r->pat); free(r->arg); goto oom; }
+        if (kind==TR_RE){
+            int e = regcomp(&r->re, pat, REG_EXTENDED|REG_ICASE|REG_NOSUB);
+            if (e){ char msg[256]; regerror(e, &r->re, msg, sizeof msg); fprintf(stderr, "triggers %s:%d: %s\n", path, lineno, msg); free(r->pat); free(r->arg); goto fail; }
+        }
+        if (a==TA_LOG){
+            r->log_fd = open(arg, O_WRONLY|O_CREAT|O_APPEND|O_CLOEXEC, 0644);
+            if (r->log_fd<0){ fprintf(stderr, "triggers %s:%d: %s: %s\n", path, lineno, arg, strerror(errno)); t->n++; goto fail; }
+        }
+        if (a==TA_EXEC) signal(SIGCHLD, SIG_IGN);   /* niente zombie dei comandi lanciati */
+        t->n++;
+    }
+    fclose(f); f=NULL;
+    /* automa: letterali delle regole lit e letterali obbligatori delle regex */
+    pats = (const char**)calloc((size_t)(t->n>0?t->n:1), sizeof(*pats));
+    t->ac_rule = (int*)calloc((size_t)(t->n>0?t->n:1), sizeof(int));
+    t->ac = (ac_t*)calloc(1, sizeof(ac_t));
+    if (!pats || !t->ac_rule || !t->ac) goto oom;
+    for (int i=0;i<t->n;i++){
+        trigger_t *r=&t->r[i];
+        const char *lit = r->pat;
+        char *req = NULL;
+        if (r->kind==TR_RE){ req = re_required_literal(r->pat); if (!req) goto oom; lit = req; }
+        if (*lit){
+            char *f = trig_fold(lit); free(req);
+            if (!f) goto oom;
+            pats[npre]=f; t->ac_rule[npre++]=i; r->has_pre = (r->kind==TR_RE);
+        }
+        else free(req);
+    }
+    int e = ac_build(t->ac, pats, npre, 1);
+    for (int i=0;i<npre;i++) free((char*)pats[i]);
+    if (e<0){ npre=0; goto oom; }
+    free(pats);
+    return t;
+oom:
+    fprintf(stderr, "triggers %s: OOM\n", path);
+fail:
+    if (f) fclose(f);
+    for (int i=0;i<npre;i++) free((char*)pats[i]);
+    free(pats);
+    trig_free(t);
+    return NULL;
+}
+extern char **environ;
+/* "NOME=valore" in un blocco nuovo; NULL se manca memoria */
+static char *env_pair(const char *name, const char *val){
+    size_t n = strlen(name) + strlen(val) + 2;
+    char *e = (char*)malloc(n);
+    if (e) snprintf(e, n, "%s=%s", name, val);
+    return e;
+}
+/* Al comando non resta nessun fd nostro: sono tutti FD_CLOEXEC, e il figlio chiude comunque
+ * fino al limite RLIMIT_NOFILE. Limite e ambiente (BPQ_LINE/HOST/PORT + environ) si preparano
+ * prima della fork: con gli altri thread vivi, nel figlio solo syscall, niente malloc */
+static void trig_exec(session_t *s, const char *cmd, const char *line){
+    struct rlimit rl; int maxfd = 1024;
+    if (getrlimit(RLIMIT_NOFILE, &rl)==0) maxfd = (rl.rlim_cur==RLIM_INFINITY || rl.rlim_cur > (1u<<20)) ? (1<<20) : (int)rl.rlim_cur;
+    size_t ne=0;
+    while (environ && environ[ne]) ne++;
+    char **envp = (char**)malloc((ne+4)*sizeof(char*));
+    if (!envp) return;
+    size_t k=0;
+    char *own[3] = { env_pair("BPQ_LINE", line), env_pair("BPQ_HOST", s->host), env_pair("BPQ_PORT", s->port) };
+    if (!own[0] || !own[1] || !own[2]) goto out;
+    for (int i=0;i<3;i++) envp[k++]=own[i];
+    for (size_t i=0;i<ne;i++)
+        if (strncmp(environ[i], "BPQ_LINE=", 9) && strncmp(environ[i], "BPQ_HOST=", 9) && strncmp(environ[i], "BPQ_PORT=", 9)) envp[k++]=environ[i];
+    envp[k]=NULL;
+    char *argv[] = { "sh", "-c", (char*)cmd, NULL };
+    pid_t pid = fork();
+    if (pid==0){
+        int nul = open("/dev/null", O_RDWR);
+        if (nul>=0){ dup2(nul, 0); dup2(nul, 1); dup2(nul, 2); }
+        for (int fd=3; fd<maxfd; fd++) close(fd);
+        setsid();
+        signal(SIGPIPE, SIG_DFL); signal(SIGTSTP, SIG_DFL); signal(SIGCHLD, SIG_DFL);
+        execve("/bin/sh", argv, envp);
+        _exit(127);
+    }
+out:                                    /* padre (o fork fallita): si prosegue */
+    for (int i=0;i<3;i++) free(own[i]);
+    free(envp);
+}
+/* Letterale completato nel flusso: send/beep subito (funziona anche sui prompt senza '\n'),
+ * il resto a fine riga; una volta per riga per regola */
+static void trig_hit(session_t *s, int rule){
+    trigger_t *r = &s->trig->r[rule];
+    if (s->tr_hit[rule]) return;
+    s->tr_hit[rule]=1;
+    if (r->kind!=TR_LIT) return;
+    if (r->action==TA_SEND) send_line_utf8_telnet_safe(s, r->arg);
+    else if (r->action==TA_BEEP) beep();
+}
+static int add_line_hl(session_t *s);
+/* Fine riga: regex candidate + azioni che vogliono la riga intera */
+static void trig_line_end(session_t *s, const wchar_t *line, size_t len){
+    trigset_t *t = s->trig;
+    int have_u8=0;
+    for (int i=0;i<t->n;i++){
+        trigger_t *r = &t->r[i];
+        int fire = s->tr_hit[i];
+        s->tr_hit[i]=0;
+        if (r->kind==TR_LIT ? !fire : (r->has_pre && !fire)) continue;
+        if (!have_u8){
+            if (4*len+2 > t->u8cap){
+                size_t nc = 4*len+2 > 4096 ? 4*len+2 : 4096;
+                unsigned char *nb = (unsigned char*)realloc(t->u8, nc);
+                if (!nb) return;
+                t->u8=nb; t->u8cap=nc;
+            }
+            size_t o=0;
+            for (size_t k=0;k<len;k++) o += utf8_put(t->u8+o, line[k]);
+            t->u8[o]='\0'; have_u8=(int)o+1;
+        }
+        unsigned char *u8 = t->u8;
+        if (r->kind==TR_RE){
+            if (regexec(&r->re, (const char*)u8, 0, NULL, 0)!=0) continue;
+            if (r->action==TA_SEND) send_line_utf8_telnet_safe(s, r->arg);
+            else if (r->action==TA_BEEP) beep();
+        }
+        if (r->action==TA_HIGHLIGHT) add_line_hl(s);
+        else if (r->action==TA_LOG){
+            u8[have_u8-1]='\n';
+            if (write_all(r->log_fd, u8, (size_t)have_u8)<0){ /* log non scrivibile: la regola resta */ }
+            u8[have_u8-1]='\0';
+        }
+        else if (r->action==TA_EXEC) trig_exec(s, r->arg, (const char*)u8);
+    }
+}
+
+/* Prompt: sui byte del flusso (senza telnet né ESC) */
+static inline void sess_ac_byte(session_t *s, unsigned char c){
+    int st = s->ac_st = ac_step(&ac_prompt, s->ac_st, c);
+    for (int j=ac_prompt.out_off[st]; j<ac_prompt.out_off[st+1]; j++) sess_prompt_hit(s, prompt_kind[ac_prompt.out_ids[j]]);
+}
+/* Trigger: sul testo decodificato che finisce nella riga, come lo vede la regex (SGR tolti,
+ * TAB espansi, non ASCII in minuscolo in UTF-8 come i pattern di trig_fold) */
+static inline void trig_ac_byte(session_t *s, unsigned char c){
+    const ac_t *a = s->trig->ac;
+    int st = s->trig_st = ac_step(a, s->trig_st, c);
+    for (int j=a->out_off[st]; j<a->out_off[st+1]; j++) trig_hit(s, s->trig->ac_rule[a->out_ids[j]]);
+}
+static void trig_ac_wc(session_t *s, wchar_t wc){
+    unsigned char b[4];
+    if (wc < 0x80){ trig_ac_byte(s, (unsigned char)wc); return; }
+    size_t n = utf8_put(b, (wchar_t)towlower((wint_t)wc));
+    for (size_t i=0;i<n;i++) trig_ac_byte(s, b[i]);
+}
+
+/* ---------- RX: decoder a passata unica ---------- */
+static void add_logical_line(session_t *s, const wchar_t *txt, size_t len, int colw, int narrow, int follow, const sgr_run_t *runs, size_t nruns);
+static void rx_put_wc(session_t *s, wchar_t wc){
+    rx_dec_t *d = &s->rx;
+    int w = 1;
+    if (wc==L'\t'){
+        /* TAB -> spazi fino al prossimo tabstop (colonne visuali) */
+        w = ((d->col/TABSTOP)+1)*TABSTOP - d->col;
+        if (!wbuf_reserve(&d->ln, d->len + (size_t)w)) die_cleanup("OOM RX");
+        for (int k=0;k<w;k++) d->ln.buf[d->len++]=L' ';
+        d->col += w;
+        if (s->trig) for (int k=0;k<w;k++) trig_ac_byte(s, ' ');
+        return;
+    }
+    if (s->trig) trig_ac_wc(s, wc);
+    w = wc_cols(wc);
+    if (w!=1) d->wide=1;
+    if (!wbuf_reserve(&d->ln, d->len + 1)) die_cleanup("OOM RX");
+    d->ln.buf[d->len++] = wc;
+    d->col += w;
+}
+/* ---------- Trasferimenti (YAPP, 7plus, cattura) ---------- */
+static void xfer_flush(session_t *s){
+    xfer_t *x = &s->xf;
+    if (!x->len) return;
+    if (x->fd>=0 && write_all(x->fd, x->buf, x->len)<0){ x->len=0; xfer_stop(s, strerror(errno)); return; }
+    x->len=0;
+}
+static void xfer_put(session_t *s, const unsigned char *p, size_t n){
+    xfer_t *x = &s->xf;
+    x->bytes += n;
+    if (x->len + n > XFER_BUF){ xfer_flush(s); if (!x->mode) return; }
+    if (n >= XFER_BUF){ if (write_all(x->fd, p, n)<0) xfer_stop(s, strerror(errno)); return; }
+    memcpy(x->buf + x->len, p, n); x->len += n;
+}
+/* Crea <dir>/<name> senza sovrascrivere (name, name.1, name.2 ...); name senza '/' */
+static int xfer_open(session_t *s, const char *name){
+    xfer_t *x = &s->xf;
+    const char *dir = s->opt.capture_dir ? s->opt.capture_dir : s->opt.log_dir ? s->opt.log_dir : ".";
+    if (!x->buf && !(x->buf = (unsigned char*)malloc(XFER_BUF))) return -1;
+    for (int k=0;k<1000;k++){
+        if (k) snprintf(x->path, sizeof x->path, "%s/%s.%d", dir, name, k);
+        else snprintf(x->path, sizeof x->path, "%s/%s", dir, name);
+        x->fd = open(x->path, O_WRONLY|O_CREAT|O_EXCL|O_CLOEXEC, 0644);
+        if (x->fd>=0 || errno!=EEXIST) break;
+    }
+    if (x->fd<0) return -1;
+    x->len=0; x->bytes=0; x->total=0; x->stop_st=0; x->stop_seen=0;
+    clock_gettime(CLOCK_MONOTONIC, &x->t0);
+    return 0;
+}
+static void xfer_note(session_t *s, const char *fmt, ...){
+    char msg[700]; wchar_t wmsg[800];
+    va_list ap; va_start(ap, fmt); vsnprintf(msg, sizeof msg, fmt, ap); va_end(ap);
+    swprintf(wmsg, sizeof(wmsg)/sizeof(wmsg[0]), L"*** %s", msg);
+    add_logical_line_w(s, wmsg, is_following(s));
+}
+/* Nome file per 7plus e cattura: host_port_AAAAMMGG-HHMMSS.ext */
+static void xfer_auto_name(const session_t *s, char *out, size_t n, const char *ext){
+    char ts[32]; time_t t=time(NULL); struct tm tm; localtime_r(&t, &tm);
+    strftime(ts, sizeof ts, "%Y%m%d-%H%M%S", &tm);
+    snprintf(out, n, "%s_%s_%s.%s", s->host, s->port, ts, ext);
+    for (char *p=out; *p; p++) if (*p=='/' || *p==':') *p='_';
+}
+static void xfer_start(session_t *s, int mode, const char *name){
+    const char *what = mode==XF_RAW ? "cattura" : mode==XF_7PLUS ? "7plus" : "YAPP";
+    if (xfer_open(s, name)<0){ xfer_note(s, "%s: %s/%s: %s", what, s->opt.capture_dir ? s->opt.capture_dir : ".", name, strerror(errno)); return; }
+    s->xf.mode=mode; s->xf.cr=0;
+    xfer_note(s, "%s su %s", what, s->xf.path);
+    ui_draw_status();
+}
+/* Chiude il file; why=NULL: chiusura regolare (o uscita dal programma, senza messaggi) */
+static void xfer_stop(session_t *s, const char *why){
+    xfer_t *x = &s->xf;
+    int mode = x->mode;
+    x->mode=XF_NONE;                    /* prima del flush: un errore di scrittura non rientra qui */
+    if (x->len && x->fd>=0 && write_all(x->fd, x->buf, x->len)<0 && !why) why=strerror(errno);
+    x->len=0;
+    if (x->fd>=0){ close(x->fd); x->fd=-1; }
+    if (!win_in) return;                /* die_cleanup: niente UI */
+    struct timespec now; clock_gettime(CLOCK_MONOTONIC,&now);
+    double secs = since_ms(x->t0, now)/1000.0;
+    const char *what = mode==XF_RAW ? "cattura" : mode==XF_7PLUS ? "7plus" : "YAPP";
+    if (why) xfer_note(s, "%s %s (%s): %s, %llu byte", what, mode==XF_RAW ? "interrotta" : "interrotto", why, x->path, (unsigned long long)x->bytes);
+    else xfer_note(s, "%s %s: %s, %llu byte in %.1f s", what, mode==XF_RAW ? "chiusa" : "completato", x->path, (unsigned long long)x->bytes, secs);
+    ui_draw_status();
+}
+/* YAPP in ricezione (SI/RR, HD/RF, DT, EF/AF, ET/AT; CAN/NAK interrompono). Senza checksum
+ * YAPP-C: all'header rispondiamo RF semplice. Le risposte vanno in txq (flush a fine chunk). */
+enum { Y_ACK=0x06, Y_ENQ=0x05, Y_SOH=0x01, Y_STX=0x02, Y_ETX=0x03, Y_EOT=0x04, Y_NAK=0x15, Y_CAN=0x18 };
+static void yapp_reply(session_t *s, unsigned char a, unsigned char b){ unsigned char t[2]={a,b}; tn_put(s, t, 2); }
+static void yapp_begin(session_t *s){
+    xfer_t *x = &s->xf;
+    x->mode=XF_YAPP; x->fd=-1; x->path[0]='\0'; x->bytes=0; x->total=0;
+    x->ystate=Y_TYPE;
+    clock_gettime(CLOCK_MONOTONIC, &x->t0);
+    yapp_reply(s, Y_ACK, 0x01);         /* RR */
+    ui_draw_status();
+}
+static void yapp_abort(session_t *s, const char *why){
+    static const char msg[] = "annullato";
+    unsigned char t[2+sizeof msg]={ Y_CAN, (unsigned char)(sizeof msg - 1) };
+    memcpy(t+2, msg, sizeof msg - 1);
+    tn_put(s, t, sizeof t - 1);
+    if (s->xf.fd>=0) xfer_stop(s, why);
+    else { s->xf.mode=XF_NONE; xfer_note(s, "YAPP interrotto (%s)", why); ui_draw_status(); }
+}
+static void yapp_packet(session_t *s){
+    xfer_t *x = &s->xf;
+    if (x->ytype==Y_SOH){
+        /* header: nome\0 dimensione\0 [data/ora]; del nome si tiene solo la parte dopo l'ultimo / o \ */
+        char name[256]; int n=0;
+        while (n<x->ylen && x->ybody[n] && n<255){ name[n]=(char)x->ybody[n]; n++; }
+        name[n]='\0';
+        const char *base = name;
+        for (char *p=name; *p; p++) if (*p=='/' || *p=='\\') base=p+1;
+        if (!*base || !strcmp(base, ".") || !strcmp(base, "..")) base="yapp.bin";
+        uint64_t total = (n+1<x->ylen) ? strtoull((const char*)x->ybody+n+1, NULL, 10) : 0;
+        if (x->fd>=0){ close(x->fd); x->fd=-1; }
+        if (xfer_open(s, base)<0){ yapp_abort(s, strerror(errno)); return; }
+        x->mode=XF_YAPP; x->total=total;
+        yapp_reply(s, Y_ACK, 0x02);     /* RF */
+        xfer_note(s, "YAPP su %s (%llu byte)", x->path, (unsigned long long)total);
+    } else if (x->ytype==Y_NAK || x->ytype==Y_CAN){
+        char why[260]; int n = x->ylen < 255 ? x->ylen : 255;
+        memcpy(why, x->ybody, (size_t)n); why[n]='\0';
+        if (x->fd>=0) xfer_stop(s, n ? why : "annullato dal nodo");
+        else { x->mode=XF_NONE; xfer_note(s, "YAPP interrotto dal nodo: %s", why); }
+    }
+    ui_draw_status();
+}
+static size_t yapp_data(session_t *s, const unsigned char *p, size_t n){
+    xfer_t *x = &s->xf;
+    size_t i=0;
+    while (i<n && x->mode==XF_YAPP){
+        unsigned char c=p[i];
+        switch (x->ystate){
+            case Y_TYPE:
+                x->ytype=c; i++;
+                if (c==Y_SOH || c==Y_STX || c==Y_NAK || c==Y_CAN) x->ystate=Y_LEN;
+                else if (c==Y_ETX || c==Y_EOT || c==Y_ENQ) x->ystate=Y_ARG;
+                else { yapp_abort(s, "pacchetto sconosciuto"); return i; }
                 break;
-            case 1:
-                tp->cmd=ch;
-                if (ch==IAC){ if (o<outcap) out[o++]=IAC; tp->state=0; }
-                else if (ch==DO_||ch==DONT||ch==WILL||ch==WONT) tp->state=2;
-                else if (ch==SB) tp->state=3;
-                else if (ch==SE) tp->state=0;
-                else tp->state=0;
+            case Y_LEN:
+                x->yneed = c ? c : 256; x->ylen=0; i++;
+                x->ystate=Y_BODY;
+                if (x->ytype==Y_STX && x->fd<0){ yapp_abort(s, "dati senza header"); return i; }
+                break;
+            case Y_BODY: {
+                size_t k = n-i < (size_t)x->yneed ? n-i : (size_t)x->yneed;
+                if (x->ytype==Y_STX) xfer_put(s, p+i, k);                       /* dati: dritti nel buffer */
+                else { size_t room = sizeof x->ybody - (size_t)x->ylen; memcpy(x->ybody + x->ylen, p+i, k<room?k:room); }
+                x->ylen += (int)k; x->yneed -= (int)k; i += k;
+                if (x->yneed==0){ x->ystate=Y_TYPE; if (x->ytype!=Y_STX) yapp_packet(s); }
                 break;
-            case 2:{
-                unsigned char opt=ch;
-                if (tp->cmd==DO_) telnet_send3(IAC,WONT,opt);
-                else if (tp->cmd==WILL) telnet_send3(IAC,DONT,opt);
-                tp->state=0; break;
             }
-            case 3: if (ch==IAC) tp->state=4; break;
-            case 4: if (ch==SE) tp->state=0; else tp->state=3; break;
+            case Y_ARG:
+                i++; x->ystate=Y_TYPE;
+                if (x->ytype==Y_ENQ) yapp_reply(s, Y_ACK, 0x01);                 /* SI ripetuto */
+                else if (x->ytype==Y_ETX){ yapp_reply(s, Y_ACK, 0x03); if (x->fd>=0){ xfer_stop(s, NULL); x->mode=XF_YAPP; x->ystate=Y_TYPE; } }
+                else { yapp_reply(s, Y_ACK, 0x04); x->mode=XF_NONE; ui_draw_status(); }   /* ET: fine sessione */
+                break;
         }
     }
-    return o;
+    return i;
+}
+/* 7plus: il file va da " go_7+." a fine della riga con "stop_7+." (CR/LF del nodo compresi) */
+static size_t x7_data(session_t *s, const unsigned char *p, size_t n){
+    static const char stop[] = "stop_7+.";
+    xfer_t *x = &s->xf;
+    for (size_t i=0;i<n;i++){
+        unsigned char c=p[i];
+        if (x->stop_seen && (c=='\r' || c=='\n')){
+            xfer_put(s, p, i+1);
+            /* l'LF di un CRLF finale arriva come riga vuota: il decoder lo unisce al CR */
+            s->rx.cr = (c=='\r');
+            xfer_stop(s, NULL);
+            return i+1;
+        }
+        if (!x->stop_seen){
+            x->stop_st = (c==(unsigned char)stop[x->stop_st]) ? x->stop_st+1 : (c==(unsigned char)stop[0]);
+            if (x->stop_st==(int)sizeof stop - 1) x->stop_seen=1;
+        }
+    }
+    xfer_put(s, p, n);
+    return n;
+}
+/* Byte RX (già senza telnet) durante un trasferimento: ritorna quanti ne ha presi */
+static size_t xfer_data(session_t *s, const unsigned char *p, size_t n){
+    if (s->xf.mode==XF_YAPP) return yapp_data(s, p, n);
+    if (s->xf.mode==XF_7PLUS) return x7_data(s, p, n);
+    xfer_put(s, p, n);
+    return n;
+}
+/* Visto " go_7+." a inizio riga: la riga in costruzione (ASCII) apre il file */
+static void x7_begin(session_t *s){
+    rx_dec_t *d = &s->rx;
+    char name[300];
+    s->xf.pend7=0;
+    if (d->len<7 || wcsncmp(d->ln.buf, L" go_7+.", 7)) return;
+    xfer_auto_name(s, name, sizeof name, "7pl");
+    xfer_start(s, XF_7PLUS, name);
+    if (s->xf.mode!=XF_7PLUS) return;
+    for (size_t i=0;i<d->len;i++){ unsigned char c=(unsigned char)(d->ln.buf[i]<256 ? d->ln.buf[i] : '?'); x7_data(s, &c, 1); }
+    d->len=0; d->col=0; d->wide=0;
+}
+static void xfer_status(const session_t *s){
+    const xfer_t *x = &s->xf;
+    struct timespec now; clock_gettime(CLOCK_MONOTONIC,&now);
+    long ms = since_ms(x->t0, now);
+    double kbs = ms>0 ? x->bytes/1.024/(double)ms : 0.0;
+    const char *what = x->mode==XF_RAW ? "Cattura" : x->mode==XF_7PLUS ? "7plus" : "YAPP";
+    if (x->total) mvwprintw(win_status, 0, 0, "%s %s: %llu/%llu byte (%d%%), %.1f KB/s. F5: interrompi", what, x->path,
+                            (unsigned long long)x->bytes, (unsigned long long)x->total, (int)(x->bytes*100/x->total), kbs);
+    else mvwprintw(win_status, 0, 0, "%s %s: %llu byte, %.1f KB/s. F5: %s", what, x->path[0] ? x->path : "(attesa header)",
+                   (unsigned long long)x->bytes, kbs, x->mode==XF_RAW ? "chiudi" : "interrompi");
 }
 
-/* ---------- RX newline normalize ---------- */
-static size_t normalize_incoming(const unsigned char *in,size_t len,unsigned char *out,size_t outcap){
-    size_t o=0;
+/* ---------- ANSI SGR ----------
+ * I colori si riducono ai 16 ANSI: 256 colori e truecolor al più vicino dei base (bright se chiaro). */
+static void sgr_mark(rx_dec_t *d){
+    if (d->nruns && d->runs[d->nruns-1].at == d->len){ d->runs[d->nruns-1].attr = d->attr; }
+    else {
+        if (d->nruns && d->runs[d->nruns-1].attr == d->attr) return;
+        if (!d->nruns && !d->attr) return;
+        if (d->nruns == d->rcap){
+            size_t nc = d->rcap ? d->rcap*2 : 8;
+            sgr_run_t *t = (sgr_run_t*)realloc(d->runs, nc*sizeof(sgr_run_t)); n_allocs++;
+            if (!t) return;
+            d->runs=t; d->rcap=nc;
+        }
+        d->runs[d->nruns].at = (uint32_t)d->len; d->runs[d->nruns].attr = d->attr; d->runs[d->nruns].pad = 0;
+        d->nruns++;
+    }
+    if (d->nruns==1 && d->runs[0].at==0 && !d->runs[0].attr) d->nruns=0;   /* solo default da capo */
+}
+static unsigned sgr_rgb16(unsigned r, unsigned g, unsigned b){
+    unsigned c = (r>=128 ? 1 : 0) | (g>=128 ? 2 : 0) | (b>=128 ? 4 : 0);
+    unsigned hi = r>g ? (r>b ? r : b) : (g>b ? g : b);
+    return c | ((hi>=192 || (c==0 && hi>=64)) ? 8 : 0);
+}
+static unsigned sgr_256(unsigned n){
+    if (n<16) return n;
+    if (n>=232){ unsigned v = 8 + (n-232)*10; return v<64 ? 0 : v<128 ? 8 : v<192 ? 7 : 15; }
+    n -= 16;
+    static const unsigned char lv[6] = {0, 95, 135, 175, 215, 255};
+    return sgr_rgb16(lv[n/36], lv[(n/6)%6], lv[n%6]);
+}
+static void sgr_apply(rx_dec_t *d){
+    uint16_t a = d->attr;
+    if (d->np==0) d->par[d->np++]=0;    /* ESC[m = reset */
+    for (int i=0;i<d->np;i++){
+        unsigned p = d->par[i];
+        if (p==0) a=0;
+        else if (p==1) a |= SGR_BOLD;
+        else if (p==22) a &= (uint16_t)~SGR_BOLD;
+        else if (p==4) a |= SGR_UNDER;
+        else if (p==24) a &= (uint16_t)~SGR_UNDER;
+        else if (p==7) a |= SGR_REV;
+        else if (p==27) a &= (uint16_t)~SGR_REV;
+        else if (p>=30 && p<=37) a = (uint16_t)((a & ~31u) | (p-30+1));
+        else if (p>=90 && p<=97) a = (uint16_t)((a & ~31u) | (p-90+8+1));
+        else if (p==39) a &= (uint16_t)~31u;
+        else if (p>=40 && p<=47) a = (uint16_t)((a & ~(31u<<5)) | ((p-40+1)<<5));
+        else if (p>=100 && p<=107) a = (uint16_t)((a & ~(31u<<5)) | ((p-100+8+1)<<5));
+        else if (p==49) a &= (uint16_t)~(31u<<5);
+        else if ((p==38 || p==48) && i+1<d->np){
+            unsigned c;
+            if (d->par[i+1]==5 && i+2<d->np){ c = sgr_256(d->par[i+2] & 255); i+=2; }
+            else if (d->par[i+1]==2 && i+4<d->np){ c = sgr_rgb16(d->par[i+2] & 255, d->par[i+3] & 255, d->par[i+4] & 255); i+=4; }
+            else break;
+            if (p==38) a = (uint16_t)((a & ~31u) | (c+1));
+            else a = (uint16_t)((a & ~(31u<<5)) | ((c+1)<<5));
+        }
+    }
+    if (a != d->attr){ d->attr = a; sgr_mark(d); }
+}
+/* Byte dentro una sequenza ESC: 1 = consumato, 0 = sequenza interrotta (il byte va trattato) */
+static int rx_esc_byte(rx_dec_t *d, unsigned char c){
+    if (c==0x1B){ d->esc=1; return 1; }                  /* ESC riparte da capo */
+    if (c < 0x20){ d->esc=0; return 0; }                  /* CR/LF & co. chiudono la sequenza */
+    if (d->esc==1){
+        if (c=='['){ d->esc=2; d->np=0; d->par[0]=0; return 1; }
+        d->esc=0;                       /* ESC x a due byte: scartata */
+        return 1;
+    }
+    if (c>='0' && c<='9'){
+        if (d->np==0) d->np=1;
+        if (d->np <= 16) d->par[d->np-1] = d->par[d->np-1]*10 + (c-'0');
+        return 1;
+    }
+    if (c==';' || c==':'){ if (d->np==0) d->np=1; if (d->np < 16) d->par[d->np++] = 0; else d->np=17; return 1; }
+    if (c>=0x3C && c<=0x3F){ d->esc=3; return 1; }        /* CSI ? ... privata */
+    if (c>=0x20 && c<=0x2F) return 1;                     /* intermedi */
+    if (c>=0x40 && c<=0x7E){
+        if (c=='m' && d->esc==2 && d->np <= 16) sgr_apply(d);
+        d->esc=0; return 1;
+    }
+    d->esc=0; return 1;
+}
+
+/* Riga completa: direttamente nello scrollback, larghezza già nota */
+static void sess_emit_line(session_t *s){
+    rx_dec_t *d = &s->rx;
+    if (d->u8_need){ d->u8_need=0; rx_put_wc(s, L'?'); } /* sequenza troncata dal fine riga */
+    while (d->nruns && d->runs[d->nruns-1].at >= d->len) d->nruns--;   /* run senza char */
+    add_logical_line(s, d->len ? d->ln.buf : L"", d->len, d->col, !d->wide, is_following(s), d->runs, d->nruns);
+    stats.rx_lines++;
+    if (ctl_nsub) ctl_line(s, d->len ? d->ln.buf : L"", d->len);
+    if (s->trig){ trig_line_end(s, d->ln.buf, d->len); s->trig_st=0; }
+    d->len=0; d->col=0; d->wide=0;
+    d->nruns=0;
+    if (d->attr) sgr_mark(d);           /* il colore continua sulla riga dopo */
+}
+static void rx_text_byte(session_t *s, unsigned char c){
+    rx_dec_t *d = &s->rx;
+    int enq = d->enq; d->enq=0;         /* conta solo il byte subito dopo ENQ */
+    if (d->esc && rx_esc_byte(d, c)) return;
+    /* CR, LF e CRLF chiudono la riga una volta sola (anche se CR e LF arrivano in read diverse) */
+    if (c=='\r' || c=='\n'){
+        int dup = (c=='\n' && d->cr);
+        d->cr = (c=='\r');
+        if (dup) return;
+        s->ac_st = ac_step(&ac_prompt, s->ac_st, '\n');
+        sess_emit_line(s);
+        return;
+    }
+    if (c==0x1B){ d->esc=1; d->cr=0; return; }
+    d->cr=0;
+    if (c==0) return;                   /* CR NUL telnet */
+    if (enq && c==Y_SOH){ yapp_begin(s); return; }
+    if (c==Y_ENQ){ d->enq=1; return; }
+    sess_ac_byte(s, c);
+    if (d->u8_need){
+        if ((c & 0xC0)==0x80){
+            d->u8_cp = (d->u8_cp<<6) | (c & 0x3F);
+            if (--d->u8_need==0){
+                unsigned cp = d->u8_cp;
+                int ok = cp>=d->u8_min && cp<=0x10FFFF && !(cp>=0xD800 && cp<=0xDFFF);
+                rx_put_wc(s, ok ? (wchar_t)cp : L'?');
+            }
+            return;
+        }
+        d->u8_need=0; rx_put_wc(s, L'?');  /* sequenza interrotta: il byte corrente riparte da capo */
+    }
+    if (c < 0x80) rx_put_wc(s, (wchar_t)c);
+    else if ((c & 0xE0)==0xC0){ d->u8_need=1; d->u8_cp=c & 0x1F; d->u8_min=0x80; }
+    else if ((c & 0xF0)==0xE0){ d->u8_need=2; d->u8_cp=c & 0x0F; d->u8_min=0x800; }
+    else if ((c & 0xF8)==0xF0){ d->u8_need=3; d->u8_cp=c & 0x07; d->u8_min=0x10000; }
+    else rx_put_wc(s, L'?');
+}
+/* Blocco ASCII stampabile già riconosciuto da ascii_run */
+static void rx_put_ascii(session_t *s, const unsigned char *p, size_t n){
+    rx_dec_t *d = &s->rx;
+    d->cr=0; d->enq=0;
+    if (!wbuf_reserve(&d->ln, d->len + n)) die_cleanup("OOM RX");
+    ascii_widen(d->ln.buf + d->len, p, n);
+    d->len += n; d->col += (int)n;
+    for (size_t i=0;i<n;i++) sess_ac_byte(s, p[i]);
+    if (s->trig) for (size_t i=0;i<n;i++) trig_ac_byte(s, p[i]);
+}
+/* Un chunk dal socket: risponde alle negoziazioni, ritorna quanti byte di testo conteneva */
+static size_t rx_feed(session_t *s, const unsigned char *in, size_t len){
+    rx_dec_t *d = &s->rx;
+    size_t text=0;
     for (size_t i=0;i<len;i++){
         unsigned char ch=in[i];
-        if (ch=='\r'){
-            if (i+1<len && in[i+1]=='\n'){ if (o<outcap) out[o++]='\n'; i++; }
-            else { if (o<outcap) out[o++]='\n'; }
-        } else if (ch=='\n'){
-            if (o<outcap) out[o++]='\n';
-        } else {
-            if (o<outcap) out[o++]=ch;
+        switch (d->tstate){
+            case 0:
+                if (s->xf.mode && ch!=IAC){
+                    /* 7plus e cattura senza BINARY dal nodo: CR NUL è un CR (YAPP ha le sue lunghezze) */
+                    int crnul = s->xf.mode!=XF_YAPP && (s->tn_him[TO_BINARY]&3)!=TQ_YES;
+                    if (crnul && ch==0 && s->xf.cr){ s->xf.cr=0; text++; break; }
+                    const unsigned char *q = (const unsigned char*)memchr(in+i, IAC, len-i);
+                    size_t run = q ? (size_t)(q-(in+i)) : len-i;
+                    if (crnul) for (size_t k=1;k<run;k++) if (in[i+k]==0 && in[i+k-1]=='\r'){ run=k; break; }
+                    size_t took = xfer_data(s, in+i, run);
+                    s->xf.cr = in[i+took-1]=='\r';
+                    i += took-1; text += took;
+                }
+                else if (ch>=0x20 && ch<0x7F && !d->u8_need && !d->esc){
+                    size_t run = ascii_run(in+i, len-i);
+                    rx_put_ascii(s, in+i, run);
+                    i += run-1; text += run;
+                }
+                else if (ch==IAC) d->tstate=1;
+                else { rx_text_byte(s, ch); text++; }
+                if (s->xf.pend7) x7_begin(s);
+                break;
+            case 1:
+                d->tcmd=ch;
+                if (ch==IAC && s->xf.mode){ unsigned char b=IAC; xfer_data(s, &b, 1); s->xf.cr=0; text++; d->tstate=0; }
+                else if (ch==IAC){ rx_text_byte(s, IAC); text++; d->tstate=0; }
+                else if (ch==DO_||ch==DONT||ch==WILL||ch==WONT) d->tstate=2;
+                else if (ch==SB) d->tstate=3;
+                else d->tstate=0;
+                break;
+            case 2: tn_recv(s, d->tcmd, ch); d->tstate=0; break;
+            case 3: if (ch==IAC) d->tstate=4; break;
+            case 4: if (ch==SE) d->tstate=0; else d->tstate=3; break;
         }
     }
-    return o;
+    return text;
 }
 
 /* ---------- TCP ---------- */
@@ -190,545 +1564,2853 @@ static void set_tcp_keepalive(int fd, long idle_s, long intvl_s, int cnt){
     if (cnt>0){ int v=cnt; setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &v, sizeof(v)); }
 #endif
 }
-static int connect_tcp(const char*host,const char*port){
-    struct addrinfo hints,*res,*rp; int fd=-1;
-    memset(&hints,0,sizeof hints); hints.ai_family=AF_UNSPEC; hints.ai_socktype=SOCK_STREAM;
-    int err=getaddrinfo(host,port,&hints,&res);
-    if (err) die_cleanup("getaddrinfo: %s", gai_strerror(err));
-    for (rp=res; rp; rp=rp->ai_next){
-        fd=socket(rp->ai_family,rp->ai_socktype,rp->ai_protocol);
-        if (fd==-1) continue;
-        if (connect(fd,rp->ai_addr,rp->ai_addrlen)==0) break;
-        close(fd); fd=-1;
+
+/* ---------- Thread di I/O ----------
+ * Un thread fa solo read() dai socket connessi dentro l'anello della sessione e sveglia il
+ * loop con un byte su io_wake: se il terminale è lento il TCP continua a svuotarsi (fino a
+ * RXRING_SIZE per sessione). Telnet, decoder, autologin, trigger e TX restano nel loop
+ * principale, che possiede store e UI. io_mx protegge la tabella rr.fd/gen: la read() avviene
+ * con il mutex preso, così una close() del loop non colpisce mai un fd riusato. */
+static pthread_mutex_t io_mx = PTHREAD_MUTEX_INITIALIZER;
+static int io_wake[2]={-1,-1}, io_ctl[2]={-1,-1};
+static void io_kick(void){ ssize_t r=write(io_ctl[1], "k", 1); (void)r; }
+static void *io_thread(void *arg){
+    (void)arg;
+    for(;;){
+        struct pollfd p[1+SESS_MAX]; int idx[1+SESS_MAX]; unsigned gen[1+SESS_MAX]; int n=1;
+        p[0].fd=io_ctl[0]; p[0].events=POLLIN; p[0].revents=0;
+        pthread_mutex_lock(&io_mx);
+        for (int k=0;k<nsess;k++){
+            rxring_t *r = &sess[k]->rr;
+            if (r->fd<0 || atomic_load(&r->eof) || atomic_load(&r->full)) continue;
+            p[n].fd=r->fd; p[n].events=POLLIN; p[n].revents=0; idx[n]=k; gen[n]=r->gen; n++;
+        }
+        pthread_mutex_unlock(&io_mx);
+        int pr = poll(p, (nfds_t)n, -1);
+        atomic_fetch_add_explicit(&stats.io_sys, 1, memory_order_relaxed);
+        if (pr<0) continue;
+        if (p[0].revents & POLLIN){ char b[64]; while (read(io_ctl[0], b, sizeof b) > 0) ; }
+        int woke=0;
+        pthread_mutex_lock(&io_mx);
+        for (int i=1;i<n;i++){
+            if (!p[i].revents) continue;
+            rxring_t *r = &sess[idx[i]]->rr;
+            if (r->fd!=p[i].fd || r->gen!=gen[i]) continue;   /* staccato nel frattempo */
+            size_t h = atomic_load_explicit(&r->head, memory_order_relaxed);
+            size_t t = atomic_load_explicit(&r->tail, memory_order_acquire);
+            size_t room = RXRING_SIZE - (h - t), off = h & (RXRING_SIZE-1);
+            size_t contig = RXRING_SIZE - off < room ? RXRING_SIZE - off : room;
+            if (!contig){ atomic_store(&r->full, 1); continue; }
+            ssize_t got = read(r->fd, r->buf + off, contig);
+            atomic_fetch_add_explicit(&stats.io_sys, 1, memory_order_relaxed);
+            if (got>0 && !atomic_load_explicit(&r->t_arrive, memory_order_relaxed)) atomic_store_explicit(&r->t_arrive, now_ns(), memory_order_relaxed);
+            if (got>0) atomic_store_explicit(&r->head, h + (size_t)got, memory_order_release);
+            else if (got==0) atomic_store(&r->eof, -1);
+            else if (errno!=EINTR && errno!=EAGAIN) atomic_store(&r->eof, errno);
+            woke=1;
+        }
+        pthread_mutex_unlock(&io_mx);
+        if (woke){ ssize_t r=write(io_wake[1], "w", 1); (void)r; atomic_fetch_add_explicit(&stats.io_sys, 1, memory_order_relaxed); }
     }
-    freeaddrinfo(res);
-    if (fd<0) die_cleanup("connect fallita");
-    return fd;
+    return NULL;
+}
+static void io_start(void){
+    if (pipe(io_wake)<0 || pipe(io_ctl)<0) die_cleanup("pipe: %s", strerror(errno));
+    for (int i=0;i<2;i++){
+        fcntl(io_wake[i], F_SETFL, fcntl(io_wake[i], F_GETFL) | O_NONBLOCK); fcntl(io_wake[i], F_SETFD, FD_CLOEXEC);
+        fcntl(io_ctl[i], F_SETFL, fcntl(io_ctl[i], F_GETFL) | O_NONBLOCK);   fcntl(io_ctl[i], F_SETFD, FD_CLOEXEC);
+    }
+    pthread_t th; pthread_attr_t at;
+    pthread_attr_init(&at); pthread_attr_setdetachstate(&at, PTHREAD_CREATE_DETACHED);
+    int e = pthread_create(&th, &at, io_thread, NULL);
+    pthread_attr_destroy(&at);
+    if (e) die_cleanup("pthread_create: %s", strerror(e));
+}
+/* Il thread I/O comincia a leggere fd per la sessione (anello vuoto) */
+static void io_attach(session_t *s, int fd){
+    rxring_t *r = &s->rr;
+    if (!r->buf && !(r->buf = (unsigned char*)malloc(RXRING_SIZE))) die_cleanup("OOM RX");
+    pthread_mutex_lock(&io_mx);
+    atomic_store(&r->head, 0); atomic_store(&r->tail, 0);
+    atomic_store(&r->eof, 0); atomic_store(&r->full, 0);
+    r->fd=fd; r->gen++;
+    pthread_mutex_unlock(&io_mx);
+    io_kick();
+}
+/* Da chiamare prima di close(): dopo il ritorno il thread non tocca più fd né anello */
+static void io_detach(session_t *s){
+    if (s->rr.fd<0) return;
+    pthread_mutex_lock(&io_mx);
+    s->rr.fd=-1; s->rr.gen++;
+    pthread_mutex_unlock(&io_mx);
+    io_kick();
+}
+/* Lato UI: byte pronti contigui (puntatore in *p) e consumo */
+static size_t rxring_peek(rxring_t *r, const unsigned char **p){
+    size_t t = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    size_t h = atomic_load_explicit(&r->head, memory_order_acquire);
+    size_t off = t & (RXRING_SIZE-1), n = h - t;
+    if (n > RXRING_SIZE - off) n = RXRING_SIZE - off;
+    *p = r->buf + off;
+    return n;
+}
+static void rxring_consume(rxring_t *r, size_t n){
+    atomic_store_explicit(&r->tail, atomic_load_explicit(&r->tail, memory_order_relaxed) + n, memory_order_release);
+    if (atomic_exchange(&r->full, 0)) io_kick();        /* c'è di nuovo spazio: riprende a leggere */
+}
+static int rxring_pending(const session_t *s){
+    return s->sockfd>=0 && s->rr.buf && (atomic_load(&s->rr.head)!=atomic_load(&s->rr.tail) || atomic_load(&s->rr.eof));
+}
+
+/* ---------- Connessione ---------- */
+struct dns_job_s {
+    session_t *s; const char *host, *port;
+    int err; struct addrinfo *res;
+    int abandoned;                      /* scaduto il timeout: il loop libera il job quando arriva */
+};
+static int dns_pipe[2]={-1,-1};
+static void *dns_thread(void *arg){
+    dns_job_t *j = (dns_job_t*)arg;
+    struct addrinfo hints; memset(&hints,0,sizeof hints);
+    hints.ai_family=AF_UNSPEC; hints.ai_socktype=SOCK_STREAM;
+    j->err = getaddrinfo(j->host, j->port, &hints, &j->res);
+    ssize_t r = write(dns_pipe[1], &j, sizeof j); (void)r;   /* < PIPE_BUF: atomica */
+    return NULL;
+}
+static void dns_pipe_init(void){
+    if (pipe(dns_pipe)<0) die_cleanup("pipe: %s", strerror(errno));
+    fcntl(dns_pipe[0], F_SETFL, fcntl(dns_pipe[0], F_GETFL) | O_NONBLOCK);
+    for (int i=0;i<2;i++) fcntl(dns_pipe[i], F_SETFD, FD_CLOEXEC);
+}
+/* Chiude i tentativi in corso e abbandona l'eventuale risoluzione */
+static void conn_reset(session_t *s){
+    conn_t *c = &s->conn;
+    for (int i=0;i<CONN_MAX_ADDR;i++) if (c->fd[i]>=0){ close(c->fd[i]); c->fd[i]=-1; }
+    if (c->job){ c->job->abandoned=1; c->job=NULL; }
+    if (c->res){ freeaddrinfo(c->res); c->res=NULL; }
+    c->naddr=c->next=0;
+}
+static void conn_start(session_t *s){
+    conn_t *c = &s->conn;
+    conn_reset(s);
+    c->err=0; c->cur[0]='\0';
+    clock_gettime(CLOCK_MONOTONIC, &c->t0);
+    dns_job_t *j = (dns_job_t*)calloc(1, sizeof(*j));
+    if (!j) die_cleanup("OOM");
+    j->s=s; j->host=s->host; j->port=s->port;
+    pthread_t th; pthread_attr_t at;
+    pthread_attr_init(&at); pthread_attr_setdetachstate(&at, PTHREAD_CREATE_DETACHED);
+    int e = pthread_create(&th, &at, dns_thread, j);
+    pthread_attr_destroy(&at);
+    if (e) die_cleanup("pthread_create: %s", strerror(e));
+    c->job=j; c->state=CS_DNS;
+}
+static void conn_fail(session_t *s, const char *fmt, ...){
+    char msg[256];
+    va_list ap; va_start(ap, fmt); vsnprintf(msg, sizeof msg, fmt, ap); va_end(ap);
+    conn_reset(s);
+    if (s->opt.reconnect){
+        char why[300]; snprintf(why, sizeof why, "connect fallita: %s", msg);
+        conn_retry_later(s, why); return;
+    }
+    s->conn.state=CS_FAIL;
+    if (sess_open_count()==0) die_cleanup("connect fallita: %s:%s: %s", s->host, s->port, msg);
+    wchar_t wmsg[300];
+    swprintf(wmsg, sizeof(wmsg)/sizeof(wmsg[0]), L"*** %s:%s: connect fallita: %s", s->host, s->port, msg);
+    add_logical_line_w(s, wmsg, is_following(s));
+    ui_draw_status();
+}
+/* Connessione riuscita: socket di nuovo bloccante (TX con write_all) e stato di login da zero */
+static void conn_up(session_t *s, int fd){
+    for (int i=0;i<CONN_MAX_ADDR;i++) if (s->conn.fd[i]==fd) s->conn.fd[i]=-1;
+    conn_reset(s);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    s->sockfd=fd; s->conn.state=CS_UP;
+    io_attach(s, fd);
+    memset(s->tn_us, 0, sizeof s->tn_us); memset(s->tn_him, 0, sizeof s->tn_him);
+    s->naws_w=s->naws_h=0;
+
+    /* Abilita SO_KEEPALIVE quando è richiesto keepalive applicativo */
+    if (s->opt.keepalive_secs > 0) set_tcp_keepalive(fd, s->opt.keepalive_secs, s->opt.keepalive_secs, 3);
+
+    /* Stato login/lock */
+    clock_gettime(CLOCK_MONOTONIC,&s->last_rx);
+    s->input_locked = (s->alp.enabled||s->alb.enabled) ? 1 : 0;
+    if (s->alb.enabled) clock_gettime(CLOCK_MONOTONIC,&s->alb.t0);
+
+    /* Track TX (inizializza) */
+    clock_gettime(CLOCK_MONOTONIC, &s->last_tx_ts);
+    s->conn.t_up = s->last_tx_ts;
+    if (s->conn.ever_up){
+        wchar_t wmsg[300];
+        swprintf(wmsg, sizeof(wmsg)/sizeof(wmsg[0]), L"*** %s:%s: riconnesso", s->host, s->port);
+        add_logical_line_w(s, wmsg, is_following(s));
+    }
+    s->conn.ever_up=1;
+    ui_draw_status();
+}
+/* Caduta con --reconnect: chiude la riga a metà, azzera decoder e macchine di login e
+ * programma il prossimo tentativo. Lo scrollback, la history e la UI restano. */
+static void conn_retry_later(session_t *s, const char *why){
+    conn_t *c = &s->conn;
+    struct timespec now; clock_gettime(CLOCK_MONOTONIC,&now);
+    if (s->xf.mode) xfer_stop(s, "connessione persa");
+    if (s->rx.len || s->rx.u8_need) sess_emit_line(s);
+    s->rx.tstate=0; s->rx.cr=0; s->rx.u8_need=0;
+    s->ac_st=0; s->trig_st=0; s->txq.len=0;
+    s->alp.state=0; s->alb.stage=0;
+    s->login_done_flag=0; s->auto_help_sent=0; s->unlock_armed=0; s->unlock_seen=0; s->post_login_sent=0;
+    if (c->state==CS_UP && since_ms(c->t_up, now) >= RECONN_STABLE_MS) c->retries=0;
+    long d = RECONN_BASE_MS;
+    for (int i=0;i<c->retries && d<RECONN_MAX_MS;i++) d*=2;
+    if (d>RECONN_MAX_MS) d=RECONN_MAX_MS;
+    d = d/2 + rand()%(d/2+1);
+    c->retries++;
+    c->t_retry = now;
+    c->t_retry.tv_sec += d/1000; c->t_retry.tv_nsec += (d%1000)*1000000L;
+    if (c->t_retry.tv_nsec >= 1000000000L){ c->t_retry.tv_sec++; c->t_retry.tv_nsec -= 1000000000L; }
+    c->state=CS_WAIT;
+    wchar_t wmsg[400];
+    swprintf(wmsg, sizeof(wmsg)/sizeof(wmsg[0]), L"*** %s:%s: %s, riconnessione fra %.1f s", s->host, s->port, why, d/1000.0);
+    add_logical_line_w(s, wmsg, is_following(s));
+    ui_draw_status();
+}
+/* Avvia il prossimo tentativo; 1 = avviato (o già connesso), 0 = indirizzi finiti */
+static int conn_try_next(session_t *s){
+    conn_t *c = &s->conn;
+    while (c->next < c->naddr){
+        struct addrinfo *ai = c->addr[c->next++];
+        if (getnameinfo(ai->ai_addr, ai->ai_addrlen, c->cur, sizeof c->cur, NULL, 0, NI_NUMERICHOST)) strcpy(c->cur, "?");
+        int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd<0){ c->err=errno; continue; }
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen)==0){ conn_up(s, fd); return 1; }
+        if (errno!=EINPROGRESS){ c->err=errno; close(fd); continue; }
+        for (int i=0;i<CONN_MAX_ADDR;i++) if (c->fd[i]<0){ c->fd[i]=fd; break; }
+        clock_gettime(CLOCK_MONOTONIC, &c->t_next);
+        c->t_next.tv_nsec += CONN_STAGGER_MS*1000000L;
+        if (c->t_next.tv_nsec >= 1000000000L){ c->t_next.tv_sec++; c->t_next.tv_nsec -= 1000000000L; }
+        ui_draw_status();
+        return 1;
+    }
+    return 0;
+}
+static int conn_inflight(const conn_t *c){
+    int n=0;
+    for (int i=0;i<CONN_MAX_ADDR;i++) if (c->fd[i]>=0) n++;
+    return n;
+}
+/* Risultato del resolver: indirizzi alternati per famiglia a partire dalla prima (RFC 8305 §4) */
+static void conn_resolved(dns_job_t *j){
+    if (j->abandoned){ if (j->res) freeaddrinfo(j->res); free(j); return; }
+    session_t *s = j->s; conn_t *c = &s->conn;
+    c->job=NULL;
+    int err=j->err; c->res=j->res; free(j);
+    if (err) { conn_fail(s, "%s", gai_strerror(err)); return; }
+    struct addrinfo *fam[2][CONN_MAX_ADDR]; int nf[2]={0,0};
+    int first = c->res ? c->res->ai_family : AF_INET6;
+    for (struct addrinfo *ai=c->res; ai; ai=ai->ai_next){
+        int f = ai->ai_family!=first;
+        if (nf[f]<CONN_MAX_ADDR) fam[f][nf[f]++]=ai;
+    }
+    c->naddr=0;
+    for (int i=0; c->naddr<CONN_MAX_ADDR && (i<nf[0] || i<nf[1]); i++){
+        if (i<nf[0]) c->addr[c->naddr++]=fam[0][i];
+        if (i<nf[1] && c->naddr<CONN_MAX_ADDR) c->addr[c->naddr++]=fam[1][i];
+    }
+    c->state=CS_CONNECTING;
+    if (!conn_try_next(s)) conn_fail(s, "%s", c->err ? strerror(c->err) : "nessun indirizzo");
+}
+static void conn_dns_events(void){
+    dns_job_t *j;
+    while (read(dns_pipe[0], &j, sizeof j)==(ssize_t)sizeof j) conn_resolved(j);
+}
+/* fd da aspettare in scrittura per la poll() */
+static int conn_pollfds(const session_t *s, struct pollfd *p){
+    int n=0;
+    if (s->conn.state!=CS_CONNECTING) return 0;
+    for (int i=0;i<CONN_MAX_ADDR;i++) if (s->conn.fd[i]>=0){ p[n].fd=s->conn.fd[i]; p[n].events=POLLOUT; p[n].revents=0; n++; }
+    return n;
+}
+static void conn_events(session_t *s, const struct pollfd *p, int n){
+    conn_t *c = &s->conn;
+    for (int k=0;k<n && c->state==CS_CONNECTING;k++){
+        if (!p[k].revents) continue;
+        int e=0; socklen_t el=sizeof e;
+        if (getsockopt(p[k].fd, SOL_SOCKET, SO_ERROR, &e, &el)<0) e=errno;
+        if (e==0){ conn_up(s, p[k].fd); return; }
+        c->err=e;
+        for (int i=0;i<CONN_MAX_ADDR;i++) if (c->fd[i]==p[k].fd){ close(c->fd[i]); c->fd[i]=-1; }
+        /* fallito: il prossimo parte subito invece di aspettare lo sfalsamento */
+        if (!conn_try_next(s) && !conn_inflight(c)){ conn_fail(s, "%s", strerror(e)); return; }
+    }
+}
+static void conn_deadline(const session_t *s, long *wait_ms, struct timespec now){
+    const conn_t *c = &s->conn;
+    if (c->state==CS_WAIT){ deadline_min(wait_ms, -since_ms(c->t_retry, now)); return; }
+    if (s->opt.connect_timeout_ms>0) deadline_min(wait_ms, s->opt.connect_timeout_ms - since_ms(c->t0, now));
+    if (c->state==CS_CONNECTING && c->next < c->naddr) deadline_min(wait_ms, -since_ms(c->t_next, now));
+}
+static void conn_timers(session_t *s){
+    conn_t *c = &s->conn;
+    struct timespec now; clock_gettime(CLOCK_MONOTONIC,&now);
+    if (c->state==CS_WAIT){ if (since_ms(c->t_retry, now) >= 0){ conn_start(s); ui_draw_status(); } return; }
+    if (s->opt.connect_timeout_ms>0 && since_ms(c->t0, now) >= s->opt.connect_timeout_ms){
+        conn_fail(s, "timeout dopo %ld s", s->opt.connect_timeout_ms/1000); return;
+    }
+    if (c->state==CS_CONNECTING && c->next < c->naddr && since_ms(c->t_next, now) >= 0) conn_try_next(s);
 }
 
 /* ---------- UI ---------- */
+static void ui_draw_titles(void){
+    for (int i=0;i<nsess;i++){
+        session_t *s = sess[i];
+        if (!s->title) continue;
+        werase(s->title);
+        wattrset(s->title, i==cur_sess ? A_REVERSE|A_BOLD : A_NORMAL);
+        mvwprintw(s->title, 0, 0, " %d %s:%s%s ", i+1, s->host, s->port, conn_pending(s) ? " [connessione...]" : s->sockfd<0 ? " [chiusa]" : "");
+        if (s->fv>=0) wprintw(s->title, "[filtro: %s] ", s->filt[s->fv].arg);
+        wattrset(s->title, A_NORMAL);
+        wnoutrefresh(s->title);
+    }
+    ui_dirty=1;
+}
+/* Campione per l'HUD: velocità sull'intervallo dall'ultimo tick */
+static void stats_tick(void){
+    struct timespec now; clock_gettime(CLOCK_MONOTONIC,&now);
+    long ms = since_ms(stats.t_snap, now);
+    if (ms<=0) return;
+    uint64_t sys = stats.sys_main + atomic_load(&stats.io_sys);
+    uint64_t dl = stats.rx_lines - stats.snap_lines;
+    stats.bps = (double)(stats.rx_bytes - stats.snap_rx)*1000.0/(double)ms;
+    stats.lps = (double)dl*1000.0/(double)ms;
+    stats.sys_per_line = dl ? (double)(sys - stats.snap_sys)/(double)dl : 0.0;
+    stats.snap_rx=stats.rx_bytes; stats.snap_lines=stats.rx_lines; stats.snap_sys=sys; stats.t_snap=now;
+}
+static void hud_draw(void){
+    mvwprintw(win_status, 0, 0, "RX %.1fKB/s %.0fl/s  schermo %.1f/%.1fms  tasto %.1f  frame %.1f  sys/r %.1f  RTT %.0fms",
+              stats.bps/1024.0, stats.lps, hist_pct(&stats.lat_screen, 0.5)/1000.0, hist_pct(&stats.lat_screen, 0.99)/1000.0,
+              hist_pct(&stats.lat_key, 0.5)/1000.0, hist_pct(&stats.render, 0.5)/1000.0, stats.sys_per_line, hist_pct(&stats.ka_rtt, 0.5)/1000.0);
+}
+static void json_hist(FILE *f, const char *name, const hist_t *h, int last){
+    fprintf(f, "    \"%s\": {\"n\": %llu, \"mean_us\": %llu, \"p50_us\": %llu, \"p99_us\": %llu, \"max_us\": %llu, \"log2_us\": [",
+            name, (unsigned long long)h->n, (unsigned long long)(h->n ? h->sum_us/h->n : 0),
+            (unsigned long long)hist_pct(h, 0.5), (unsigned long long)hist_pct(h, 0.99), (unsigned long long)h->max_us);
+    int top=HIST_N; while (top>0 && !h->b[top-1]) top--;
+    for (int b=0;b<top;b++) fprintf(f, "%s%llu", b?", ":"", (unsigned long long)h->b[b]);
+    fprintf(f, "]}%s\n", last ? "" : ",");
+}
+/* SIGUSR1: istantanea in $TMPDIR/bpqchat-PID.json (scritta in .tmp e rinominata) */
+static void stats_dump_json(void){
+    const char *dir = getenv("TMPDIR"); if (!dir || !*dir) dir="/tmp";
+    char path[512], tmp[520];
+    snprintf(path, sizeof path, "%s/bpqchat-%ld.json", dir, (long)getpid());
+    snprintf(tmp, sizeof tmp, "%s.tmp", path);
+    FILE *f = fopen(tmp, "we");
+    if (!f) return;
+    struct timespec now; clock_gettime(CLOCK_MONOTONIC,&now);
+    fprintf(f, "{\n  \"uptime_ms\": %ld,\n", since_ms(stats.t_start, now));
+    fprintf(f, "  \"rx_bytes\": %llu, \"rx_lines\": %llu, \"tx_bytes\": %llu, \"frames\": %llu,\n",
+            (unsigned long long)stats.rx_bytes, (unsigned long long)stats.rx_lines, (unsigned long long)stats.tx_bytes, (unsigned long long)stats.frames);
+    fprintf(f, "  \"syscalls_main\": %llu, \"syscalls_io\": %llu, \"allocs\": %llu,\n", (unsigned long long)stats.sys_main, (unsigned long long)atomic_load(&stats.io_sys), (unsigned long long)n_allocs);
+    fprintf(f, "  \"rx_bytes_per_s\": %.1f, \"rx_lines_per_s\": %.1f, \"syscalls_per_line\": %.2f,\n", stats.bps, stats.lps, stats.sys_per_line);
+    fprintf(f, "  \"sessions\": [");
+    for (int i=0;i<nsess;i++)
+        fprintf(f, "%s{\"host\": \"%s\", \"port\": \"%s\", \"connected\": %s}", i?", ":"", sess[i]->host, sess[i]->port, sess[i]->sockfd>=0 ? "true" : "false");
+    fprintf(f, "],\n  \"latency\": {\n");
+    json_hist(f, "read_to_screen", &stats.lat_screen, 0);
+    json_hist(f, "key_to_write", &stats.lat_key, 0);
+    json_hist(f, "render_frame", &stats.render, 0);
+    json_hist(f, "keepalive_rtt", &stats.ka_rtt, 1);
+    fprintf(f, "  }\n}\n");
+    if (fclose(f)==0) rename(tmp, path); else unlink(tmp);
+}
+
+static void ui_draw_status(void){
+    if (!win_status) return;
+    werase(win_status);
+    if (opt_hud){
+        hud_draw();
+    } else if (CUR->xf.mode){
+        xfer_status(CUR);
+    } else if (upl_active(CUR)){
+        const session_t *s = CUR;
+        mvwprintw(win_status, 0, 0, "Invio: %d/%d righe%s%s. F6: annulla", s->up.sent, s->up.lines,
+                  s->input_locked || s->sockfd<0 ? " (in attesa della sessione)" : "", s->up.wait_prompt ? " (attesa prompt)" : "");
+    } else if (nsess<=1 && conn_pending(sess[0])){
+        const conn_t *c = &sess[0]->conn;
+        if (c->state==CS_WAIT) mvwprintw(win_status, 0, 0, "Disconnesso da %s:%s: nuovo tentativo (%d) fra poco...", sess[0]->host, sess[0]->port, c->retries);
+        else if (c->state==CS_DNS) mvwprintw(win_status, 0, 0, "Connessione a %s:%s: risoluzione DNS...", sess[0]->host, sess[0]->port);
+        else mvwprintw(win_status, 0, 0, "Connessione a %s:%s: tentativo %d/%d (%s)...", sess[0]->host, sess[0]->port, c->next, c->naddr, c->cur);
+    } else if (nsess<=1 && CUR->fv>=0){
+        mvwprintw(win_status, 0, 0, "Vista filtrata %d/%d: \"%s\" (%lu righe). F8: vista successiva", CUR->fv+1, CUR->nfilt,
+                  CUR->filt[CUR->fv].arg, vid_count(CUR));
+    } else if (nsess<=1){
+        mvwprintw(win_status, 0, 0, "Output SOPRA (verde) — Comandi QUI (bianco). PgUp/PgDn/Home/End scroll. F10 o Ctrl-C: esci. Ctrl-Z: SUB");
+    } else {
+        /* linguette: [n] attiva, + = righe nuove non viste, x = chiusa, ~ = in connessione */
+        wmove(win_status, 0, 0);
+        for (int i=0;i<nsess;i++){
+            session_t *s = sess[i];
+            if (i==cur_sess) wattron(win_status, A_REVERSE);
+            wprintw(win_status, "%d%s%s:%s", i+1, conn_pending(s) ? "~ " : s->sockfd<0 ? "x " : (s->activity ? "+ " : " "), s->host, s->port);
+            if (s->fv>=0) wprintw(win_status, "[%s]", s->filt[s->fv].arg);
+            if (i==cur_sess) wattroff(win_status, A_REVERSE);
+            waddch(win_status, ' ');
+        }
+        wprintw(win_status, "| F2: sessione  F3: split  F10: esci");
+    }
+    wnoutrefresh(win_status);
+    ui_draw_titles();
+    ui_dirty=1;
+}
 static void ui_make_windows(void){
-    if (win_out) { delwin(win_out); win_out=NULL; }
+    for (int i=0;i<nsess;i++){
+        session_t *s = sess[i];
+        if (s->win) { delwin(s->win); s->win=NULL; }
+        if (s->title) { delwin(s->title); s->title=NULL; }
+    }
     if (win_status) { delwin(win_status); win_status=NULL; }
     if (win_in) { delwin(win_in); win_in=NULL; }
 
     int out_h = rows - 2; if (out_h < 1) out_h = 1;
-    win_out    = newwin(out_h, cols, 0, 0);
+    /* split: un pane per sessione (titolo + output), se c'è spazio per almeno una riga ciascuna */
+    int split = opt_split && nsess>1 && out_h/nsess >= 2;
+    int y0 = 0;
+    for (int i=0;i<nsess;i++){
+        session_t *s = sess[i];
+        s->pane_h = out_h;
+        if (split){
+            int h = (i==nsess-1) ? out_h - y0 : out_h/nsess;
+            s->title = newwin(1, cols, y0, 0);
+            wbkgd(s->title, COLOR_PAIR(CP_ST));
+            s->win = newwin(h-1, cols, y0+1, 0);
+            s->pane_h = h-1;
+            y0 += h;
+        } else if (i==cur_sess){
+            s->win = newwin(out_h, cols, 0, 0);
+        }
+        if (s->win){
+            wbkgd(s->win, COLOR_PAIR(CP_OUT));
+            scrollok(s->win, TRUE);   /* wscrl per seguire la coda; il wrap a cols-1 non tocca mai l'ultima colonna */
+            idlok(s->win, TRUE);
+            s->activity = 0;
+        }
+        /* pane nuovo: tutto da ridisegnare */
+        scr_row_t *d = (scr_row_t*)realloc(s->drawn, sizeof(*d)*(size_t)s->pane_h);
+        if (d) s->drawn=d;
+        scr_row_t *w = (scr_row_t*)realloc(s->want, sizeof(*w)*(size_t)s->pane_h);
+        if (w) s->want=w;
+        if (!d || !w) die_cleanup("OOM UI");
+        s->drawn_valid=0; s->out_dirty=1;
+    }
     win_status = newwin(1, cols, out_h, 0);
     win_in     = newwin(1, cols, out_h+1, 0);
 
-    wbkgd(win_out,    COLOR_PAIR(CP_OUT));
     wbkgd(win_status, COLOR_PAIR(CP_ST));
     wbkgd(win_in,     COLOR_PAIR(CP_IN));
 
-    scrollok(win_out, FALSE);
-    keypad(stdscr, TRUE);
-    keypad(win_in, TRUE);
-    curs_set(1);
+    keypad(stdscr, TRUE);
+    keypad(win_in, TRUE);
+    nodelay(win_in, TRUE);     /* letto solo quando poll() segnala stdin pronto */
+    curs_set(1);
+
+    ui_draw_status();
+    ui_dirty=1;
+}
+/* Render scheduler: RX ed echo locale marcano solo out_dirty, i pane si ridisegnano al più
+ * opt_max_fps volte al secondo (coalescendo tutti i chunk arrivati nel frattempo). render_out
+ * diretto resta per scroll e cambi di vista da tastiera, l'eco in render_input è sempre immediato. */
+static struct timespec last_frame_ts;
+static long frame_wait_ms(void){
+    if (opt_max_fps<=0) return 0;
+    struct timespec now; clock_gettime(CLOCK_MONOTONIC,&now);
+    long left = 1000/opt_max_fps - since_ms(last_frame_ts, now);
+    return left>0 ? left : 0;
+}
+static int out_pending(void){
+    for (int i=0;i<nsess;i++) if (sess[i]->win && sess[i]->out_dirty) return 1;
+    return 0;
+}
+static void render_out(session_t *s);
+static void render_out_frame(void){
+    if (!out_pending() || frame_wait_ms()>0) return;
+    for (int i=0;i<nsess;i++) render_out(sess[i]);
+    clock_gettime(CLOCK_MONOTONIC, &last_frame_ts);
+}
+/* Flush unico verso il terminale; win_in per ultima così il cursore resta sulla barra comandi */
+static void ui_flush(void){
+    if (!ui_dirty) return;
+    wnoutrefresh(win_in);
+    doupdate();
+    ui_dirty=0;
+}
+static void ui_init(void){
+    initscr(); cbreak(); noecho();
+    start_color(); use_default_colors();
+    init_pair(CP_OUT, COLOR_GREEN, -1);
+    init_pair(CP_IN,  COLOR_WHITE, -1);
+    init_pair(CP_ST,  COLOR_CYAN,  -1);
+    init_pair(CP_HL,  COLOR_YELLOW, -1);
+    set_escdelay(25);          /* Esc esce subito dalla ricerca */
+    /* bracketed paste: il terminale racchiude il testo incollato fra \e[200~ e \e[201~ */
+    define_key("\033[200~", KEY_PASTE_BEGIN); define_key("\033[201~", KEY_PASTE_END);
+    define_key("\033[1;5D", KEY_WORD_LEFT);  define_key("\033[1;3D", KEY_WORD_LEFT);  define_key("\033b", KEY_WORD_LEFT);
+    define_key("\033[1;5C", KEY_WORD_RIGHT); define_key("\033[1;3C", KEY_WORD_RIGHT); define_key("\033f", KEY_WORD_RIGHT);
+    paste_mode(1);
+    getmaxyx(stdscr, rows, cols);
+    ui_make_windows();
+}
+
+/* ---------- Store & wrap lazy (wide) ---------- */
+static int visible_rows(session_t *s){ return s->pane_h<1 ? 1 : s->pane_h; }
+static int wrap_width(void){ int w=cols-1; return w<1?1:w; }
+static unsigned long store_end_id(session_t *s){ return s->store_first_id + (unsigned long)s->store_count; }
+/* Prima riga raggiungibile: col log su disco anche quelle uscite dal ring, senza quelle compresse */
+static unsigned long first_id(session_t *s){ return s->log.fd>=0 ? 0 : s->cold.n ? s->cold.first_id : s->store_first_id; }
+static line_t *slog_line(session_t *s, unsigned long id);
+static line_t *cold_line(session_t *s, unsigned long id);
+/* Riga per id: dal ring se è ancora in memoria, altrimenti dal log o dai blocchi compressi
+ * (puntatore valido finché non si leggono altre LCACHE_N righe dal disco o COLD_LRU blocchi) */
+static line_t *line_by_id(session_t *s, unsigned long id){
+    if (id < s->store_first_id) return s->log.fd>=0 ? slog_line(s, id) : cold_line(s, id);
+    return &STORE_AT(s, (int)(id - s->store_first_id));
+}
+static inline wchar_t line_ch(const line_t *L, size_t i){
+    if (L->enc==1) return (wchar_t)L->txt[i];
+    if (L->enc==2) return (wchar_t)((const uint16_t*)L->txt)[i];
+    return (wchar_t)((const uint32_t*)L->txt)[i];
+}
+/* Tabella per char delle righe non narrow: larghezza nei bit 0-6, LW_BRK = opportunità di taglio */
+#define LW_BRK 0x80
+static inline int line_cw(const line_t *L, size_t i){ return L->narrow ? 1 : L->txt[(size_t)L->len*L->enc + i] & 0x7F; }
+static inline int line_brk(const line_t *L, size_t i){ return L->txt[(size_t)L->len*L->enc + i] & LW_BRK; }
+/* Codifica compatta di una riga wide: ritorna i byte necessari (testo + larghezze) */
+static size_t line_pack_size(const wchar_t *line, size_t len, int *colw, int *narrow, int *enc){
+    wchar_t maxc=0;
+    if (*colw<0){
+        int cw=0, nw=1;
+        for (size_t i=0;i<len;i++){ int w=wc_cols(line[i]); cw+=w; if (w!=1) nw=0; if (line[i]>maxc) maxc=line[i]; }
+        *colw=cw; *narrow=nw;
+    } else {
+        for (size_t i=0;i<len;i++) if (line[i]>maxc) maxc=line[i];
+    }
+    *enc = maxc < 0x100 ? 1 : maxc < 0x10000 ? 2 : 4;
+    return len*(size_t)*enc + (*narrow ? 0 : len);
+}
+static void line_pack(line_t *L, unsigned char *dst, const wchar_t *line, size_t len, int colw, int narrow, int enc){
+    if (enc==1) for (size_t i=0;i<len;i++) dst[i]=(unsigned char)line[i];
+    else if (enc==2) for (size_t i=0;i<len;i++) ((uint16_t*)dst)[i]=(uint16_t)line[i];
+    else for (size_t i=0;i<len;i++) ((uint32_t*)dst)[i]=(uint32_t)line[i];
+    if (!narrow){ unsigned char *wd = dst + len*(size_t)enc; for (size_t i=0;i<len;i++) wd[i]=(unsigned char)(wc_cols(line[i]) | (wc_is_break(line[i]) ? LW_BRK : 0)); }
+    L->txt=dst; L->len=(int)len; L->colw=colw; L->narrow=(unsigned char)narrow; L->enc=(unsigned char)enc; L->hl=0; L->wrap_w=0; L->nrows=1; L->nruns=0;
+}
+static inline size_t line_runs_off(const line_t *L){ return ((size_t)L->len*L->enc + (L->narrow ? 0 : (size_t)L->len) + 3) & ~(size_t)3; }
+static inline const sgr_run_t *line_runs(const line_t *L){ return (const sgr_run_t*)(L->txt + line_runs_off(L)); }
+/* Segmento [off, off+n) in wide per ncurses (buffer di lavoro, valido fino alla chiamata successiva) */
+static const wchar_t *line_wcs(const line_t *L, size_t off, size_t n){
+    if (L->enc==sizeof(wchar_t)) return (const wchar_t*)L->txt + off;
+    if (!wbuf_reserve(&wb_row, n)) return NULL;
+    for (size_t i=0;i<n;i++) wb_row.buf[i]=line_ch(L, off+i);
+    return wb_row.buf;
+}
+
+/* wrap su colonne visuali, evitando split di codepoint; preferisci taglio a spazi/punteggiatura.
+ * Calcola il segmento che parte da *pos e avanza *pos all'inizio del successivo. */
+static int wrap_next(const line_t *L, int width, size_t *pos, size_t *seg_off, size_t *seg_len){
+    size_t len = (size_t)L->len;
+    if (width < 1) width = 1;
+    size_t i = *pos;
+    if (i >= len) return 0;
+    size_t start = i;
+    if (L->narrow){
+        /* tutti i char larghi 1: il segmento è di width char esatti (come il ciclo sotto) */
+        size_t end = (len - i > (size_t)width) ? i + (size_t)width : len;
+        *seg_off = start; *seg_len = end - start;
+        while (end < len && line_ch(L, end)==L' ') end++;
+        *pos = end;
+        return 1;
+    }
+    int col=0, overflow=0;
+    ssize_t last_break = -1;
+    int col_at_last_break = 0;
+
+    while (i < len){
+        int w = line_cw(L, i);
+        /* opportunità di taglio (già classificata in line_pack) */
+        if (line_brk(L, i)) { last_break = (ssize_t)i; col_at_last_break = col + w; }
+
+        if (col + w > width){ overflow=1; break; }
+
+        col += w; i++;
+        if (col==width) { break; }
+    }
+
+    size_t end = i;
+    if (overflow){
+        if (last_break >= (ssize_t)start && col_at_last_break>0){
+            end = (size_t)last_break + 1;
+        } else if (end==start){
+            /* char più largo del width: forza presa di almeno un char */
+            end = start + 1;
+        }
+    }
+    *seg_off = start; *seg_len = end - start;
+
+    /* salta spazi successivi all'interruzione per non iniziare la nuova riga con spazio */
+    while (end < len && line_ch(L, end)==L' ') end++;
+    *pos = end;
+    return 1;
+}
+
+/* Righe visuali di una riga logica: calcolate al primo uso e memorizzate per larghezza */
+static int line_rows(line_t *L, int width){
+    if (L->wrap_w != width){
+        /* sta tutta in una riga: niente wrap da calcolare */
+        if (L->colw>=0 && L->colw<=width){ L->nrows=1; L->wrap_w=width; return 1; }
+        int n=0; size_t pos=0, o, l;
+        while (wrap_next(L, width, &pos, &o, &l)) n++;
+        L->nrows = n>0 ? n : 1; /* riga vuota = una riga visuale */
+        L->wrap_w = width;
+    }
+    return L->nrows;
+}
+
+/* ---------- Log su disco ---------- */
+static size_t utf8_put(unsigned char *o, wchar_t wc){
+    unsigned c = (unsigned)wc;
+    if (c < 0x80){ o[0]=(unsigned char)c; return 1; }
+    if (c < 0x800){ o[0]=0xC0|(c>>6); o[1]=0x80|(c&0x3F); return 2; }
+    if (c < 0x10000){ o[0]=0xE0|(c>>12); o[1]=0x80|((c>>6)&0x3F); o[2]=0x80|(c&0x3F); return 3; }
+    o[0]=0xF0|(c>>18); o[1]=0x80|((c>>12)&0x3F); o[2]=0x80|((c>>6)&0x3F); o[3]=0x80|(c&0x3F); return 4;
+}
+/* UTF-8 -> wide in b (byte non validi = '?'), ritorna il numero di char */
+static size_t utf8_decode_buf(const unsigned char *p, size_t n, wbuf_t *b){
+    if (!wbuf_reserve(b, n+1)) return 0;
+    size_t o=0, i=0;
+    while (i<n){
+        unsigned c=p[i], need, cp, min;
+        if (c<0x80){ b->buf[o++]=(wchar_t)c; i++; continue; }
+        if ((c&0xE0)==0xC0){ need=1; cp=c&0x1F; min=0x80; }
+        else if ((c&0xF0)==0xE0){ need=2; cp=c&0x0F; min=0x800; }
+        else if ((c&0xF8)==0xF0){ need=3; cp=c&0x07; min=0x10000; }
+        else { b->buf[o++]=L'?'; i++; continue; }
+        size_t k=1;
+        for (; k<=need && i+k<n && (p[i+k]&0xC0)==0x80; k++) cp=(cp<<6)|(p[i+k]&0x3F);
+        if (k<=need || cp<min || cp>0x10FFFF || (cp>=0xD800 && cp<=0xDFFF)){ b->buf[o++]=L'?'; i++; continue; }
+        b->buf[o++]=(wchar_t)cp; i+=k;
+    }
+    return o;
+}
+static int slog_flush(slog_t *g){
+    if (g->fd<0) return 0;
+    if (g->wlen && write_all(g->fd, g->wbuf, g->wlen)<0) return -1;
+    if (g->ilen && write_all(g->ifd, g->ibuf, g->ilen*sizeof(uint64_t))<0) return -1;
+    g->wlen=0; g->ilen=0;
+    return 0;
+}
+static void slog_close(slog_t *g){
+    if (g->fd<0) return;
+    slog_flush(g);
+    if (g->map) munmap(g->map, g->map_len);
+    if (g->imap) munmap(g->imap, g->imap_len);
+    close(g->fd); close(g->ifd);
+    free(g->wbuf); free(g->ibuf);
+    g->fd=g->ifd=-1;
+}
+/* Rimappa fd se la mappa corrente non copre need byte (il file cresce solo in coda) */
+static void *slog_map(int fd, void *map, size_t *map_len, size_t need){
+    if (map && *map_len >= need) return map;
+    if (map){ munmap(map, *map_len); map=NULL; *map_len=0; }
+    struct stat st;
+    if (fstat(fd, &st)<0 || (size_t)st.st_size < need || st.st_size==0) return NULL;
+    void *m = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (m==MAP_FAILED) return NULL;
+    *map_len=(size_t)st.st_size;
+    return m;
+}
+static void slog_open(session_t *s){
+    slog_t *g = &s->log;
+    char name[512], path[1024];
+    int dup=0; /* stesso nodo due volte nella stessa cartella: file separati */
+    for (int i=0;i<nsess && sess[i]!=s;i++)
+        if (sess[i]->opt.log_dir && !strcmp(sess[i]->opt.log_dir, s->opt.log_dir) && !strcmp(sess[i]->host, s->host) && !strcmp(sess[i]->port, s->port)) dup++;
+    if (dup) snprintf(name, sizeof name, "%s_%s_%d", s->host, s->port, dup+1);
+    else snprintf(name, sizeof name, "%s_%s", s->host, s->port);
+    for (char *c=name; *c; c++) if (!isalnum((unsigned char)*c) && *c!='.' && *c!='-') *c='_';
+    snprintf(path, sizeof path, "%s/%s.log", s->opt.log_dir, name);
+    g->fd = open(path, O_RDWR|O_CREAT|O_APPEND|O_CLOEXEC, 0644);
+    if (g->fd<0) die_cleanup("log %s: %s", path, strerror(errno));
+    snprintf(path, sizeof path, "%s/%s.idx", s->opt.log_dir, name);
+    g->ifd = open(path, O_RDWR|O_CREAT|O_APPEND|O_CLOEXEC, 0644);
+    if (g->ifd<0) die_cleanup("log %s: %s", path, strerror(errno));
+
+    struct stat st, ist;
+    if (fstat(g->fd, &st)<0 || fstat(g->ifd, &ist)<0) die_cleanup("log fstat: %s", strerror(errno));
+    g->size = (uint64_t)st.st_size;
+    /* coda incompleta (crash a metà scrittura): chiudi la riga */
+    if (g->size>0){
+        unsigned char last=0;
+        if (pread(g->fd, &last, 1, (off_t)g->size-1)==1 && last!='\n'){
+            if (write_all(g->fd, "\n", 1)<0) die_cleanup("log: %s", strerror(errno));
+            g->size++;
+        }
+    }
+    g->nlines = (unsigned long)(ist.st_size / (off_t)sizeof(uint64_t));
+    /* indice oltre la fine del .log: scarta le voci orfane */
+    while (g->nlines>0){
+        uint64_t off=0;
+        if (pread(g->ifd, &off, sizeof off, (off_t)((g->nlines-1)*sizeof(uint64_t)))==(ssize_t)sizeof off && off < g->size) break;
+        g->nlines--;
+    }
+    if ((off_t)(g->nlines*sizeof(uint64_t)) != ist.st_size && ftruncate(g->ifd, (off_t)(g->nlines*sizeof(uint64_t)))<0)
+        die_cleanup("log idx: %s", strerror(errno));
+    /* indice mancante o corto: ricostruiscilo scorrendo il .log */
+    uint64_t from = 0;
+    if (g->nlines>0){
+        uint64_t off=0;
+        if (pread(g->ifd, &off, sizeof off, (off_t)((g->nlines-1)*sizeof(uint64_t)))==(ssize_t)sizeof off){
+            g->map = (unsigned char*)slog_map(g->fd, NULL, &g->map_len, (size_t)g->size);
+            const unsigned char *nl = g->map ? memchr(g->map+off, '\n', (size_t)(g->size-off)) : NULL;
+            from = nl ? (uint64_t)(nl - g->map) + 1 : g->size;
+        }
+    }
+    if (from < g->size){
+        if (!g->map) g->map = (unsigned char*)slog_map(g->fd, NULL, &g->map_len, (size_t)g->size);
+        if (!g->map) die_cleanup("log mmap: %s", strerror(errno));
+        for (uint64_t off=from; off<g->size; ){
+            const unsigned char *nl = memchr(g->map+off, '\n', (size_t)(g->size-off));
+            if (write_all(g->ifd, &off, sizeof off)<0) die_cleanup("log idx: %s", strerror(errno));
+            g->nlines++;
+            off = nl ? (uint64_t)(nl - g->map) + 1 : g->size;
+        }
+    }
+    s->lcache = (lcache_t*)calloc(LCACHE_N, sizeof(lcache_t));
+    if (!s->lcache) die_cleanup("OOM log");
+    for (int i=0;i<LCACHE_N;i++) s->lcache[i].id=ROW_NONE;
+    /* le righe già nel log diventano scrollback: la prima riga nuova ha id nlines */
+    s->store_first_id = g->nlines;
+    s->view_id = g->nlines ? g->nlines-1 : 0;
+    s->idx_hist_end = g->nlines;
+    /* il background indicizza solo i blocchi che ci stanno negli slot, i più recenti; i più
+     * vecchi li ricostruisce la ricerca se ci arriva */
+    unsigned long keep = (unsigned long)IDX_SLOTS*IDX_BLOCK;
+    if (g->nlines > keep){
+        unsigned long start = (g->nlines - keep + IDX_BLOCK-1) / IDX_BLOCK * IDX_BLOCK;
+        uint64_t off;
+        if (pread(g->ifd, &off, sizeof off, (off_t)(start*sizeof off)) == (ssize_t)sizeof off){ s->idx_bg_id=start; s->idx_bg_off=off; }
+    }
+}
+static void slog_append(session_t *s, const wchar_t *line, size_t len){
+    slog_t *g = &s->log;
+    size_t need = g->wlen + 4*len + 1;
+    if (need > g->wcap){
+        size_t nc = g->wcap ? g->wcap : 65536;
+        while (nc < need) nc *= 2;
+        unsigned char *t = (unsigned char*)realloc(g->wbuf, nc);
+        if (!t) die_cleanup("OOM log");
+        g->wbuf=t; g->wcap=nc;
+    }
+    if (g->ilen == g->icap){
+        size_t nc = g->icap ? g->icap*2 : 1024;
+        uint64_t *t = (uint64_t*)realloc(g->ibuf, nc*sizeof(uint64_t));
+        if (!t) die_cleanup("OOM log");
+        g->ibuf=t; g->icap=nc;
+    }
+    g->ibuf[g->ilen++] = g->size;
+    size_t o = g->wlen;
+    for (size_t i=0;i<len;i++) o += utf8_put(g->wbuf+o, line[i]);
+    g->wbuf[o++]='\n';
+    g->size += o - g->wlen; g->wlen = o;
+    g->nlines++;
+}
+static line_t *slog_line(session_t *s, unsigned long id){
+    static const line_t empty = { .txt=(unsigned char*)"", .nrows=1, .enc=1, .narrow=1 };
+    static line_t fallback;
+    slog_t *g = &s->log;
+    lcache_t *e = &s->lcache[id % LCACHE_N];
+    if (e->id==id) return &e->L;
+    /* la riga potrebbe essere ancora nel buffer di scrittura */
+    if (id+1 >= g->nlines - g->ilen && slog_flush(g)<0){ fallback=empty; return &fallback; }
+    size_t ineed = (size_t)(id+2 <= g->nlines ? id+2 : id+1) * sizeof(uint64_t);
+    g->imap = (uint64_t*)slog_map(g->ifd, g->imap, &g->imap_len, ineed);
+    if (!g->imap){ fallback=empty; return &fallback; }
+    uint64_t off = g->imap[id], end = (id+1 < g->nlines) ? g->imap[id+1] : g->size;
+    g->map = (unsigned char*)slog_map(g->fd, g->map, &g->map_len, (size_t)end);
+    if (!g->map || end<=off){ fallback=empty; return &fallback; }
+    size_t n = utf8_decode_buf(g->map + off, (size_t)(end - off - 1), &wb_disk); /* senza '\n' */
+    int colw=-1, narrow=1, enc;
+    size_t sz = line_pack_size(wb_disk.buf, n, &colw, &narrow, &enc);
+    if (sz > e->cap){
+        unsigned char *t = (unsigned char*)realloc(e->L.txt, sz);
+        if (!t){ fallback=empty; return &fallback; }
+        e->L.txt=t; e->cap=sz;
+    }
+    line_pack(&e->L, e->L.txt, wb_disk.buf, n, colw, narrow, enc);
+    e->id = id;
+    return &e->L;
+}
+
+/* ---------- Scrollback freddo ----------
+ * Senza log su disco le righe che escono dal ring non si buttano: a blocchi di COLD_BLOCK diventano
+ * record {cold_rec_t, byte della riga} compressi LZ4 (formato a blocchi, compressore greedy interno).
+ * Un blocco si decomprime solo quando vista o ricerca ci arrivano; i line_t decodificati puntano dentro
+ * il buffer del blocco e restano validi finché la LRU (COLD_LRU blocchi) non lo riusa. */
+typedef struct { int32_t len, colw; unsigned char enc, narrow, hl, pad; uint16_t nruns, pad2; } cold_rec_t;
+static inline size_t line_bytes(const line_t *L){
+    return L->nruns ? line_runs_off(L) + (size_t)L->nruns*sizeof(sgr_run_t) : (size_t)L->len*L->enc + (L->narrow ? 0 : (size_t)L->len);
+}
+static inline uint32_t rd32(const unsigned char *p){ uint32_t v; memcpy(&v, p, 4); return v; }
+static size_t lz_len(unsigned char *o, size_t n){   /* estensione 255,255,..,resto */
+    size_t k=0;
+    for (; n>=255; n-=255) o[k++]=255;
+    o[k++]=(unsigned char)n;
+    return k;
+}
+/* dst deve avere n + n/255 + 16 byte */
+static size_t lz_pack(const unsigned char *src, size_t n, unsigned char *dst){
+    static uint32_t ht[1<<12];          /* posizione+1 per hash dei 4 byte */
+    size_t ip=0, anchor=0, op=0;
+    memset(ht, 0, sizeof ht);
+    if (n >= 13){
+        size_t limit = n-12;            /* gli ultimi byte restano letterali, come vuole il formato */
+        while (ip < limit){
+            uint32_t seq = rd32(src+ip), h = (seq*2654435761u) >> 20;
+            size_t ref = ht[h]; ht[h] = (uint32_t)ip+1;
+            if (!ref || ip-(ref-1) > 65535 || rd32(src+ref-1) != seq){ ip++; continue; }
+            ref--;
+            size_t ml=4; while (ip+ml < n-5 && src[ref+ml]==src[ip+ml]) ml++;
+            size_t lit = ip-anchor;
+            unsigned char *tok = &dst[op++];
+            *tok = (unsigned char)((lit<15 ? lit : 15)<<4 | (ml-4<15 ? ml-4 : 15));
+            if (lit>=15) op += lz_len(dst+op, lit-15);
+            memcpy(dst+op, src+anchor, lit); op += lit;
+            dst[op++] = (unsigned char)(ip-ref); dst[op++] = (unsigned char)((ip-ref)>>8);
+            if (ml-4>=15) op += lz_len(dst+op, ml-4-15);
+            ip += ml; anchor = ip;
+        }
+    }
+    size_t lit = n-anchor;
+    dst[op++] = (unsigned char)((lit<15 ? lit : 15)<<4);
+    if (lit>=15) op += lz_len(dst+op, lit-15);
+    memcpy(dst+op, src+anchor, lit);
+    return op+lit;
+}
+/* Ritorna i byte scritti, (size_t)-1 se il blocco è corrotto */
+static size_t lz_unpack(const unsigned char *src, size_t n, unsigned char *dst, size_t cap){
+    size_t ip=0, op=0;
+    while (ip < n){
+        unsigned t = src[ip++];
+        size_t l = t>>4, ml = t & 15;
+        if (l==15){ unsigned b; do { if (ip>=n) return (size_t)-1; b=src[ip++]; l+=b; } while (b==255); }
+        if (l > n-ip || l > cap-op) return (size_t)-1;
+        memcpy(dst+op, src+ip, l); ip+=l; op+=l;
+        if (ip==n) break;               /* ultima sequenza: solo letterali */
+        if (n-ip < 2) return (size_t)-1;
+        size_t off = (size_t)src[ip] | (size_t)src[ip+1]<<8; ip+=2;
+        if (ml==15){ unsigned b; do { if (ip>=n) return (size_t)-1; b=src[ip++]; ml+=b; } while (b==255); }
+        ml += 4;
+        if (!off || off > op || ml > cap-op) return (size_t)-1;
+        if (off >= ml) memcpy(dst+op, dst+op-off, ml);
+        else for (size_t k=0;k<ml;k++) dst[op+k] = dst[op+k-off];   /* sovrapposto: ripete il motivo */
+        op += ml;
+    }
+    return op;
+}
+/* Le COLD_BLOCK righe più vecchie del ring diventano un blocco; 0 se manca memoria (il ring scarta come prima) */
+static int cold_push(session_t *s){
+    cold_t *c = &s->cold;
+    size_t need=0;
+    for (int i=0;i<COLD_BLOCK;i++) need += sizeof(cold_rec_t) + ((line_bytes(&STORE_AT(s, i))+3) & ~(size_t)3);
+    size_t zneed = need + need/255 + 16;
+    if (need > c->rcap){ unsigned char *t=(unsigned char*)realloc(c->raw, need); n_allocs++; if (!t) return 0; c->raw=t; c->rcap=need; }
+    if (zneed > c->zcap){ unsigned char *t=(unsigned char*)realloc(c->z, zneed); n_allocs++; if (!t) return 0; c->z=t; c->zcap=zneed; }
+    unsigned char *raw = c->raw, *z = c->z;
+    if (!c->blk){
+        c->cap = (int)(s->opt.cold_lines/COLD_BLOCK); if (c->cap<1) c->cap=1;
+        c->blk = (cold_blk_t*)calloc((size_t)c->cap, sizeof(cold_blk_t)); n_allocs++;
+        if (!c->blk) return 0;
+    }
+    size_t o=0;
+    for (int i=0;i<COLD_BLOCK;i++){
+        const line_t *L = &STORE_AT(s, i);
+        cold_rec_t r = { L->len, L->colw, L->enc, L->narrow, L->hl, 0, L->nruns, 0 };
+        size_t nb = line_bytes(L);
+        memcpy(raw+o, &r, sizeof r); o += sizeof r;
+        memcpy(raw+o, L->txt, nb);
+        memset(raw+o+nb, 0, ((nb+3) & ~(size_t)3) - nb); o += (nb+3) & ~(size_t)3;
+    }
+    size_t zl = lz_pack(raw, need, z);
+    unsigned char *keep = (unsigned char*)malloc(zl); n_allocs++;
+    if (!keep) return 0;
+    memcpy(keep, z, zl);
+    if (c->n == c->cap){                /* pieno: via il blocco più vecchio */
+        cold_blk_t *b = &c->blk[c->head];
+        c->zbytes -= b->zlen; c->rawbytes -= b->raw; free(b->z);
+        c->head = (c->head+1) % c->cap; c->n--;
+        if (c->n) c->first_id = c->blk[c->head].first;
+    }
+    if (!c->n) c->first_id = s->store_first_id;
+    cold_blk_t *b = &c->blk[(c->head + c->n) % c->cap];
+    b->z=keep; b->zlen=(uint32_t)zl; b->raw=(uint32_t)need; b->first=s->store_first_id; c->n++;
+    c->zbytes += zl; c->rawbytes += need;
+    for (int i=0;i<COLD_BLOCK;i++) arena_release(&s->arena, STORE_AT(s, i).chunk);
+    s->store_head = (s->store_head+COLD_BLOCK) % STORE_MAX; s->store_count -= COLD_BLOCK; s->store_first_id += COLD_BLOCK;
+    return 1;
+}
+static line_t *cold_line(session_t *s, unsigned long id){
+    static const line_t empty = { .txt=(unsigned char*)"", .nrows=1, .enc=1, .narrow=1 };
+    static line_t fallback;
+    cold_t *c = &s->cold;
+    if (!c->n || id < c->first_id || id >= s->store_first_id){ fallback=empty; return &fallback; }
+    /* ultimo blocco con first <= id: se un cold_push è fallito fra due blocchi ci sono righe perse */
+    int lo=0, hi=c->n;
+    while (hi-lo > 1){ int m=(lo+hi)/2; if (c->blk[(c->head+m) % c->cap].first <= id) lo=m; else hi=m; }
+    int k = lo;
+    unsigned long base = c->blk[(c->head+k) % c->cap].first;
+    if (id - base >= COLD_BLOCK){ fallback=empty; return &fallback; }
+    if (!c->dec){
+        c->dec = (cold_dec_t*)calloc(COLD_LRU, sizeof(cold_dec_t)); n_allocs++;
+        if (!c->dec){ fallback=empty; return &fallback; }
+        for (int i=0;i<COLD_LRU;i++) c->dec[i].base=ROW_NONE;
+    }
+    cold_dec_t *d=NULL, *old=&c->dec[0];
+    for (int i=0;i<COLD_LRU && !d;i++){
+        if (c->dec[i].base==base) d=&c->dec[i];
+        else if (c->dec[i].used < old->used) old=&c->dec[i];
+    }
+    if (!d){
+        const cold_blk_t *b = &c->blk[(c->head + k) % c->cap];
+        d=old; d->base=ROW_NONE;
+        if (b->raw > d->cap){
+            unsigned char *t = (unsigned char*)realloc(d->raw, b->raw); n_allocs++;
+            if (!t){ fallback=empty; return &fallback; }
+            d->raw=t; d->cap=b->raw;
+        }
+        if (lz_unpack(b->z, b->zlen, d->raw, b->raw) != b->raw){ fallback=empty; return &fallback; }
+        unsigned char *p = d->raw;
+        for (int i=0;i<COLD_BLOCK;i++){
+            cold_rec_t r; memcpy(&r, p, sizeof r); p += sizeof r;
+            line_t *L = &d->L[i];
+            L->txt=p; L->chunk=NULL; L->len=r.len; L->colw=r.colw; L->enc=r.enc; L->narrow=r.narrow;
+            L->hl=r.hl; L->nruns=r.nruns; L->wrap_w=0; L->nrows=1;
+            p += (line_bytes(L)+3) & ~(size_t)3;
+        }
+        d->base=base;
+    }
+    d->used = ++c->tick;
+    return &d->L[id-base];
+}
+static void cold_free(cold_t *c){
+    for (int i=0;i<c->n;i++) free(c->blk[(c->head+i) % c->cap].z);
+    free(c->blk); free(c->raw); free(c->z);
+    if (c->dec){ for (int i=0;i<COLD_LRU;i++) free(c->dec[i].raw); free(c->dec); }
+    memset(c, 0, sizeof *c);
+}
+
+/* ---------- Viste filtrate ----------
+ * --filter PATTERN (anche più volte): per filtro l'elenco crescente degli id delle righe che lo
+ * contengono, allungato da add_logical_line a ogni riga (niente riscansioni). PATTERN: alternative
+ * separate da '|', senza distinzione maiuscole/minuscole. Con una vista attiva nel pane ancora,
+ * scroll, disegno e ricerca scorrono le righe con vid_next/vid_prev, ricerche binarie
+ * sull'elenco: cambiare vista costa quanto riempire il pane, qualunque sia lo scrollback. */
+static inline wchar_t fold_wc(wchar_t c);
+static void filt_add(session_t *s, const char *arg){
+    if (s->nfilt == FILT_MAX) die_cleanup("--filter: al massimo %d filtri per sessione", FILT_MAX);
+    size_t n = mbstowcs(NULL, arg, 0);
+    if (n==(size_t)-1 || n==0) die_cleanup("--filter: pattern non valido: %s", arg);
+    filt_t *f = &s->filt[s->nfilt];
+    f->pat = (wchar_t*)malloc((n+1)*sizeof(wchar_t));
+    if (!f->pat) die_cleanup("OOM filtro");
+    mbstowcs(f->pat, arg, n+1);
+    for (size_t i=0;i<n;i++) f->pat[i] = f->pat[i]==L'|' ? L'\0' : fold_wc(f->pat[i]);
+    f->arg=arg; f->plen=n+1;
+    s->nfilt++;
+}
+static void filt_free(session_t *s){
+    for (int i=0;i<s->nfilt;i++){ free(s->filt[i].pat); free(s->filt[i].ids); }
+    s->nfilt=0; s->fv=-1;
+}
+static int filt_match(const filt_t *f, const wchar_t *line, size_t len){
+    for (const wchar_t *a=f->pat; a < f->pat + f->plen; a += wcslen(a)+1){
+        size_t n = wcslen(a);
+        if (!n) continue;
+        for (size_t i=0; i+n<=len; i++){
+            if (fold_wc(line[i])!=a[0]) continue;
+            size_t k=1;
+            while (k<n && fold_wc(line[i+k])==a[k]) k++;
+            if (k==n) return 1;
+        }
+    }
+    return 0;
+}
+static void filt_add_line(session_t *s, unsigned long id, const wchar_t *line, size_t len){
+    unsigned long lo = first_id(s);
+    for (int i=0;i<s->nfilt;i++){
+        filt_t *f = &s->filt[i];
+        while (f->off < f->n && f->ids[f->off] < lo) f->off++;   /* righe uscite dallo scrollback */
+        if (!filt_match(f, line, len)) continue;
+        if (f->n == f->cap){
+            if (f->off && f->off >= f->n/2){ memmove(f->ids, f->ids + f->off, (f->n - f->off)*sizeof(*f->ids)); f->n -= f->off; f->off=0; }
+            else {
+                size_t nc = f->cap ? f->cap*2 : 1024;
+                unsigned long *t = (unsigned long*)realloc(f->ids, nc*sizeof(*f->ids)); n_allocs++;
+                if (!t) continue;
+                f->ids=t; f->cap=nc;
+            }
+        }
+        f->ids[f->n++] = id;
+    }
+}
+static filt_t *vfilt(session_t *s){ return s->fv>=0 ? &s->filt[s->fv] : NULL; }
+/* Primo indice in [off, n) con ids >= id */
+static size_t filt_lower(const filt_t *f, unsigned long id){
+    size_t lo=f->off, hi=f->n;
+    while (lo<hi){ size_t m = lo + (hi-lo)/2; if (f->ids[m] < id) lo=m+1; else hi=m; }
+    return lo;
+}
+/* Riga visibile nel pane dopo / prima di id, prima e ultima; ROW_NONE se non c'è */
+static unsigned long vid_next(session_t *s, unsigned long id){
+    const filt_t *f = vfilt(s);
+    if (!f) return id+1 < store_end_id(s) ? id+1 : ROW_NONE;
+    size_t k = filt_lower(f, id+1 > first_id(s) ? id+1 : first_id(s));
+    return k < f->n ? f->ids[k] : ROW_NONE;
+}
+static unsigned long vid_prev(session_t *s, unsigned long id){
+    const filt_t *f = vfilt(s);
+    unsigned long lo = first_id(s);
+    if (!f) return id > lo ? id-1 : ROW_NONE;
+    size_t k = filt_lower(f, id);
+    return (k > f->off && f->ids[k-1] >= lo) ? f->ids[k-1] : ROW_NONE;
+}
+static unsigned long vid_first(session_t *s){
+    const filt_t *f = vfilt(s);
+    if (!f) return store_end_id(s) > first_id(s) ? first_id(s) : ROW_NONE;
+    size_t k = filt_lower(f, first_id(s));
+    return k < f->n ? f->ids[k] : ROW_NONE;
+}
+static unsigned long vid_last(session_t *s){
+    const filt_t *f = vfilt(s);
+    if (!f) return store_end_id(s) > first_id(s) ? store_end_id(s)-1 : ROW_NONE;
+    return (f->n > f->off && f->ids[f->n-1] >= first_id(s)) ? f->ids[f->n-1] : ROW_NONE;
+}
+/* Righe del pane nella vista corrente (tutte senza filtro) */
+static unsigned long vid_count(session_t *s){
+    const filt_t *f = vfilt(s);
+    unsigned long first = vid_first(s);
+    if (first==ROW_NONE) return 0;
+    if (!f) return store_end_id(s) - first;
+    return (unsigned long)(f->n - filt_lower(f, first));
+}
+static void view_set_bottom(session_t *s);
+/* F8: vista successiva del pane (dopo l'ultimo filtro di nuovo tutte le righe), agganciata in coda */
+static void filt_cycle(session_t *s){
+    if (!s->nfilt) return;
+    s->fv = s->fv+1 < s->nfilt ? s->fv+1 : -1;
+    view_set_bottom(s);
+    s->drawn_valid=0; s->out_dirty=1;
+}
+
+/* ---------- Vista: ancora (riga logica, riga visuale interna) ---------- */
+static void view_clamp(session_t *s){
+    unsigned long first = vid_first(s), last = vid_last(s);
+    if (first==ROW_NONE || s->view_id < first){ s->view_id = first==ROW_NONE ? first_id(s) : first; s->view_row=0; return; }
+    if (s->view_id > last){ s->view_id=last; s->view_row=0; }
+    else if (s->fv>=0 && vid_next(s, s->view_id-1)!=s->view_id){ s->view_id=vid_next(s, s->view_id-1); s->view_row=0; }  /* riga nascosta */
+    int n = line_rows(line_by_id(s, s->view_id), wrap_width());
+    if (s->view_row >= n) s->view_row = n-1;
+    if (s->view_row < 0) s->view_row = 0;
+}
+/* Righe visuali dall'ancora alla fine; smette di contare oltre limit */
+static int rows_below_view(session_t *s, int limit){
+    int width=wrap_width(), n=-s->view_row;
+    for (unsigned long id = vid_last(s)==ROW_NONE ? ROW_NONE : s->view_id; id!=ROW_NONE && n<=limit; id=vid_next(s, id))
+        n += line_rows(line_by_id(s, id), width);
+    return n<0 ? 0 : n;
+}
+/* Ancora tale che l'ultima riga visuale sia in fondo al pane (costo ~ altezza pane) */
+static void view_set_bottom(session_t *s){
+    int width=wrap_width(), need=visible_rows(s);
+    unsigned long first = vid_first(s);
+    s->view_id = first==ROW_NONE ? first_id(s) : first; s->view_row=0;
+    for (unsigned long id=vid_last(s); id!=ROW_NONE; id=vid_prev(s, id)){
+        int n = line_rows(line_by_id(s, id), width);
+        if (n >= need){ s->view_id=id; s->view_row=n-need; break; }
+        need -= n;
+    }
+    s->out_dirty=1;
+}
+static void view_scroll(session_t *s, int delta){
+    int width=wrap_width();
+    unsigned long p;
+    view_clamp(s);
+    if (vid_last(s)==ROW_NONE) return;
+    while (delta<0){
+        if (s->view_row>0){ int k = s->view_row < -delta ? s->view_row : -delta; s->view_row-=k; delta+=k; }
+        else if ((p=vid_prev(s, s->view_id))!=ROW_NONE){ s->view_id=p; s->view_row=line_rows(line_by_id(s, s->view_id), width)-1; delta++; }
+        else break;
+    }
+    while (delta>0){
+        int n = line_rows(line_by_id(s, s->view_id), width);
+        if (s->view_row < n-1){ int k = (n-1-s->view_row) < delta ? (n-1-s->view_row) : delta; s->view_row+=k; delta-=k; }
+        else if ((p=vid_next(s, s->view_id))!=ROW_NONE){ s->view_id=p; s->view_row=0; delta--; }
+        else break;
+    }
+    if (rows_below_view(s, visible_rows(s)) < visible_rows(s)) view_set_bottom(s);
+    s->out_dirty=1;
+}
+
+/* Wrap progressivo in background (a loop inattivo): completa la cache righe/larghezza
+ * partendo dall'ancora, verso il passato (dir<0, dopo PgUp/resize) o verso la coda (dir>0, dopo Home). */
+/* Solo le righe in memoria: quelle del log si wrappano quando servono */
+static void wrap_bg_start(session_t *s, int dir){
+    s->wrap_bg_id=s->view_id; s->wrap_bg_dir = s->store_count>0 ? dir : 0;
+    if (s->wrap_bg_id < s->store_first_id){ if (dir>0) s->wrap_bg_id=s->store_first_id; else s->wrap_bg_dir=0; }
+}
+static int wrap_bg_pending(void){
+    for (int i=0;i<nsess;i++) if (sess[i]->wrap_bg_dir) return 1;
+    return 0;
+}
+static void wrap_bg_step(session_t *s, int budget){
+    int width=wrap_width();
+    while (s->wrap_bg_dir && budget-- > 0){
+        if (s->wrap_bg_id < s->store_first_id || s->wrap_bg_id >= store_end_id(s)){ s->wrap_bg_dir=0; break; }
+        line_rows(line_by_id(s, s->wrap_bg_id), width);
+        if (s->wrap_bg_dir<0 && s->wrap_bg_id==s->store_first_id) s->wrap_bg_dir=0;
+        else s->wrap_bg_id += (s->wrap_bg_dir<0) ? (unsigned long)-1 : 1UL;
+    }
+}
+
+static void slog_append(session_t *s, const wchar_t *line, size_t len);
+static void idx_add_line(session_t *s, unsigned long id, const wchar_t *line, size_t len);
+/* colw<0: larghezza ignota, calcolata qui insieme a narrow; runs (ANSI) vanno in coda al testo */
+static void add_logical_line(session_t *s, const wchar_t *line, size_t len, int colw, int narrow, int follow, const sgr_run_t *runs, size_t nruns){
+    int enc;
+    size_t sz = line_pack_size(line, len, &colw, &narrow, &enc);
+    if (nruns > 0xFFFF) nruns = 0xFFFF;
+    if (nruns) sz = ((sz+3) & ~(size_t)3) + nruns*sizeof(sgr_run_t);
+    arena_chunk_t *chunk = NULL;
+    unsigned char *copy = arena_alloc(&s->arena, sz, &chunk); if (!copy) return;
+    if (s->log.fd>=0) slog_append(s, line, len);
+    idx_add_line(s, store_end_id(s), line, len);
+    if (s->nfilt) filt_add_line(s, store_end_id(s), line, len);
+    if (s->store_count == STORE_MAX && !(s->log.fd<0 && s->opt.cold_lines>0 && cold_push(s))){
+        arena_release(&s->arena, s->store[s->store_head].chunk);
+        s->store_head = (s->store_head+1) % STORE_MAX; s->store_count--; s->store_first_id++;
+    }
+    line_t *L = &STORE_AT(s, s->store_count++);
+    line_pack(L, copy, line, len, colw, narrow, enc);
+    L->chunk=chunk;
+    if (nruns){ memcpy(copy + line_runs_off(L), runs, nruns*sizeof(sgr_run_t)); L->nruns=(unsigned short)nruns; }
+
+    if (follow) view_set_bottom(s);
+    else if (s->view_id < first_id(s)) view_clamp(s);
+    s->out_dirty=1;
+    if (!s->win && !s->activity){ s->activity=1; ui_draw_status(); }
+}
+/* Evidenzia l'ultima riga inserita (trigger highlight) */
+static int add_line_hl(session_t *s){
+    if (s->store_count==0) return 0;
+    STORE_AT(s, s->store_count-1).hl = 1;
+    s->drawn_valid=0; s->out_dirty=1;
+    return 1;
+}
+static void add_logical_line_w(session_t *s, const wchar_t *line, int follow){
+    if (!line) line = L"";
+    add_logical_line(s, line, wcslen(line), -1, 1, follow, NULL, 0);
+}
+/* Al resize non si riwrappa nulla: la cache è per larghezza, basta sistemare l'ancora */
+static void reflow(session_t *s, int keep_bottom){
+    if (keep_bottom) view_set_bottom(s);
+    else view_clamp(s);
+    wrap_bg_start(s, -1);
+    s->out_dirty=1;
+}
+
+/* ---------- Indice e ricerca ----------
+ * La ricerca salta i blocchi il cui filtro non contiene tutti i trigrammi della query e
+ * scandisce solo i candidati; query sotto i 3 char e blocchi non ancora indicizzati si
+ * scandiscono direttamente. I filtri sono al più IDX_SLOTS, a indirizzamento diretto: un
+ * blocco nuovo prende il posto di quello vecchio con lo stesso slot, che la ricerca
+ * ricostruisce dalle sue righe quando ci ripassa. */
+static inline wchar_t fold_wc(wchar_t c){
+    if (c < 0x80) return (c>='A' && c<='Z') ? c+32 : c;
+    return (wchar_t)towlower((wint_t)c);
+}
+static inline uint32_t tri_hash(wchar_t a, wchar_t b, wchar_t c){
+    uint32_t h = (uint32_t)a*0x9E3779B1u ^ (uint32_t)b*0x85EBCA77u ^ (uint32_t)c*0xC2B2AE3Du;
+    h ^= h>>15; h *= 0x2C1B3C6Du; h ^= h>>12;
+    return h;
+}
+static inline void bloom_set(bloom_t *b, uint32_t h){
+    uint32_t b1 = h & (BLOOM_BITS-1), b2 = (h>>16) & (BLOOM_BITS-1);
+    b->w[b1>>6] |= 1ULL<<(b1&63); b->w[b2>>6] |= 1ULL<<(b2&63);
+}
+static inline int bloom_has(const bloom_t *b, uint32_t h){
+    uint32_t b1 = h & (BLOOM_BITS-1), b2 = (h>>16) & (BLOOM_BITS-1);
+    return (b->w[b1>>6]>>(b1&63) & 1) && (b->w[b2>>6]>>(b2&63) & 1);
+}
+/* Filtro del blocco blk; con create lo slot si libera per blk se contiene un blocco più vecchio */
+static bloom_t *idx_block(session_t *s, unsigned long blk, int create){
+    size_t i = (size_t)(blk % IDX_SLOTS);
+    if (i >= s->idx_n){
+        if (!create) return NULL;
+        size_t nc = s->idx_n ? s->idx_n : 16;
+        while (nc <= i) nc *= 2;
+        bloom_t *t = (bloom_t*)realloc(s->idx, nc*sizeof(bloom_t)); n_allocs++;
+        if (!t) return NULL;
+        s->idx=t;
+        unsigned long *tg = (unsigned long*)realloc(s->idx_tag, nc*sizeof(*tg)); n_allocs++;
+        if (!tg) return NULL;
+        s->idx_tag=tg;
+        uint16_t *f = (uint16_t*)realloc(s->idx_fill, nc*sizeof(*f)); n_allocs++;
+        if (!f) return NULL;
+        s->idx_fill=f;
+        for (size_t k=s->idx_n;k<nc;k++) s->idx_tag[k]=ROW_NONE;
+        s->idx_n=nc;
+    }
+    if (s->idx_tag[i]!=blk){
+        if (!create || (s->idx_tag[i]!=ROW_NONE && s->idx_tag[i] > blk)) return NULL;
+        memset(&s->idx[i], 0, sizeof(bloom_t));
+        s->idx_tag[i]=blk; s->idx_fill[i]=0;
+    }
+    return &s->idx[i];
+}
+static void idx_add_line(session_t *s, unsigned long id, const wchar_t *line, size_t len){
+    bloom_t *b = idx_block(s, id/IDX_BLOCK, 1);
+    if (!b) return;
+    s->idx_fill[(id/IDX_BLOCK) % IDX_SLOTS]++;
+    if (len<3) return;
+    wchar_t a = fold_wc(line[0]), c = fold_wc(line[1]);
+    for (size_t i=2;i<len;i++){
+        wchar_t d = fold_wc(line[i]);
+        bloom_set(b, tri_hash(a, c, d));
+        a=c; c=d;
+    }
+}
+/* Filtro del blocco solo se contiene tutte le sue righe */
+static const bloom_t *idx_ready(session_t *s, unsigned long blk){
+    const bloom_t *b = idx_block(s, blk, 0);
+    unsigned long end = store_end_id(s), lo = blk*IDX_BLOCK;
+    unsigned long need = end - lo < IDX_BLOCK ? end - lo : IDX_BLOCK;
+    return b && s->idx_fill[blk % IDX_SLOTS]==need ? b : NULL;
+}
+/* Blocco completo rimasto senza filtro: lo ricostruisce dalle righe (NULL = si scandisce e basta) */
+static const bloom_t *idx_rebuild(session_t *s, unsigned long blk){
+    unsigned long lo = blk*IDX_BLOCK, hi = lo + IDX_BLOCK;
+    if (lo < first_id(s) || hi >= store_end_id(s)) return NULL;      /* in parte perso, o la coda */
+    if (hi > s->idx_bg_id && lo < s->idx_hist_end) return NULL;       /* ci arriva il background */
+    size_t i = (size_t)(blk % IDX_SLOTS);
+    if (i < s->idx_n && s->idx_tag[i]!=ROW_NONE && s->idx_tag[i]*IDX_BLOCK + IDX_BLOCK >= store_end_id(s)) return NULL;
+    if (i < s->idx_n) s->idx_tag[i]=ROW_NONE;
+    bloom_t *b = idx_block(s, blk, 1);
+    if (!b) return NULL;
+    for (unsigned long id=lo; id<hi; id++){
+        const line_t *L = line_by_id(s, id);
+        if (L->len<3) continue;
+        wchar_t a = fold_wc(line_ch(L, 0)), c = fold_wc(line_ch(L, 1));
+        for (size_t k=2;k<(size_t)L->len;k++){
+            wchar_t d = fold_wc(line_ch(L, k));
+            bloom_set(b, tri_hash(a, c, d));
+            a=c; c=d;
+        }
+    }
+    s->idx_fill[i]=IDX_BLOCK;
+    return b;
+}
+static int idx_bg_pending(void){
+    for (int i=0;i<nsess;i++) if (sess[i]->idx_bg_id < sess[i]->idx_hist_end) return 1;
+    return 0;
+}
+/* Indicizza in background le righe del log scritte prima dell'avvio (lettura sequenziale della mappa) */
+static void idx_bg_step(session_t *s, int budget){
+    slog_t *g = &s->log;
+    if (s->idx_bg_id >= s->idx_hist_end) return;
+    g->map = (unsigned char*)slog_map(g->fd, g->map, &g->map_len, (size_t)g->size - g->wlen);
+    if (!g->map){ s->idx_bg_id = s->idx_hist_end; return; }
+    while (budget-- > 0 && s->idx_bg_id < s->idx_hist_end && s->idx_bg_off < g->map_len){
+        const unsigned char *p = g->map + s->idx_bg_off;
+        const unsigned char *nl = memchr(p, '\n', g->map_len - (size_t)s->idx_bg_off);
+        size_t n = nl ? (size_t)(nl - p) : g->map_len - (size_t)s->idx_bg_off;
+        size_t w = utf8_decode_buf(p, n, &wb_idx);
+        idx_add_line(s, s->idx_bg_id, wb_idx.buf, w);
+        s->idx_bg_id++; s->idx_bg_off += n + 1;
+    }
+    if (s->idx_bg_off >= g->map_len) s->idx_bg_id = s->idx_hist_end;
+}
+
+/* Stato ricerca (una alla volta, sulla sessione attiva) */
+static struct {
+    int mode;                           /* 0 = spenta, 1 = digitazione query, 2 = navigazione n/N */
+    wchar_t q[128], fq[128]; size_t qlen; /* query e query minuscola */
+    unsigned long origin, hit; int found;
+} srch;
 
-    werase(win_status);
-    mvwprintw(win_status, 0, 0, "Output SOPRA (verde) — Comandi QUI (bianco). PgUp/PgDn/Home/End scroll. F10 o Ctrl-C: esci. Ctrl-Z: SUB");
-    wrefresh(win_status);
+static long line_find(const line_t *L, size_t from){
+    size_t len=(size_t)L->len, n=srch.qlen;
+    if (n==0) return -1;
+    for (size_t i=from; i+n<=len; i++){
+        if (fold_wc(line_ch(L, i))!=srch.fq[0]) continue;
+        size_t k=1;
+        while (k<n && fold_wc(line_ch(L, i+k))==srch.fq[k]) k++;
+        if (k==n) return (long)i;
+    }
+    return -1;
 }
-static void ui_init(void){
-    setlocale(LC_ALL, "");
-    initscr(); cbreak(); noecho(); timeout(50);
-    start_color(); use_default_colors();
-    init_pair(CP_OUT, COLOR_GREEN, -1);
-    init_pair(CP_IN,  COLOR_WHITE, -1);
-    init_pair(CP_ST,  COLOR_CYAN,  -1);
-    getmaxyx(stdscr, rows, cols);
-    ui_make_windows();
+/* Prima riga con la query da start in direzione dir (-1 più vecchie, +1 più nuove) */
+static int srch_find(session_t *s, unsigned long start, int dir){
+    uint32_t th[126]; size_t nt=0;
+    for (size_t i=2;i<srch.qlen;i++) th[nt++] = tri_hash(srch.fq[i-2], srch.fq[i-1], srch.fq[i]);
+    unsigned long lo=first_id(s), hi=store_end_id(s);
+    if (s->fv>=0){                      /* vista filtrata: solo le sue righe, poche, senza indice */
+        unsigned long id = dir<0 ? vid_prev(s, start+1) : start ? vid_next(s, start-1) : vid_first(s);
+        for (; id!=ROW_NONE; id = dir<0 ? vid_prev(s, id) : vid_next(s, id))
+            if (line_find(line_by_id(s, id), 0)>=0){ srch.hit=id; return 1; }
+        return 0;
+    }
+    for (unsigned long id=start; id>=lo && id<hi; ){
+        unsigned long blk = id/IDX_BLOCK;
+        const bloom_t *b = nt ? idx_ready(s, blk) : NULL;
+        if (nt && !b) b = idx_rebuild(s, blk);
+        if (b){
+            size_t k=0;
+            while (k<nt && bloom_has(b, th[k])) k++;
+            if (k<nt){
+                /* il blocco non può contenere la query: saltalo tutto */
+                if (dir<0){ if (blk*IDX_BLOCK==0) break; id = blk*IDX_BLOCK - 1; }
+                else id = (blk+1)*IDX_BLOCK;
+                continue;
+            }
+        }
+        if (line_find(line_by_id(s, id), 0)>=0){ srch.hit=id; return 1; }
+        id += (unsigned long)(long)dir;
+    }
+    return 0;
 }
-
-/* ---------- Wide helpers (UTF-8 <-> wide) ---------- */
-static wchar_t *utf8_to_wcs_lossy(const char *s){
-    if (!s) return wcsdup(L"");
-    size_t n = strlen(s);
-    mbstate_t st; memset(&st,0,sizeof st);
-    const char *p = s;
-    size_t cap = n+1;
-    wchar_t *out = (wchar_t*)malloc(sizeof(wchar_t)*cap);
-    if (!out) return NULL;
-    size_t o=0;
-    while (*p){
-        wchar_t wc=0;
-        size_t r = mbrtowc(&wc, p, MB_CUR_MAX, &st);
-        if (r==(size_t)-2){ wc=L'?'; r=1; memset(&st,0,sizeof st); }
-        else if (r==(size_t)-1){ wc=L'?'; r=1; memset(&st,0,sizeof st); }
-        else if (r==0){ wc=L'\0'; p++; }
-        if (o+1>=cap){ cap = cap*2 + 8; wchar_t *tmp=realloc(out,sizeof(wchar_t)*cap); if(!tmp){ free(out); return NULL; } out=tmp; }
-        out[o++]=wc;
-        p += (r==0?1:r);
-    }
-    out[o]=L'\0';
-    return out;
+/* Porta il risultato a un terzo del pane; invalida il pane per le evidenziazioni */
+static void srch_show(session_t *s){
+    if (srch.found){ s->view_id=srch.hit; s->view_row=0; view_scroll(s, -(visible_rows(s)/3)); }
+    s->drawn_valid=0; s->out_dirty=1;
 }
 
-/* Espansione TAB -> spazi, tabstop in colonne visuali */
-static wchar_t *expand_tabs_wcs(const wchar_t *in, int tabstop){
-    if (!in) return wcsdup(L"");
-    size_t cap = wcslen(in) + 1;
-    wchar_t *out = (wchar_t*)malloc(sizeof(wchar_t)*cap);
-    if (!out) return NULL;
-    size_t o=0;
-    int col=0;
-    for (size_t i=0; in[i]; ++i){
-        wchar_t ch = in[i];
-        int w = wcwidth(ch);
-        if (ch==L'\t'){
-            int next = tabstop>0 ? ((col/tabstop)+1)*tabstop : col+1;
-            int spaces = next - col;
-            if (spaces<1) spaces=1;
-            if (o+spaces+1>=cap){ cap = cap + spaces + 64; wchar_t *tmp=realloc(out,sizeof(wchar_t)*cap); if(!tmp){ free(out); return NULL; } out=tmp; }
-            for (int k=0;k<spaces;k++){ out[o++]=L' '; }
-            col = next;
-            continue;
+/* ---------- Render ---------- */
+/* Coppia ncurses per fg/bg ANSI (0 = default), creata al primo uso; 0 se i colori finiscono */
+static short sgr_pair_of(unsigned fg, unsigned bg){
+    static short map[17*17]; static short next = CP_DYN;
+    if (!fg && !bg) return CP_OUT;
+    int ncol = COLORS >= 16 ? 16 : 8;
+    short *m = &map[fg*17 + bg];
+    if (*m) return *m;
+    if (next >= COLOR_PAIRS) return CP_OUT;
+    short f = fg ? (short)(fg-1 < (unsigned)ncol ? fg-1 : fg-1-8) : COLOR_GREEN;
+    short b = bg ? (short)(bg-1 < (unsigned)ncol ? bg-1 : bg-1-8) : -1;
+    if (init_pair(next, f, b)==ERR) return CP_OUT;
+    return *m = next++;
+}
+static void sgr_attrs(uint16_t a, attr_t *at, short *pair){
+    unsigned fg = SGR_FG(a), bg = SGR_BG(a);
+    *at = A_NORMAL;
+    if (a & SGR_BOLD) *at |= A_BOLD;
+    if (a & SGR_UNDER) *at |= A_UNDERLINE;
+    if (a & SGR_REV) *at |= A_REVERSE;
+    if (COLORS < 16 && fg > 8) *at |= A_BOLD;   /* bright senza 16 colori: grassetto */
+    *pair = sgr_pair_of(fg, COLORS < 16 && bg > 8 ? bg-8 : bg);
+}
+/* Segmento [o, o+l) a pezzi omogenei: un wattr_set + un waddnwstr per run */
+static void draw_runs(WINDOW *w, int y, const line_t *L, const wchar_t *seg, size_t o, size_t l){
+    const sgr_run_t *r = line_runs(L);
+    int n = L->nruns, k = 0;
+    while (k+1 < n && r[k+1].at <= o) k++;
+    uint16_t a = (r[k].at <= o) ? r[k].attr : 0;
+    if (r[k].at <= o) k++;
+    wmove(w, y, 0);
+    for (size_t p = o, end = o+l; p < end; ){
+        size_t q = (k < n && r[k].at < end) ? r[k].at : end;
+        if (q > p){
+            attr_t at; short pair; sgr_attrs(a, &at, &pair);
+            wattr_set(w, at, pair, NULL);
+            waddnwstr(w, seg + (p-o), (int)(q-p));
+            p = q;
         }
-        if (w<0) w=1; /* non stampabili: considerali 1 */
-        if (o+1>=cap){ cap = cap*2 + 8; wchar_t *tmp=realloc(out,sizeof(wchar_t)*cap); if(!tmp){ free(out); return NULL; } out=tmp; }
-        out[o++]=ch;
-        col += w;
+        if (k < n && r[k].at <= p){ a = r[k].attr; k++; }
     }
-    out[o]=L'\0';
-    return out;
+    wattr_set(w, A_NORMAL, CP_OUT, NULL);
 }
-
-/* ---------- Store & wrap visual (wide) ---------- */
-static void free_visual(void){ for (int i=0;i<vis_count;i++) free(visual[i]); vis_count=0; }
-static void push_visual_w(const wchar_t *s){
-    if (!s) s=L"";
-    wchar_t *copy = wcsdup(s); if (!copy) return;
-    if (vis_count < VIS_MAX) visual[vis_count++] = copy;
-    else {
-        free(visual[0]);
-        memmove(visual, visual+1, sizeof(visual[0])*(VIS_MAX-1));
-        visual[VIS_MAX-1] = copy;
-        if (view_top>0) view_top--;
+static void draw_row(session_t *s, int y, scr_row_t r){
+    /* riga successiva della stessa riga logica: riparti dal segmento precedente */
+    static session_t *last_s=NULL; static unsigned long last_id=ROW_NONE; static int last_row=-1, last_w=0; static size_t last_pos=0;
+    wmove(s->win, y, 0); wclrtoeol(s->win);
+    if (r.id==ROW_NONE) return;
+    line_t *L = line_by_id(s, r.id);
+    int width = wrap_width();
+    size_t pos=0, o=0, l=0; int i=0;
+    if (s==last_s && r.id==last_id && r.row==last_row+1 && width==last_w){ pos=last_pos; i=r.row; }
+    for (; i<=r.row; i++) if (!wrap_next(L, width, &pos, &o, &l)){ l=0; break; }
+    last_s=s; last_id=r.id; last_row=r.row; last_pos=pos; last_w=width;
+    const wchar_t *seg = (cols>0 && l>0) ? line_wcs(L, o, l) : NULL;
+    if (seg && L->nruns && !L->hl) draw_runs(s->win, y, L, seg, o, l);
+    else if (seg && L->hl){ wattron(s->win, COLOR_PAIR(CP_HL)|A_BOLD); mvwaddnwstr(s->win, y, 0, seg, (int)l); wattroff(s->win, COLOR_PAIR(CP_HL)|A_BOLD); }
+    else if (seg) mvwaddnwstr(s->win, y, 0, seg, (int)l);
+    /* occorrenze della ricerca che cadono nel segmento */
+    if (seg && srch.mode && srch.qlen && s==CUR){
+        long m = line_find(L, o > srch.qlen ? o - srch.qlen + 1 : 0);
+        while (m>=0 && (size_t)m < o+l){
+            size_t a = (size_t)m > o ? (size_t)m : o, b = (size_t)m + srch.qlen < o+l ? (size_t)m + srch.qlen : o+l;
+            if (b > a){
+                int x=0, n=0;
+                for (size_t k=o;k<a;k++) x += line_cw(L, k);
+                for (size_t k=a;k<b;k++) n += line_cw(L, k);
+                mvwchgat(s->win, y, x, n, A_REVERSE, L->hl ? CP_HL : CP_OUT, NULL);
+            }
+            m = line_find(L, (size_t)m + 1);
+        }
     }
 }
+static int same_row(scr_row_t a, scr_row_t b){ return a.id==b.id && a.row==b.row; }
+static void render_out(session_t *s){
+    if (!s->win || !s->out_dirty) return;
+    int visible=visible_rows(s), width=wrap_width();
+    scr_row_t *drawn=s->drawn, *want=s->want;
+    view_clamp(s);
+    if (rows_below_view(s, visible) < visible) view_set_bottom(s);
+    s->out_dirty=0;
 
-/* wrap su colonne visuali, evitando split di codepoint; preferisci taglio a spazi/punteggiatura */
-static void wrap_and_push_wide(const wchar_t *line, int width){
-    if (width < 1) width = 1;
-    size_t len = wcslen(line);
-    size_t i = 0;
-    while (i < len){
-        size_t start = i;
-        int col=0, overflow=0;
-        ssize_t last_break = -1;
-        int col_at_last_break = 0;
-
-        while (i < len){
-            wchar_t ch = line[i];
-            int w = wcwidth(ch);
-            if (w < 0) w = 1; /* fallback */
-            /* opportunità di taglio */
-            if (ch==L' ' || iswpunct(ch)) { last_break = (ssize_t)i; col_at_last_break = col + w; }
-
-            if (col + w > width){ overflow=1; break; }
-
-            col += w; i++;
-            if (col==width) { break; }
-        }
-
-        size_t end = i;
-        if (overflow){
-            if (last_break >= (ssize_t)start && col_at_last_break>0){
-                end = (size_t)last_break + 1;
-            } else if (end==start){
-                /* char più largo del width: forza presa di almeno un char */
-                end = start + 1;
+    /* righe che dovrebbero essere a schermo */
+    int y=0, r=s->view_row;
+    for (unsigned long id = vid_last(s)==ROW_NONE ? ROW_NONE : s->view_id; id!=ROW_NONE && y<visible; id=vid_next(s, id), r=0){
+        int n = line_rows(line_by_id(s, id), width);
+        for (; r<n && y<visible; r++, y++){ want[y].id=id; want[y].row=r; }
+    }
+    for (; y<visible; y++){ want[y].id=ROW_NONE; want[y].row=0; }
+
+    int fresh = !s->drawn_valid;
+    if (fresh){
+        werase(s->win);
+        for (y=0; y<visible; y++) drawn[y].id=ROW_NONE;
+        s->drawn_valid=1;
+    } else if (want[0].id!=ROW_NONE && !same_row(want[0], drawn[0])){
+        /* contenuto spostato di k righe (coda seguita o scroll): scroll del terminale */
+        int k;
+        for (k=1; k<visible && !same_row(drawn[k], want[0]); k++) ;
+        if (k<visible){
+            wscrl(s->win, k);
+            memmove(drawn, drawn+k, sizeof(*drawn)*(size_t)(visible-k));
+            for (y=visible-k; y<visible; y++) drawn[y].id=ROW_NONE;
+        } else {
+            for (k=1; k<visible && !same_row(want[k], drawn[0]); k++) ;
+            if (k<visible){
+                wscrl(s->win, -k);
+                memmove(drawn+k, drawn, sizeof(*drawn)*(size_t)(visible-k));
+                for (y=0; y<k; y++) drawn[y].id=ROW_NONE;
             }
         }
+    }
 
-        /* copia segmento [start,end) */
-        size_t seglen = end - start;
-        wchar_t *seg = (wchar_t*)malloc(sizeof(wchar_t)*(seglen+1));
-        if (!seg) return;
-        wmemcpy(seg, line+start, seglen); seg[seglen]=L'\0';
-        push_visual_w(seg);
-        free(seg);
-
-        /* salta spazi successivi all'interruzione per non iniziare la nuova riga con spazio */
-        while (end < len && line[end]==L' ') end++;
-        i = end;
+    /* solo le righe cambiate */
+    int changed=0;
+    for (y=0; y<visible; y++){
+        if (same_row(drawn[y], want[y])) continue;
+        draw_row(s, y, want[y]); drawn[y]=want[y]; changed=1;
     }
+    if (changed || fresh){ wnoutrefresh(s->win); ui_dirty=1; }
 }
-
-static void add_logical_line_w(const wchar_t *line, int follow){
-    wchar_t *copy = wcsdup(line?line:L""); if (!copy) return;
-    if (store_count < STORE_MAX) store[store_count++]=copy;
-    else { free(store[0]); memmove(store, store+1, sizeof(store[0])*(STORE_MAX-1)); store[STORE_MAX-1]=copy; }
-
-    int width = cols - 1; if (width<1) width=1;
-    wrap_and_push_wide(line, width);
-    if (follow) {
-        int visible = rows-2; if (visible<1) visible=1;
-        view_top = vis_count - visible; if (view_top<0) view_top=0;
+/* ---------- Riga di input ----------
+ * Gap buffer: [0,gs) prima del cursore, [ge,cap) dopo, quindi inserire e cancellare al cursore
+ * costa O(1) e spostarlo costa quanto lo spostamento. off = primo char a schermo: si muove solo
+ * quando il cursore esce dalla barra, e il disegno guarda al più una larghezza di barra. */
+typedef struct {
+    wchar_t *buf; size_t cap, gs, ge;
+    size_t off;
+    wchar_t *kill; size_t klen, kcap;   /* ultimo testo tagliato (Ctrl-K/U/W), Ctrl-Y lo reinserisce */
+} ed_t;
+static ed_t ed;
+static size_t ed_len(void){ return ed.cap - (ed.ge - ed.gs); }
+static wchar_t ed_at(size_t i){ return i < ed.gs ? ed.buf[i] : ed.buf[i + (ed.ge - ed.gs)]; }
+static int ed_reserve(size_t more){
+    if (ed.ge - ed.gs >= more) return 1;
+    size_t n = ed_len(), nc = ed.cap ? ed.cap : 256;
+    while (nc - n < more) nc *= 2;
+    wchar_t *t = (wchar_t*)realloc(ed.buf, nc*sizeof(wchar_t));
+    if (!t) return 0;
+    size_t tail = ed.cap - ed.ge;
+    wmemmove(t + nc - tail, t + ed.ge, tail);
+    ed.buf=t; ed.ge = nc - tail; ed.cap=nc;
+    return 1;
+}
+static void ed_insert(const wchar_t *p, size_t n){
+    if (!n || !ed_reserve(n)) return;
+    wmemcpy(ed.buf + ed.gs, p, n); ed.gs += n;
+}
+/* Cursore in pos (0..ed_len()): il gap si sposta con lui */
+static void ed_move(size_t pos){
+    if (pos < ed.gs){ size_t k = ed.gs - pos; ed.gs -= k; ed.ge -= k; wmemmove(ed.buf + ed.ge, ed.buf + ed.gs, k); }
+    else if (pos > ed.gs){ size_t k = pos - ed.gs; wmemmove(ed.buf + ed.gs, ed.buf + ed.ge, k); ed.gs += k; ed.ge += k; }
+}
+/* Toglie [a,b) lasciando il cursore in a; kill: lo copia prima nel buffer di Ctrl-Y */
+static void ed_cut(size_t a, size_t b, int kill){
+    if (a >= b) return;
+    ed_move(b);
+    if (kill){
+        size_t n = b-a;
+        if (n > ed.kcap){ wchar_t *t = (wchar_t*)realloc(ed.kill, n*sizeof(wchar_t)); if (!t) return; ed.kill=t; ed.kcap=n; }
+        wmemcpy(ed.kill, ed.buf + a, n); ed.klen = n;
     }
+    ed.gs = a;
 }
-static void reflow(int keep_bottom){
-    free_visual();
-    int width = cols - 1; if (width<1) width=1;
-    for (int i=0;i<store_count;i++) wrap_and_push_wide(store[i], width);
-    int visible = rows-2; if (visible<1) visible=1;
-    if (keep_bottom) {
-        view_top = vis_count - visible; if (view_top<0) view_top=0;
-    } else {
-        int max_top = vis_count - visible; if (max_top<0) max_top=0;
-        if (view_top>max_top) view_top=max_top;
-        if (view_top<0) view_top=0;
+static void ed_free(void){ free(ed.buf); free(ed.kill); memset(&ed, 0, sizeof ed); }
+static void ed_set(const wchar_t *w){
+    ed.gs=0; ed.ge=ed.cap; ed.off=0;
+    if (w) ed_insert(w, wcslen(w));
+}
+/* Testo intero terminato da NUL (porta il cursore in fondo) */
+static const wchar_t *ed_text(void){
+    ed_move(ed_len());
+    if (!ed_reserve(1)) return L"";
+    ed.buf[ed.gs] = L'\0';
+    return ed.buf;
+}
+static int ed_word(wchar_t c){ return iswalnum((wint_t)c) || c==L'_'; }
+static size_t ed_word_left(size_t i){
+    while (i>0 && !ed_word(ed_at(i-1))) i--;
+    while (i>0 && ed_word(ed_at(i-1))) i--;
+    return i;
+}
+static size_t ed_word_right(size_t i){
+    size_t n = ed_len();
+    while (i<n && !ed_word(ed_at(i))) i++;
+    while (i<n && ed_word(ed_at(i))) i++;
+    return i;
+}
+/* Ctrl-W: fino allo spazio precedente, come nella shell */
+static size_t ed_rubout_left(size_t i){
+    while (i>0 && iswspace((wint_t)ed_at(i-1))) i--;
+    while (i>0 && !iswspace((wint_t)ed_at(i-1))) i--;
+    return i;
+}
+/* Tasto di editing: 1 = consumato (edit = testo cambiato, per la history) */
+static int ed_key(int ch, wint_t wch, int *edit){
+    size_t n = ed_len(), c = ed.gs;
+    *edit = 0;
+    if (ch == KEY_CODE_YES){
+        if (wch == KEY_LEFT){ if (c) ed_move(c-1); }
+        else if (wch == KEY_RIGHT){ if (c<n) ed_move(c+1); }
+        else if (wch == KEY_WORD_LEFT) ed_move(ed_word_left(c));
+        else if (wch == KEY_WORD_RIGHT) ed_move(ed_word_right(c));
+        else if (wch == KEY_DC){ if (c<n){ ed_cut(c, c+1, 0); *edit=1; } }
+        else if (wch == KEY_BACKSPACE){ if (c){ ed_cut(c-1, c, 0); *edit=1; } }
+        else return 0;
+        return 1;
     }
+    if (ch != OK) return 0;
+    switch (wch){
+        case 1:  ed_move(0); break;                                    /* Ctrl-A */
+        case 5:  ed_move(n); break;                                    /* Ctrl-E */
+        case 11: ed_cut(c, n, 1); *edit=1; break;                      /* Ctrl-K */
+        case 21: ed_cut(0, c, 1); *edit=1; break;                      /* Ctrl-U */
+        case 23: ed_cut(ed_rubout_left(c), c, 1); *edit=1; break;      /* Ctrl-W */
+        case 25: ed_insert(ed.kill, ed.klen); *edit=1; break;          /* Ctrl-Y */
+        case 127: case 8: if (c){ ed_cut(c-1, c, 0); *edit=1; } break;
+        default:
+            if (!iswprint(wch)) return 0;
+            { wchar_t w=(wchar_t)wch; ed_insert(&w, 1); *edit=1; }
+    }
+    return 1;
 }
-
-/* ---------- Render ---------- */
-static void render_out(void){
-    werase(win_out);
-    int visible = rows - 2; if (visible<1) visible=1;
-    int max_top = vis_count - visible; if (max_top<0) max_top=0;
-    if (view_top>max_top) view_top=max_top;
-    int y=0;
-    for (int i=view_top; i<vis_count && y<visible; ++i,++y) {
-        if (cols>0) mvwaddnwstr(win_out, y, 0, visual[i], wcslen(visual[i]));
+/* Sistema off per avere il cursore nella barra (room colonne) e ritorna la sua colonna da off */
+static int ed_view(int room){
+    if (ed.off > ed.gs){   /* cursore a sinistra della finestra: un quarto di barra di contesto */
+        size_t i = ed.gs; int col=0;
+        while (i>0 && col + wc_cols(ed_at(i-1)) <= room/4){ col += wc_cols(ed_at(i-1)); i--; }
+        ed.off = i;
     }
-    wrefresh(win_out);
+    size_t i = ed.gs; int col=0;
+    while (i > ed.off){
+        int w = wc_cols(ed_at(i-1));
+        if (col + w > room) break;
+        col += w; i--;
+    }
+    ed.off = i;
+    return col;
 }
+
 static size_t tail_offset_fit(const wchar_t *buf, int maxcols){
     if (maxcols <= 0) return wcslen(buf);
     size_t len = wcslen(buf);
     int col=0;
     ssize_t start = (ssize_t)len;
     for (ssize_t i=(ssize_t)len-1; i>=0; --i){
-        int w = wcwidth(buf[i]); if (w<0) w=1;
+        int w = wc_cols(buf[i]);
         if (col + w > maxcols) break;
         col += w; start = i;
     }
     return (size_t)start;
 }
 
-static void render_input(const wchar_t *buf){
+static void render_input(void){
+    /* in ricerca la barra mostra la query al posto della riga comandi */
     werase(win_in);
-    int room = cols - (int)strlen(PROMPT) - 1; if (room < 0) room = 0;
-    size_t start = tail_offset_fit(buf, room);
-    mvwprintw(win_in, 0, 0, "%s", PROMPT);
-    waddnwstr(win_in, buf + start, wcslen(buf + start));
-    wmove(win_in, 0, (int)strlen(PROMPT) + (int)wcswidth(buf + start, wcslen(buf + start)));
-    wrefresh(win_in);
+    if (hrs.on){
+        const wchar_t *t = hrs.found ? ch_at(&CUR->hist, hrs.hit) : L"";
+        mvwprintw(win_in, 0, 0, "Cronologia `");
+        waddnwstr(win_in, hrs.q, (int)hrs.qlen);
+        int x = getcurx(win_in);
+        wprintw(win_in, "'%s: ", hrs.found || !hrs.qlen ? "" : " [non trovato]");
+        int room = cols - getcurx(win_in) - 1;
+        for (int col=0; *t; t++){ int w=wc_cols(*t); if (col + w > room) break; col += w; waddnwstr(win_in, t, 1); }
+        wmove(win_in, 0, x);
+    }
+    else if (srch.mode){
+        const char *prompt = srch.mode==1 ? "Cerca: " : "Cerca (n/N, Esc): ", *note = "";
+        const wchar_t *buf = srch.q;
+        if (srch.qlen && !srch.found) note = "  [non trovato]";
+        int room = cols - (int)strlen(prompt) - 1; if (room < 0) room = 0;
+        size_t start = tail_offset_fit(buf, room);
+        mvwprintw(win_in, 0, 0, "%s", prompt);
+        waddnwstr(win_in, buf + start, wcslen(buf + start));
+        int x = (int)strlen(prompt);
+        for (const wchar_t *q = buf + start; *q; q++) x += wc_cols(*q);
+        if (*note && x + (int)strlen(note) < cols) waddstr(win_in, note);
+        wmove(win_in, 0, x);
+    } else {
+        int room = cols - (int)strlen(PROMPT) - 1; if (room < 0) room = 0;
+        int x = (int)strlen(PROMPT) + ed_view(room);
+        mvwprintw(win_in, 0, 0, "%s", PROMPT);
+        wchar_t seg[64]; int k=0, col=0;
+        for (size_t i=ed.off, n=ed_len(); i<n; i++){
+            wchar_t c = ed_at(i); int w = wc_cols(c);
+            if (col + w > room) break;
+            col += w; seg[k++] = c;
+            if (k==64){ waddnwstr(win_in, seg, k); k=0; }
+        }
+        if (k) waddnwstr(win_in, seg, k);
+        wmove(win_in, 0, x);
+    }
+    wnoutrefresh(win_in); ui_dirty=1;
 }
 
-/* ---------- Helpers TX ---------- */
-static void send_eol(void){
-    if (opt_cr_only){ char cr='\r'; if (write_all(sockfd,&cr,1)<0) die_cleanup("write: %s", strerror(errno)); }
-    else { char crlf[2]={'\r','\n'}; if (write_all(sockfd,crlf,2)<0) die_cleanup("write: %s", strerror(errno)); }
-    clock_gettime(CLOCK_MONOTONIC, &last_tx_ts);
+/* ---------- Ricerca: tasti ---------- */
+static void srch_start(session_t *s){
+    memset(&srch, 0, sizeof srch);
+    srch.mode = 1;
+    /* parte dall'ultima riga visibile verso le più vecchie */
+    unsigned long id = vid_last(s)==ROW_NONE ? ROW_NONE : s->view_id, last=s->view_id; int r=-s->view_row, width=wrap_width();
+    for (; id!=ROW_NONE; id=vid_next(s, id)){ last=id; r += line_rows(line_by_id(s, id), width); if (r >= visible_rows(s)) break; }
+    srch.origin = last;
 }
-
-/* Duplica ogni IAC (0xFF) in TX, con write_all */
-static void write_telnet_safe(const unsigned char *s, size_t n){
-    for (size_t i=0;i<n;i++){
-        unsigned char c = s[i];
-        if (write_all(sockfd, &c, 1)<0) die_cleanup("write: %s", strerror(errno));
-        if (c == IAC){
-            if (write_all(sockfd, &c, 1)<0) die_cleanup("write: %s", strerror(errno));
+static void srch_stop(session_t *s){
+    srch.mode = 0;
+    s->drawn_valid=0; s->out_dirty=1;
+}
+static void srch_update(session_t *s){
+    for (size_t i=0;i<srch.qlen;i++) srch.fq[i]=fold_wc(srch.q[i]);
+    srch.found = srch.qlen ? srch_find(s, srch.origin, -1) : 0;
+    srch_show(s);
+}
+/* 1 = tasto consumato dalla ricerca */
+static int srch_key(session_t *s, int ch, wint_t wch){
+    int printable = (ch==OK && iswprint(wch));
+    if (ch==OK && (wch==27 || wch==7)){ srch_stop(s); }                 /* Esc / Ctrl-G */
+    else if (srch.mode==1){
+        if (ch==OK && (wch=='\n' || wch=='\r')){ if (srch.qlen) srch.mode=2; else srch_stop(s); }
+        else if ((ch==KEY_CODE_YES && wch==KEY_BACKSPACE) || (ch==OK && (wch==127 || wch==8))){ if (srch.qlen){ srch.q[--srch.qlen]=L'\0'; srch_update(s); } }
+        else if (ch==OK && wch==6){                                      /* Ctrl-F: successiva */
+            if (srch.found && srch.hit>first_id(s) && srch_find(s, srch.hit-1, -1)) srch_show(s);
+        }
+        else if (printable){
+            if (srch.qlen < sizeof(srch.q)/sizeof(srch.q[0])-1){ srch.q[srch.qlen++]=(wchar_t)wch; srch.q[srch.qlen]=L'\0'; srch_update(s); }
+        }
+        else return 0;
+    } else {
+        if (ch==OK && (wch=='n' || wch=='N')){
+            int dir = wch=='n' ? -1 : +1;
+            if (!(dir<0 && srch.hit==first_id(s)) && srch_find(s, srch.hit+(unsigned long)(long)dir, dir)) srch_show(s);
         }
+        else if (ch==OK && wch==6) srch.mode=1;
+        else if (ch==OK && (wch=='\n' || wch=='\r')) srch_stop(s);
+        else { if (printable) srch_stop(s); render_out(s); render_input(); return 0; }
     }
-    clock_gettime(CLOCK_MONOTONIC, &last_tx_ts);
+    render_out(s); render_input();
+    return 1;
 }
 
-static void send_line_utf8_telnet_safe(const char*s){ write_telnet_safe((const unsigned char*)s, strlen(s)); send_eol(); }
+/* ---------- Helpers TX ---------- */
+static int txbuf_reserve(txbuf_t *b, size_t n){
+    if (b->len + n <= b->cap) return 1;
+    size_t nc = b->cap ? b->cap : 1024;
+    while (nc < b->len + n) nc *= 2;
+    unsigned char *t = (unsigned char*)realloc(b->buf, nc);
+    if (!t) return 0;
+    b->buf=t; b->cap=nc; return 1;
+}
+static const char *eol_bytes(session_t *s, size_t *n){ *n = s->opt.cr_only ? 1 : 2; return "\r\n"; }
 
-/* Case-insensitive strstr */
-static const char* istrstr(const char*hay,const char*needle){
-    if(!*needle) return hay; size_t nlen=strlen(needle);
-    for(const char*p=hay; *p; ++p){
-        if (tolower((unsigned char)*p)==tolower((unsigned char)*needle))
-            if (strncasecmp(p,needle,nlen)==0) return p;
+/* Raddoppia ogni IAC (0xFF) in un solo passaggio: copia a blocchi tra un IAC e l'altro */
+static void tx_put_telnet_safe(txbuf_t *b, const unsigned char *s, size_t n){
+    if (!txbuf_reserve(b, 2*n)) die_cleanup("OOM TX");
+    while (n>0){
+        const unsigned char *p = (const unsigned char*)memchr(s, IAC, n);
+        size_t run = p ? (size_t)(p - s) + 1 : n;
+        memcpy(b->buf + b->len, s, run); b->len += run;
+        if (p) b->buf[b->len++] = IAC;
+        s += run; n -= run;
     }
-    return NULL;
+}
+static void tx_put_eol(session_t *s, txbuf_t *b){
+    size_t n; const char *e = eol_bytes(s, &n);
+    if (!txbuf_reserve(b, n)) die_cleanup("OOM TX");
+    memcpy(b->buf + b->len, e, n); b->len += n;
+}
+/* Accoda una riga (payload + EOL) senza spedirla: più comandi partono con un solo tx_flush */
+static void tx_queue_line(session_t *s, const unsigned char *p, size_t n){ tx_put_telnet_safe(&s->txq, p, n); tx_put_eol(s, &s->txq); }
+static void tx_flush(session_t *s){
+    if (s->txq.len==0) return;
+    if (s->sockfd<0){ s->txq.len=0; return; }
+    if (write_all(s->sockfd, s->txq.buf, s->txq.len)<0){ s->txq.len=0; sess_fail(s, "write: %s", strerror(errno)); return; }
+    stats.tx_bytes += s->txq.len;
+    s->txq.len = 0;
+    clock_gettime(CLOCK_MONOTONIC, &s->last_tx_ts);
 }
 
-/* ---------- Autologin ---------- */
-typedef struct { int enabled; int state; char user[128]; char pass[128]; } autologin_prompt_t;
-typedef struct { int enabled; int stage; struct timespec t0, t_pass; long du_ms, dp_ms; char user[128]; char pass[128]; } autologin_blind_t;
+/* Duplica ogni IAC (0xFF) in TX; senza IAC il payload parte così com'è */
+static void write_telnet_safe(session_t *s, const unsigned char *p, size_t n){
+    if (s->sockfd<0) return;
+    if (s->txq.len==0 && !memchr(p, IAC, n)){
+        if (write_all(s->sockfd, p, n)<0){ sess_fail(s, "write: %s", strerror(errno)); return; }
+        clock_gettime(CLOCK_MONOTONIC, &s->last_tx_ts);
+        stats.tx_bytes += n;
+        return;
+    }
+    tx_put_telnet_safe(&s->txq, p, n);
+    tx_flush(s);
+}
+
+/* Riga + EOL con una sola syscall: writev zero-copy se non ci sono IAC, altrimenti via coda */
+static void send_line_telnet_safe(session_t *s, const unsigned char *p, size_t n){
+    if (s->sockfd<0) return;
+    if (s->txq.len==0 && !memchr(p, IAC, n)){
+        size_t en; const char *e = eol_bytes(s, &en);
+        struct iovec iov[2] = { { (void*)p, n }, { (void*)e, en } };
+        if (writev_all(s->sockfd, iov, 2)<0){ sess_fail(s, "write: %s", strerror(errno)); return; }
+        clock_gettime(CLOCK_MONOTONIC, &s->last_tx_ts);
+        stats.tx_bytes += n + en;
+        return;
+    }
+    tx_queue_line(s, p, n);
+    tx_flush(s);
+}
+static void send_line_utf8_telnet_safe(session_t *s, const char*p){ send_line_telnet_safe(s, (const unsigned char*)p, strlen(p)); }
 
-static void autologin_try_prompt(autologin_prompt_t *al, const char *recent){
-    if (!al->enabled || al->state>=2) return;
-    if (al->state==0){
-        if (istrstr(recent,"login:")||istrstr(recent,"user:")||istrstr(recent,"callsign:")){
-            send_line_utf8_telnet_safe(al->user); al->state=1; return;
+/* ---------- Invio a ritmo (paste, --send-file) ---------- */
+static void local_echo_line(session_t *s, const wchar_t *src);
+/* Accoda testo: CRLF e CR diventano '\n', l'ultima riga si chiude se manca */
+static int upl_add(session_t *s, const unsigned char *p, size_t n){
+    upl_t *u = &s->up;
+    if (u->off==u->len){ u->off=u->len=0; u->lines=u->sent=0; }
+    if (u->len + n + 1 > u->cap){
+        size_t nc = u->cap ? u->cap : 4096;
+        while (nc < u->len + n + 1) nc *= 2;
+        unsigned char *t = (unsigned char*)realloc(u->buf, nc);
+        if (!t) return -1;
+        u->buf=t; u->cap=nc;
+    }
+    for (size_t i=0;i<n;i++){
+        unsigned char c=p[i];
+        if (c=='\r'){ if (i+1<n && p[i+1]=='\n') continue; c='\n'; }
+        u->buf[u->len++]=c;
+        if (c=='\n') u->lines++;
+    }
+    if (u->len>u->off && u->buf[u->len-1]!='\n'){ u->buf[u->len++]='\n'; u->lines++; }
+    ui_draw_status();
+    return 0;
+}
+static void upl_cancel(session_t *s, const char *why){
+    upl_t *u = &s->up;
+    if (u->off==u->len) return;
+    wchar_t wmsg[200];
+    swprintf(wmsg, sizeof(wmsg)/sizeof(wmsg[0]), L"*** invio %s: %d/%d righe", why, u->sent, u->lines);
+    add_logical_line_w(s, wmsg, is_following(s));
+    u->off=u->len=0; u->lines=u->sent=0; u->wait_prompt=0;
+    ui_draw_status();
+}
+static int upl_paced(const session_t *s){ return s->opt.pace_bps>0 || s->opt.pace_lps>0; }
+static void ts_add_ms(struct timespec *t, long ms){
+    t->tv_sec += ms/1000; t->tv_nsec += (ms%1000)*1000000L;
+    if (t->tv_nsec >= 1000000000L){ t->tv_sec++; t->tv_nsec -= 1000000000L; }
+}
+/* Spedisce le righe che il budget consente adesso (solo a sessione connessa e sbloccata) */
+static void upl_step(session_t *s){
+    upl_t *u = &s->up;
+    if (!upl_active(s) || s->sockfd<0 || s->input_locked) return;
+    struct timespec now; clock_gettime(CLOCK_MONOTONIC,&now);
+    if (u->wait_prompt){ if (since_ms(u->t_wait, now) < PACE_PROMPT_MS) return; u->wait_prompt=0; }
+    /* il credito non si accumula oltre un secondo di inattività */
+    if (upl_paced(s) && since_ms(u->t_next, now) > 1000) u->t_next=now;
+    size_t batch=0;
+    while (u->off < u->len && batch < UPL_BATCH){
+        if (upl_paced(s) && since_ms(u->t_next, now) < 0) break;
+        const unsigned char *ln = u->buf + u->off;
+        const unsigned char *nl = (const unsigned char*)memchr(ln, '\n', u->len - u->off);
+        size_t n = (size_t)(nl - ln);
+        tx_queue_line(s, ln, n);
+        if (sess_local_echo(s)){
+            size_t w = utf8_decode_buf(ln, n, &wb_echo);
+            if (wb_echo.buf){ wb_echo.buf[w]=L'\0'; local_echo_line(s, wb_echo.buf); }
         }
-    } else if (al->state==1){
-        if (istrstr(recent,"password:")||istrstr(recent,"pass:")||istrstr(recent,"pw:")||istrstr(recent,"enter password")){
-            send_line_utf8_telnet_safe(al->pass); al->state=2; return;
+        u->off += n+1; u->sent++; batch += n+2;
+        if (upl_paced(s)){
+            long ms_b = s->opt.pace_bps>0 ? (long)((n+2)*1000/(size_t)s->opt.pace_bps) : 0;
+            long ms_l = s->opt.pace_lps>0 ? 1000/s->opt.pace_lps : 0;
+            ts_add_ms(&u->t_next, ms_b>ms_l ? ms_b : ms_l);
         }
+        if (s->opt.pace_prompt){ u->wait_prompt=1; u->t_wait=now; break; }
+    }
+    tx_flush(s);
+    if (u->off >= u->len && u->lines){
+        wchar_t wmsg[200];
+        swprintf(wmsg, sizeof(wmsg)/sizeof(wmsg[0]), L"*** invio completato: %d righe", u->sent);
+        add_logical_line_w(s, wmsg, is_following(s));
+        u->off=u->len=0; u->lines=u->sent=0;
+    }
+    if (s==CUR) ui_draw_status();
+}
+static void upl_deadline(const session_t *s, long *wait_ms, struct timespec now){
+    const upl_t *u = &s->up;
+    if (!upl_active(s) || s->input_locked) return;
+    if (u->wait_prompt) deadline_min(wait_ms, PACE_PROMPT_MS - since_ms(u->t_wait, now));
+    else if (upl_paced(s)) deadline_min(wait_ms, -since_ms(u->t_next, now));
+    else deadline_min(wait_ms, 0);
+}
+static int upl_load_file(session_t *s, const char *path){
+    int fd = open(path, O_RDONLY|O_CLOEXEC);
+    if (fd<0) return -1;
+    unsigned char b[65536]; ssize_t r;
+    while ((r = read(fd, b, sizeof b)) > 0) if (upl_add(s, b, (size_t)r)<0){ close(fd); errno=ENOMEM; return -1; }
+    int e=errno; close(fd);
+    if (r<0){ errno=e; return -1; }
+    return 0;
+}
+
+/* Fine di un paste: senza a capo si inserisce al cursore (1 = riga di input cambiata),
+ * altrimenti riga in editing + testo incollato vanno all'invio a ritmo */
+static int paste_finish(session_t *s, const wchar_t *p, size_t n){
+    if (!n) return 0;
+    if (!wmemchr(p, L'\n', n)){
+        for (size_t i=0;i<n;i++) if (iswprint(p[i])) ed_insert(&p[i], 1);
+        return 1;
     }
+    const wchar_t *cur = ed_text(); size_t clen = ed_len();
+    unsigned char *u8 = (unsigned char*)malloc(4*(clen + n)+1);
+    if (!u8) return 0;
+    size_t o=0;
+    for (size_t i=0;i<clen;i++) o += utf8_put(u8+o, cur[i]);
+    for (size_t i=0;i<n;i++) o += utf8_put(u8+o, p[i]);
+    int ok = upl_add(s, u8, o)==0;
+    free(u8);
+    if (ok) ed_set(NULL);
+    return ok;
 }
-static void autologin_try_blind(autologin_blind_t *ab){
+
+/* ---------- Autologin ---------- */
+static void autologin_try_blind(session_t *s){
+    autologin_blind_t *ab = &s->alb;
     if (!ab->enabled || ab->stage>=2) return;
     struct timespec now; clock_gettime(CLOCK_MONOTONIC,&now);
     long ms=since_ms(ab->t0, now);
-    if (ab->stage==0 && ms>=ab->du_ms){ send_line_utf8_telnet_safe(ab->user); ab->stage=1; return; }
-    if (ab->stage==1 && ms>=ab->dp_ms){ send_line_utf8_telnet_safe(ab->pass); ab->stage=2; ab->t_pass=now; return; }
+    if (ab->stage==0 && ms>=ab->du_ms){ send_line_utf8_telnet_safe(s, ab->user); ab->stage=1; return; }
+    if (ab->stage==1 && ms>=ab->dp_ms){ send_line_utf8_telnet_safe(s, ab->pass); ab->stage=2; ab->t_pass=now; return; }
 }
 
 /* Helper: stiamo seguendo la coda? */
-static int is_following(void){
-    int visible = rows-2; if (visible<1) visible=1;
-    return (view_top + visible >= vis_count-1);
+static int is_following(session_t *s){
+    int visible = visible_rows(s);
+    return rows_below_view(s, visible+1) <= visible+1;
 }
 
 /* Echo locale (riga) nell'output */
-static void local_echo_line(const wchar_t *src){
-    int follow = is_following();
+static void local_echo_line(session_t *s, const wchar_t *src){
+    int follow = is_following(s);
     size_t pfx = 2; /* "> " */
     size_t L = wcslen(src);
     wchar_t *echo = (wchar_t*)malloc(sizeof(wchar_t)*(pfx+L+1));
     if (echo){
         echo[0]=L'>'; echo[1]=L' '; wmemcpy(echo+2, src, L); echo[pfx+L]=L'\0';
-        add_logical_line_w(echo, follow);
+        add_logical_line_w(s, echo, follow);   /* out_dirty: la disegna il frame successivo */
         free(echo);
-        render_out();
     }
 }
 
-/* ---------- History comandi ---------- */
-#define HIST_MAX 200
-static wchar_t *hist[HIST_MAX];
-static int hist_count = 0;
-static int hist_pos = -1; /* -1 = non in navigazione; 0..hist_count-1 = indice in history (0 = più vecchio) */
-/* backup della riga in editing quando si entra in history con ↑ */
-static wchar_t edit_backup[4096];
+/* ---------- History comandi ----------
+ * Per nodo (host_port.hist): una riga UTF-8 per invio, solo in coda; al caricamento vince
+ * l'ultima occorrenza e il file si riscrive compatto se è più del doppio delle voci vive.
+ * ↑/↓ con testo in editing scorrono solo le voci che iniziano così (range dell'indice
+ * ordinato); Ctrl-R cerca all'indietro una sottostringa (maiuscole = minuscole). */
+static wchar_t *edit_backup;            /* riga in editing quando si entra in history con ↑ (= prefisso) */
 static int edit_saved = 0;
+static struct { int on; unsigned long id; } hnav;   /* voce mostrata da ↑/↓ */
+/* Id delle voci che iniziano col prefisso di ↑/↓, crescenti: si rifà solo se cambiano prefisso o history */
+static struct { const cmdhist_t *h; unsigned long gen; wchar_t *p; unsigned long *ids; size_t n, cap; } chp;
 
 static void history_free_all(void){
-    for (int i=0;i<hist_count;i++){ free(hist[i]); }
-    hist_count=0; hist_pos=-1;
+    free(edit_backup); edit_backup=NULL;
+    edit_saved=0; hnav.on=0;
+    free(chp.p); free(chp.ids); memset(&chp, 0, sizeof chp);
 }
-static void history_push(const wchar_t *wline){
-    if (!wline || !*wline) return;
-    if (hist_count>0 && wcscmp(hist[hist_count-1], wline)==0) return; /* evita duplicati consecutivi */
-    wchar_t *cpy = wcsdup(wline);
-    if (!cpy) return;
-    if (hist_count < HIST_MAX){
-        hist[hist_count++] = cpy;
-    } else {
-        free(hist[0]);
-        memmove(hist, hist+1, sizeof(hist[0])*(HIST_MAX-1));
-        hist[HIST_MAX-1] = cpy;
+static void ch_free(cmdhist_t *h){
+    if (chp.h==h) chp.h=NULL;
+    if (h->ring) for (unsigned long id=h->first; id<h->end; id++) free(h->ring[id % CMDHIST_MAX]);
+    free(h->ring); free(h->hs); free(h->tn);
+    if (h->fd>=0) close(h->fd);
+    memset(h, 0, sizeof *h); h->fd=-1;
+}
+static uint32_t ch_hash(const wchar_t *w){
+    uint32_t x = 2166136261u;
+    for (; *w; w++){ x ^= (uint32_t)*w; x *= 16777619u; }
+    return x & (CMDHIST_HS-1);
+}
+/* Slot della voce viva con testo w, -1 se non c'è */
+static int32_t ch_find(const cmdhist_t *h, const wchar_t *w){
+    for (uint32_t i = ch_hash(w); h->hs[i]; i = (i+1) & (CMDHIST_HS-1))
+        if (!wcscmp(h->ring[h->hs[i]-1], w)) return h->hs[i]-1;
+    return -1;
+}
+static void ch_hs_add(cmdhist_t *h, int32_t slot){
+    uint32_t i = ch_hash(h->ring[slot]);
+    while (h->hs[i]) i = (i+1) & (CMDHIST_HS-1);
+    h->hs[i] = slot+1;
+}
+/* Toglie slot (testo ancora in ring) e ricompatta il cluster: niente lapidi */
+static void ch_hs_del(cmdhist_t *h, int32_t slot){
+    uint32_t i = ch_hash(h->ring[slot]), j;
+    while (h->hs[i] != slot+1) i = (i+1) & (CMDHIST_HS-1);
+    for (j = (i+1) & (CMDHIST_HS-1); h->hs[j]; j = (j+1) & (CMDHIST_HS-1)){
+        uint32_t k = ch_hash(h->ring[h->hs[j]-1]);
+        if (i<=j ? (k<=i || k>j) : (k<=i && k>j)){ h->hs[i]=h->hs[j]; i=j; }
+    }
+    h->hs[i]=0;
+}
+/* Albero AVL sugli slot, per testo (unico grazie al dedup) */
+static inline int ch_ht(const cmdhist_t *h, int32_t n){ return n<0 ? 0 : h->tn[n].ht; }
+static void ch_fix(cmdhist_t *h, int32_t n){
+    int a = ch_ht(h, h->tn[n].l), b = ch_ht(h, h->tn[n].r);
+    h->tn[n].ht = (a>b ? a : b) + 1;
+}
+static int32_t ch_rot(cmdhist_t *h, int32_t n, int left){
+    int32_t x;
+    if (left){ x=h->tn[n].r; h->tn[n].r=h->tn[x].l; h->tn[x].l=n; }
+    else { x=h->tn[n].l; h->tn[n].l=h->tn[x].r; h->tn[x].r=n; }
+    ch_fix(h, n); ch_fix(h, x);
+    return x;
+}
+static int32_t ch_bal(cmdhist_t *h, int32_t n){
+    chnode_t *t = h->tn;
+    ch_fix(h, n);
+    int d = ch_ht(h, t[n].l) - ch_ht(h, t[n].r);
+    if (d>1){ if (ch_ht(h, t[t[n].l].l) < ch_ht(h, t[t[n].l].r)) t[n].l = ch_rot(h, t[n].l, 1); return ch_rot(h, n, 0); }
+    if (d<-1){ if (ch_ht(h, t[t[n].r].r) < ch_ht(h, t[t[n].r].l)) t[n].r = ch_rot(h, t[n].r, 0); return ch_rot(h, n, 1); }
+    return n;
+}
+static int32_t ch_ins(cmdhist_t *h, int32_t n, int32_t slot){
+    if (n<0){ h->tn[slot] = (chnode_t){ -1, -1, 1 }; return slot; }
+    if (wcscmp(h->ring[slot], h->ring[n]) < 0) h->tn[n].l = ch_ins(h, h->tn[n].l, slot);
+    else h->tn[n].r = ch_ins(h, h->tn[n].r, slot);
+    return ch_bal(h, n);
+}
+static int32_t ch_delmin(cmdhist_t *h, int32_t n, int32_t *min){
+    if (h->tn[n].l<0){ *min=n; return h->tn[n].r; }
+    h->tn[n].l = ch_delmin(h, h->tn[n].l, min);
+    return ch_bal(h, n);
+}
+static int32_t ch_del(cmdhist_t *h, int32_t n, int32_t slot){
+    if (n<0) return -1;
+    int c = n==slot ? 0 : wcscmp(h->ring[slot], h->ring[n]);
+    if (c<0) h->tn[n].l = ch_del(h, h->tn[n].l, slot);
+    else if (c>0) h->tn[n].r = ch_del(h, h->tn[n].r, slot);
+    else {
+        int32_t l = h->tn[n].l, r = h->tn[n].r, m;
+        if (l<0) return r;
+        if (r<0) return l;
+        h->tn[n].r = -1;
+        r = ch_delmin(h, r, &m);
+        h->tn[m].l=l; h->tn[m].r=r; n=m;
+    }
+    return ch_bal(h, n);
+}
+/* Albero bilanciato da slot già ordinati per testo */
+static int32_t ch_build(cmdhist_t *h, const int32_t *ord, size_t lo, size_t hi){
+    if (lo>=hi) return -1;
+    size_t m = lo + (hi-lo)/2;
+    int32_t n = ord[m];
+    h->tn[n].l = ch_build(h, ord, lo, m);
+    h->tn[n].r = ch_build(h, ord, m+1, hi);
+    ch_fix(h, n);
+    return n;
+}
+/* Voce viva: via da hash e albero (il testo resta al chiamante) */
+static wchar_t *ch_unlink(cmdhist_t *h, int32_t slot){
+    wchar_t *w = h->ring[slot];
+    ch_hs_del(h, slot);
+    if (!h->bulk) h->root = ch_del(h, h->root, slot);
+    h->ring[slot]=NULL; h->nlive--;
+    return w;
+}
+/* Nuova voce (o ripetizione portata in cima); write = anche sul file */
+static void ch_add(cmdhist_t *h, const wchar_t *w, int write){
+    if (h->end > h->first && ch_at(h, h->end-1) && !wcscmp(ch_at(h, h->end-1), w)) return;   /* già l'ultima */
+    h->gen++;
+    if (h->end - h->first == CMDHIST_MAX){           /* ring pieno: esce la più vecchia */
+        int32_t old = (int32_t)(h->first % CMDHIST_MAX);
+        if (h->ring[old]) free(ch_unlink(h, old));
+        h->first++;
+    }
+    int32_t k = ch_find(h, w);
+    wchar_t *txt = k>=0 ? ch_unlink(h, k) : wcsdup(w);
+    if (!txt) return;
+    int32_t slot = (int32_t)(h->end++ % CMDHIST_MAX);
+    h->ring[slot] = txt; h->nlive++;
+    ch_hs_add(h, slot);
+    if (!h->bulk) h->root = ch_ins(h, h->root, slot);
+    if (write && h->fd>=0){
+        size_t n = wcslen(w);
+        unsigned char *u8 = (unsigned char*)malloc(4*n+1);
+        if (!u8) return;
+        size_t o=0;
+        for (size_t i=0;i<n;i++) o += utf8_put(u8+o, w[i]);
+        u8[o++]='\n';
+        if (write_all(h->fd, u8, o)<0){ close(h->fd); h->fd=-1; }   /* disco pieno: si prosegue in memoria */
+        free(u8);
+    }
+}
+static void ch_path(const session_t *s, char *path, size_t cap){
+    const char *dir = s->opt.history_dir;
+    char def[512];
+    if (!dir){
+        const char *home = getenv("HOME");
+        if (!home || !*home){ path[0]=0; return; }
+        snprintf(def, sizeof def, "%s/.bpqchat", home);
+        if (mkdir(def, 0700)<0 && errno!=EEXIST){ path[0]=0; return; }
+        dir = def;
+    }
+    if (!*dir){ path[0]=0; return; }
+    char name[300];
+    snprintf(name, sizeof name, "%s_%s", s->host, s->port);
+    for (char *c=name; *c; c++) if (!isalnum((unsigned char)*c) && *c!='.' && *c!='-') *c='_';
+    snprintf(path, cap, "%s/%s.hist", dir, name);
+}
+/* Riscrive il file con le sole voci vive, dalla più vecchia (tmp + rename) */
+static void ch_compact(cmdhist_t *h, const char *path){
+    char tmp[1100]; snprintf(tmp, sizeof tmp, "%s.tmp", path);
+    FILE *f = fopen(tmp, "we");
+    if (!f) return;
+    unsigned char u8[16];
+    for (unsigned long id=h->first; id<h->end; id++){
+        const wchar_t *w = ch_at(h, id);
+        if (!w) continue;
+        for (; *w; w++) fwrite(u8, 1, utf8_put(u8, *w), f);
+        fputc('\n', f);
+    }
+    if (fclose(f)==0 && rename(tmp, path)==0){
+        close(h->fd);
+        h->fd = open(path, O_WRONLY|O_APPEND|O_CLOEXEC);
+    } else unlink(tmp);
+}
+static const cmdhist_t *ch_sort_h;
+static int ch_cmp_slot(const void *a, const void *b){
+    return wcscmp(ch_sort_h->ring[*(const int32_t*)a], ch_sort_h->ring[*(const int32_t*)b]);
+}
+/* Fine caricamento: slot vivi ordinati per testo con un qsort, albero costruito bilanciato */
+static void ch_bulk_end(cmdhist_t *h){
+    int32_t *ord = (int32_t*)malloc((h->nlive ? h->nlive : 1)*sizeof(int32_t));
+    size_t n=0;
+    h->bulk=0; h->root=-1;
+    if (!ord){                          /* senza memoria: inserimenti uno a uno */
+        for (unsigned long id=h->first; id<h->end; id++)
+            if (ch_at(h, id)) h->root = ch_ins(h, h->root, (int32_t)(id % CMDHIST_MAX));
+        return;
+    }
+    for (unsigned long id=h->first; id<h->end; id++) if (ch_at(h, id)) ord[n++] = (int32_t)(id % CMDHIST_MAX);
+    ch_sort_h = h;
+    qsort(ord, n, sizeof(*ord), ch_cmp_slot);
+    h->root = ch_build(h, ord, 0, n);
+    free(ord);
+}
+/* Caricamento al primo uso (o a loop inattivo): senza file la history resta in memoria */
+static void ch_load(session_t *s){
+    cmdhist_t *h = &s->hist;
+    if (h->loaded) return;
+    h->loaded = 1;
+    h->ring = (wchar_t**)calloc(CMDHIST_MAX, sizeof(wchar_t*));
+    h->hs = (int32_t*)calloc(CMDHIST_HS, sizeof(int32_t));
+    h->tn = (chnode_t*)malloc(CMDHIST_MAX*sizeof(chnode_t));
+    h->root = -1;
+    if (!h->ring || !h->hs || !h->tn){ free(h->ring); free(h->hs); free(h->tn); h->ring=NULL; h->hs=NULL; h->tn=NULL; return; }
+    char path[1024]; ch_path(s, path, sizeof path);
+    if (!path[0]) return;
+    h->fd = open(path, O_RDWR|O_CREAT|O_APPEND|O_CLOEXEC, 0600);
+    if (h->fd<0) return;
+    struct stat st;
+    if (fstat(h->fd, &st)<0 || st.st_size==0) return;
+    unsigned char *m = (unsigned char*)mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, h->fd, 0);
+    if (m==MAP_FAILED) return;
+    wbuf_t wb = {0};
+    unsigned long nfile=0;
+    h->bulk = 1;                        /* prima il ring, poi un solo ordinamento per l'albero */
+    for (size_t off=0, sz=(size_t)st.st_size; off<sz; ){
+        const unsigned char *nl = (const unsigned char*)memchr(m+off, '\n', sz-off);
+        size_t n = nl ? (size_t)(nl-(m+off)) : sz-off;
+        if (n){
+            size_t w = utf8_decode_buf(m+off, n, &wb);
+            if (w){ wb.buf[w]=L'\0'; ch_add(h, wb.buf, 0); nfile++; }
+        }
+        off += n+1;
     }
+    munmap(m, (size_t)st.st_size);
+    free(wb.buf);
+    ch_bulk_end(h);
+    if (nfile > 2*h->nlive + 1000) ch_compact(h, path);
 }
-static int history_prev(wchar_t *dst, size_t dstcap){
-    if (hist_count==0) return 0;
-    if (hist_pos==-1) hist_pos = hist_count-1;
-    else if (hist_pos>0) hist_pos--;
-    wcsncpy(dst, hist[hist_pos], dstcap-1);
-    dst[dstcap-1]=L'\0';
+static int cmp_ulong(const void *a, const void *b){
+    unsigned long x = *(const unsigned long*)a, y = *(const unsigned long*)b;
+    return x<y ? -1 : x>y;
+}
+/* Id delle voci del sottoalbero n che iniziano con p, in chp.ids */
+static void ch_range(const cmdhist_t *h, int32_t n, const wchar_t *p, size_t plen){
+    while (n>=0){
+        int c = wcsncmp(h->ring[n], p, plen);
+        if (c<0){ n = h->tn[n].r; continue; }
+        if (c>0){ n = h->tn[n].l; continue; }
+        ch_range(h, h->tn[n].l, p, plen);
+        chp.ids[chp.n++] = h->first + ((unsigned long)n + CMDHIST_MAX - h->first % CMDHIST_MAX) % CMDHIST_MAX;
+        n = h->tn[n].r;
+    }
+}
+/* Riempie chp col range di p nell'albero, riordinato per id; 0 se manca memoria */
+static int ch_prefix_ids(const cmdhist_t *h, const wchar_t *p, size_t plen){
+    if (chp.h==h && chp.gen==h->gen && chp.p && !wcscmp(chp.p, p)) return 1;
+    chp.h=NULL;
+    if (h->nlive > chp.cap){
+        unsigned long *t = (unsigned long*)realloc(chp.ids, h->nlive*sizeof(*t)); n_allocs++;
+        if (!t) return 0;
+        chp.ids=t; chp.cap=h->nlive;
+    }
+    wchar_t *c = wcsdup(p);
+    if (!c) return 0;
+    free(chp.p); chp.p=c;
+    chp.n=0;
+    ch_range(h, h->root, p, plen);
+    qsort(chp.ids, chp.n, sizeof(*chp.ids), cmp_ulong);
+    chp.h=h; chp.gen=h->gen;
     return 1;
 }
-static int history_next(wchar_t *dst, size_t dstcap){
-    if (hist_count==0 || hist_pos==-1) return 0;
-    if (hist_pos < hist_count-1){
-        hist_pos++;
-        wcsncpy(dst, hist[hist_pos], dstcap-1);
-        dst[dstcap-1]=L'\0';
+/* Voce viva più recente prima di id (dir<0) o la più vecchia dopo (dir>0) che inizia con p;
+ * ULONG_MAX se non c'è. Con prefisso: ricerca binaria negli id del suo range (chp). */
+static unsigned long ch_step(const cmdhist_t *h, unsigned long id, int dir, const wchar_t *p){
+    size_t plen = p ? wcslen(p) : 0;
+    if (!h->ring) return (unsigned long)-1;
+    if (!plen){
+        if (dir<0){ while (id > h->first){ id--; if (ch_at(h, id)) return id; } }
+        else { while (id+1 < h->end){ id++; if (ch_at(h, id)) return id; } }
+        return (unsigned long)-1;
+    }
+    if (!ch_prefix_ids(h, p, plen)) return (unsigned long)-1;
+    size_t lo=0, hi=chp.n;              /* primo con id > id (dir>0) o >= id (dir<0) */
+    while (lo<hi){ size_t m = lo + (hi-lo)/2; if (dir>0 ? chp.ids[m] <= id : chp.ids[m] < id) lo=m+1; else hi=m; }
+    if (dir<0) return lo ? chp.ids[lo-1] : (unsigned long)-1;
+    return lo<chp.n ? chp.ids[lo] : (unsigned long)-1;
+}
+static const wchar_t *history_prev(session_t *s){
+    cmdhist_t *h = &s->hist;
+    ch_load(s);
+    unsigned long id = ch_step(h, hnav.on ? hnav.id : h->end, -1, edit_backup);
+    if (id==(unsigned long)-1) return NULL;
+    hnav.on=1; hnav.id=id;
+    return ch_at(h, id);
+}
+static const wchar_t *history_next(session_t *s){
+    cmdhist_t *h = &s->hist;
+    if (!hnav.on) return NULL;
+    unsigned long id = ch_step(h, hnav.id, +1, edit_backup);
+    if (id!=(unsigned long)-1){ hnav.id=id; return ch_at(h, id); }
+    /* dopo l'ultima: torna la riga in editing */
+    hnav.on=0;
+    return L"";
+}
+static void history_push(session_t *s, const wchar_t *wline){
+    if (!wline || !*wline) return;
+    ch_load(s);
+    if (s->hist.ring) ch_add(&s->hist, wline, 1);
+}
+
+/* Ctrl-R: sottostringa senza distinzione maiuscole, dalla voce id verso il passato */
+static int hrs_match(const wchar_t *t){
+    size_t n = hrs.qlen;
+    if (!n) return 1;
+    for (; *t; t++){
+        size_t k=0;
+        while (k<n && t[k] && fold_wc(t[k])==fold_wc(hrs.q[k])) k++;
+        if (k==n) return 1;
+    }
+    return 0;
+}
+static void hrs_find(const cmdhist_t *h, unsigned long from){
+    hrs.found=0;
+    if (!h->ring) return;
+    for (unsigned long id=from+1; id-- > h->first; ){
+        const wchar_t *t = ch_at(h, id);
+        if (t && hrs_match(t)){ hrs.found=1; hrs.hit=id; return; }
+    }
+}
+/* 1 = tasto consumato; 0 = ricerca chiusa con la voce trovata nella riga, il tasto va gestito */
+static int hrs_key(session_t *s, int ch, wint_t wch){
+    cmdhist_t *h = &s->hist;
+    if (ch==OK && (wch==27 || wch==7)){ hrs.on=0; return 1; }      /* Esc / Ctrl-G: riga invariata */
+    if (ch==OK && wch==18){                                         /* Ctrl-R: occorrenza precedente */
+        if (hrs.found && hrs.hit > h->first){ unsigned long prev=hrs.hit; hrs_find(h, hrs.hit-1); if (!hrs.found){ hrs.found=1; hrs.hit=prev; } }
         return 1;
-    } else {
-        /* dopo l'ultima: svuota buffer e reset pos */
-        hist_pos=-1;
-        dst[0]=L'\0';
+    }
+    if ((ch==KEY_CODE_YES && wch==KEY_BACKSPACE) || (ch==OK && (wch==127 || wch==8))){
+        if (hrs.qlen){ hrs.q[--hrs.qlen]=L'\0'; hrs_find(h, h->end-1); }
+        return 1;
+    }
+    if (ch==OK && iswprint(wch)){
+        if (hrs.qlen < sizeof(hrs.q)/sizeof(hrs.q[0])-1){ hrs.q[hrs.qlen++]=(wchar_t)wch; hrs.q[hrs.qlen]=L'\0'; hrs_find(h, hrs.found ? hrs.hit : h->end-1); }
         return 1;
     }
+    hrs.on=0;
+    if (hrs.found){ ed_set(ch_at(h, hrs.hit)); hnav.on=0; edit_saved=0; }
+    return 0;
+}
+static void hrs_start(session_t *s){
+    ch_load(s);
+    hrs.on=1; hrs.qlen=0; hrs.q[0]=L'\0';
+    hrs_find(&s->hist, s->hist.end-1);
+}
+
+/* ---------- RX e timer di sessione ---------- */
+/* Un chunk ricevuto: decoder + risposte */
+static void sess_rx_chunk(session_t *s, const unsigned char *in, size_t n){
+    stats.rx_bytes += n;
+    size_t text = rx_feed(s, in, n);
+    tx_flush(s);                        /* risposte di negoziazione (e YAPP) del chunk, un solo write */
+    if (s->xf.mode && s==CUR) ui_draw_status();
+    if (!text) return;
+
+    clock_gettime(CLOCK_MONOTONIC,&s->last_rx);
+    /* da qui in poi i prompt possono sbloccare l'input (non quello che ha chiesto la password) */
+    if (s->login_done_flag || s->alb.stage==2) s->unlock_armed=1;
+}
+/* Svuota l'anello RX della sessione (al più RX_ROUND byte per giro, il resto al prossimo) */
+#define RX_ROUND (256*1024)
+static void sess_rx(session_t *s){
+    rxring_t *r = &s->rr;
+    int eof = atomic_load(&r->eof);     /* prima dei dati: quelli arrivati prima della chiusura si leggono tutti */
+    uint64_t ta = atomic_exchange_explicit(&r->t_arrive, 0, memory_order_relaxed);
+    if (ta && s->ka_t0){ if (ta > s->ka_t0) hist_add(&stats.ka_rtt, ta - s->ka_t0); s->ka_t0=0; }
+    size_t done=0;
+    while (done < RX_ROUND){
+        const unsigned char *p;
+        size_t n = rxring_peek(r, &p);
+        if (!n) break;
+        if (n > 16384) n = 16384;
+        sess_rx_chunk(s, p, n);
+        if (s->sockfd<0) return;        /* chiusa durante il chunk (write fallita) */
+        rxring_consume(r, n); done += n;
+    }
+    if (ta && s->out_dirty && !s->lat_t0) s->lat_t0 = ta;   /* si chiude quando il frame è a schermo */
+    if (done < RX_ROUND && eof){
+        if (eof<0) sess_fail(s, NULL);
+        else sess_fail(s, "read(sock): %s", strerror(eof));
+    }
+}
+/* Scadenze della sessione per il poll() */
+static void sess_deadline(session_t *s, long *wait_ms, struct timespec now){
+    if (conn_pending(s)){ conn_deadline(s, wait_ms, now); return; }
+    if (s->sockfd<0) return;
+    if (s->alb.enabled && s->alb.stage<2) deadline_min(wait_ms, (s->alb.stage==0 ? s->alb.du_ms : s->alb.dp_ms) - since_ms(s->alb.t0, now));
+    if (s->input_locked && (s->login_done_flag || s->alb.stage==2))
+        deadline_min(wait_ms, s->opt.unlock_delay_ms - since_ms(s->login_done_flag ? s->t_login_done : s->alb.t_pass, now));
+    if (s->input_locked && s->unlock_seen) deadline_min(wait_ms, s->opt.unlock_quiet_ms - since_ms(s->last_rx, now));
+    if (s->opt.keepalive_secs > 0) deadline_min(wait_ms, s->opt.keepalive_secs*1000L - since_ms(s->last_tx_ts, now));
+    upl_deadline(s, wait_ms, now);
+}
+static void sess_timers(session_t *s){
+    if (conn_pending(s)){ conn_timers(s); return; }
+    if (s->sockfd<0) return;
+    if (s->alb.enabled && s->alb.stage<2) autologin_try_blind(s);
+
+    /* Sblocco input su timeout post-login */
+    if (s->input_locked && (s->login_done_flag || s->alb.stage==2)){
+        struct timespec now; clock_gettime(CLOCK_MONOTONIC,&now);
+        struct timespec t0 = s->login_done_flag ? s->t_login_done : s->alb.t_pass;
+        if (since_ms(t0, now) >= s->opt.unlock_delay_ms) s->input_locked=0;
+    }
+    /* Sblocco anticipato: prompt visto dopo il login e poi silenzio per unlock_quiet_ms */
+    if (s->input_locked && s->unlock_seen){
+        struct timespec now; clock_gettime(CLOCK_MONOTONIC,&now);
+        if (since_ms(s->last_rx, now) >= s->opt.unlock_quiet_ms) s->input_locked=0;
+    }
+
+    /* Auto "?" una volta sbloccato */
+    if (!s->input_locked && !s->auto_help_sent && s->opt.auto_help){
+        send_line_utf8_telnet_safe(s, "?");
+        s->auto_help_sent=1;
+    }
+    /* Comandi --post-login, a ogni connessione */
+    if (!s->input_locked && !s->post_login_sent){
+        for (int i=0;i<s->opt.npost && s->sockfd>=0;i++) send_line_utf8_telnet_safe(s, s->opt.post_login[i]);
+        s->post_login_sent=1;
+    }
+    /* --send-file: una volta, alla prima connessione sbloccata */
+    if (!s->input_locked && s->opt.send_file && !s->send_file_done){
+        s->send_file_done=1;
+        if (upl_load_file(s, s->opt.send_file)<0){
+            wchar_t wmsg[600];
+            swprintf(wmsg, sizeof(wmsg)/sizeof(wmsg[0]), L"*** --send-file %s: %s", s->opt.send_file, strerror(errno));
+            add_logical_line_w(s, wmsg, is_following(s));
+        }
+    }
+    upl_step(s);
+
+    /* Keepalive applicativo — invia TELNET NOP ogni keepalive_secs */
+    if (s->opt.keepalive_secs > 0){
+        struct timespec now; clock_gettime(CLOCK_MONOTONIC,&now);
+        if (since_ms(s->last_tx_ts, now) >= s->opt.keepalive_secs * 1000L){
+            telnet_send_nop(s);
+        }
+    }
+}
+
+/* Rifà il layout (resize, split, cambio sessione) mantenendo chi seguiva la coda */
+static void ui_relayout(int query_size){
+    int keep_bottom[SESS_MAX];
+    for (int i=0;i<nsess;i++) keep_bottom[i] = is_following(sess[i]); /* con l'altezza vecchia */
+    if (query_size){ endwin(); refresh(); clearok(curscr, TRUE); getmaxyx(stdscr, rows, cols); }
+    ui_make_windows();
+    for (int i=0;i<nsess;i++) reflow(sess[i], keep_bottom[i]);
+    for (int i=0;i<nsess;i++) if (sess[i]->sockfd>=0){ tn_queue_naws(sess[i]); tx_flush(sess[i]); }
 }
 
 /* ---------- main ---------- */
-int main(int argc, char **argv){
-    signal(SIGPIPE, SIG_IGN);   /* non morire su write dopo chiusura peer */
-    signal(SIGTSTP, SIG_IGN);   /* gestiamo ^Z manualmente (pass-thru) */
+/* ---------- Socket di controllo ----------
+ * Unix stream, protocollo a righe UTF-8. Dal client:
+ *   SUB [n|*]      righe ricevute della sessione n (1..), default tutte
+ *   UNSUB          basta righe
+ *   SEND n TESTO   TESTO + EOL alla sessione n, come dalla riga comandi (echo locale compreso)
+ *   LIST           una riga "SESS n host port stato" per sessione, poi OK
+ * Al client: "LINE n TESTO" per ogni riga decodificata, OK / ERR motivo per i comandi.
+ * L'uscita di ogni client si accoda e parte con write non bloccanti una volta per giro: chi
+ * resta indietro di CTL_OUT_MAX viene chiuso, il loop non aspetta nessuno. */
+#define CTL_MAX 8
+#define CTL_OUT_MAX (4u<<20)
+typedef struct {
+    int fd; unsigned sub;               /* bit i = sessione i */
+    txbuf_t out; size_t off;            /* out[off..len) da scrivere */
+    char in[4096]; size_t inlen;        /* comando in arrivo */
+} ctl_client_t;
+static int ctl_fd=-1;
+static const char *ctl_path;
+static ctl_client_t ctl_cl[CTL_MAX];
+static void ctl_count_subs(void){
+    ctl_nsub=0;
+    for (int i=0;i<CTL_MAX;i++) if (ctl_cl[i].fd>=0 && ctl_cl[i].sub) ctl_nsub++;
+}
+static void ctl_drop(ctl_client_t *c){
+    close(c->fd); c->fd=-1;
+    free(c->out.buf); memset(&c->out, 0, sizeof c->out); c->off=0; c->inlen=0; c->sub=0;
+    ctl_count_subs();
+}
+static void ctl_close_all(void){
+    for (int i=0;i<CTL_MAX;i++) if (ctl_cl[i].fd>=0) ctl_drop(&ctl_cl[i]);
+    if (ctl_fd>=0){ close(ctl_fd); ctl_fd=-1; unlink(ctl_path); }
+}
+static void ctl_put(ctl_client_t *c, const void *p, size_t n){
+    if (c->fd<0) return;
+    if (c->off && c->off == c->out.len){ c->off=0; c->out.len=0; }
+    if (c->out.len - c->off + n > CTL_OUT_MAX || !txbuf_reserve(&c->out, n)){ ctl_drop(c); return; }
+    memcpy(c->out.buf + c->out.len, p, n); c->out.len += n;
+}
+static void ctl_printf(ctl_client_t *c, const char *fmt, ...){
+    char b[512]; va_list ap; va_start(ap, fmt);
+    int n = vsnprintf(b, sizeof b, fmt, ap); va_end(ap);
+    if (n>0) ctl_put(c, b, (size_t)n < sizeof b ? (size_t)n : sizeof b - 1);
+}
+static void ctl_init(const char *path){
+    struct sockaddr_un sa; memset(&sa, 0, sizeof sa);
+    sa.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof sa.sun_path) die_cleanup("--control: percorso troppo lungo");
+    strcpy(sa.sun_path, path);
+    for (int i=0;i<CTL_MAX;i++) ctl_cl[i].fd=-1;
+    ctl_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (ctl_fd<0) die_cleanup("--control: socket: %s", strerror(errno));
+    fcntl(ctl_fd, F_SETFL, fcntl(ctl_fd, F_GETFL) | O_NONBLOCK); fcntl(ctl_fd, F_SETFD, FD_CLOEXEC);
+    mode_t um = umask(077);             /* socket 0600: solo l'utente */
+    int r = bind(ctl_fd, (struct sockaddr*)&sa, sizeof sa);
+    if (r<0 && errno==EADDRINUSE){
+        /* file rimasto da un processo morto? se nessuno risponde si ricrea */
+        int t = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (t>=0) fcntl(t, F_SETFD, FD_CLOEXEC);
+        int alive = t>=0 && connect(t, (struct sockaddr*)&sa, sizeof sa)==0;
+        if (t>=0) close(t);
+        if (!alive){ unlink(path); r = bind(ctl_fd, (struct sockaddr*)&sa, sizeof sa); }
+        else errno = EADDRINUSE;
+    }
+    umask(um);
+    if (r<0 || listen(ctl_fd, CTL_MAX)<0){ int e=errno; close(ctl_fd); ctl_fd=-1; die_cleanup("--control %s: %s", path, strerror(e)); }
+}
+/* Riga decodificata: codificata una volta, accodata a chi è iscritto alla sessione */
+static void ctl_line(session_t *s, const wchar_t *w, size_t n){
+    static txbuf_t lb;
+    int k=0; while (k<nsess && sess[k]!=s) k++;
+    lb.len=0;
+    if (!txbuf_reserve(&lb, 4*n + 32)) return;
+    lb.len = (size_t)snprintf((char*)lb.buf, 32, "LINE %d ", k+1);
+    for (size_t i=0;i<n;i++) lb.len += utf8_put(lb.buf + lb.len, w[i]);
+    lb.buf[lb.len++]='\n';
+    for (int i=0;i<CTL_MAX;i++) if (ctl_cl[i].fd>=0 && (ctl_cl[i].sub>>k & 1)) ctl_put(&ctl_cl[i], lb.buf, lb.len);
+}
+static session_t *ctl_sess(const char *a, int *k){
+    char *e; long n = strtol(a, &e, 10);
+    if (e==a || n<1 || n>nsess) return NULL;
+    *k = (int)n-1;
+    return sess[n-1];
+}
+static void ctl_cmd(ctl_client_t *c, char *l){
+    char *arg = l + strcspn(l, " "); if (*arg) *arg++ = 0;
+    int k;
+    if (!strcasecmp(l, "SUB")){
+        if (!*arg || !strcmp(arg, "*")) c->sub = ~0u;
+        else if (ctl_sess(arg, &k)) c->sub |= 1u<<k;
+        else { ctl_printf(c, "ERR sessione\n"); return; }
+        ctl_count_subs(); ctl_printf(c, "OK\n");
+    }
+    else if (!strcasecmp(l, "UNSUB")){ c->sub=0; ctl_count_subs(); ctl_printf(c, "OK\n"); }
+    else if (!strcasecmp(l, "LIST")){
+        for (int i=0;i<nsess;i++){
+            const session_t *s = sess[i];
+            ctl_printf(c, "SESS %d %s %s %s\n", i+1, s->host, s->port,
+                       s->sockfd>=0 ? (s->input_locked ? "login" : "up") : conn_pending(s) ? "connecting" : s->rp.data ? "replay" : "down");
+        }
+        ctl_printf(c, "OK\n");
+    }
+    else if (!strcasecmp(l, "SEND")){
+        char *txt = arg + strcspn(arg, " "); if (*txt) *txt++ = 0;
+        session_t *s = ctl_sess(arg, &k);
+        if (!s){ ctl_printf(c, "ERR sessione\n"); return; }
+        if (s->sockfd<0){ ctl_printf(c, "ERR non connessa\n"); return; }
+        if (sess_local_echo(s)){
+            size_t n = utf8_decode_buf((const unsigned char*)txt, strlen(txt), &wb_echo);
+            if (wb_echo.buf){ wb_echo.buf[n]=L'\0'; local_echo_line(s, wb_echo.buf); }
+        }
+        send_line_utf8_telnet_safe(s, txt);
+        ctl_printf(c, s->sockfd>=0 ? "OK\n" : "ERR write\n");
+    }
+    else ctl_printf(c, "ERR comando\n");
+}
+/* Scrive quanto entra senza bloccare (una volta per giro, dopo l'RX) */
+static void ctl_flush(void){
+    for (int i=0;i<CTL_MAX;i++){
+        ctl_client_t *c = &ctl_cl[i];
+        if (c->fd<0 || c->off==c->out.len) continue;
+        ssize_t w = write(c->fd, c->out.buf + c->off, c->out.len - c->off); stats.sys_main++;
+        if (w>0) c->off += (size_t)w;
+        else if (w<0 && errno!=EAGAIN && errno!=EINTR) ctl_drop(c);
+    }
+}
+/* pfd dei client e del listen (se c'è posto): ctl_pidx[j] = client, -1 = listen */
+static int ctl_pidx[1+CTL_MAX];
+static int ctl_pollfds(struct pollfd *p){
+    int n=0;
+    if (ctl_fd<0) return 0;
+    for (int i=0;i<CTL_MAX;i++){
+        ctl_client_t *c = &ctl_cl[i];
+        if (c->fd<0) continue;
+        p[n].fd=c->fd; p[n].events=POLLIN | (c->off<c->out.len ? POLLOUT : 0); p[n].revents=0; ctl_pidx[n++]=i;
+    }
+    if (n<CTL_MAX){ p[n].fd=ctl_fd; p[n].events=POLLIN; p[n].revents=0; ctl_pidx[n++]=-1; }
+    return n;
+}
+static void ctl_events(struct pollfd *p, int n){
+    for (int j=0;j<n;j++){
+        if (!p[j].revents) continue;
+        if (ctl_pidx[j]<0){
+            int fd = accept(ctl_fd, NULL, NULL);
+            if (fd<0) continue;
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK); fcntl(fd, F_SETFD, FD_CLOEXEC);
+            int i=0; while (i<CTL_MAX && ctl_cl[i].fd>=0) i++;
+            if (i==CTL_MAX){ close(fd); continue; }
+            ctl_cl[i].fd=fd;
+            continue;
+        }
+        ctl_client_t *c = &ctl_cl[ctl_pidx[j]];
+        if (c->fd<0 || !(p[j].revents & (POLLIN|POLLHUP|POLLERR))) continue;
+        ssize_t r = read(c->fd, c->in + c->inlen, sizeof c->in - c->inlen); stats.sys_main++;
+        if (r==0 || (r<0 && errno!=EAGAIN && errno!=EINTR)){ ctl_drop(c); continue; }
+        if (r>0) c->inlen += (size_t)r;
+        char *nl;
+        while (c->fd>=0 && (nl = (char*)memchr(c->in, '\n', c->inlen))){
+            size_t ll = (size_t)(nl - c->in);
+            *nl = 0; if (ll && c->in[ll-1]=='\r') c->in[ll-1]=0;
+            ctl_cmd(c, c->in);
+            if (c->fd<0) break;
+            memmove(c->in, nl+1, c->inlen - ll - 1); c->inlen -= ll + 1;
+        }
+        if (c->fd>=0 && c->inlen == sizeof c->in) ctl_drop(c);   /* riga troppo lunga */
+    }
+}
 
-    if (argc<3){
-        fprintf(stderr,"Uso: %s <host> <port> [-u USER -p PASS] [--blind-auto] [--cr-only] [--upper] [--no-auto-help] [--no-local-echo] [--no-pass-ctrl-z] [--ctrl-z-cr] [--keepalive SECONDS] [--unlock-delay MS] [--unlock-quiet MS]\n", argv[0]);
-        return 1;
+/* ---------- Replay e benchmark ----------
+ * Un file di traffico registrato (byte del socket così come sono: IAC, CR/LF misti, TAB,
+ * UTF-8, CJK/emoji) passa per sess_rx_chunk come un chunk da 16 KiB del thread I/O: stesso
+ * decoder, autologin, trigger e store della connessione vera. Le risposte telnet si scartano
+ * (sockfd<0). */
+static void *map_file(const char *path, size_t *len){
+    int fd = open(path, O_RDONLY|O_CLOEXEC);
+    if (fd<0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st)<0 || st.st_size==0){ close(fd); if (!errno) errno=EINVAL; return NULL; }
+    void *m = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (m==MAP_FAILED) return NULL;
+    *len = (size_t)st.st_size;
+    return m;
+}
+static int replay_pending(const session_t *s){ return s->rp.data && s->rp.off < s->rp.len; }
+/* Al più RX_ROUND byte per giro, come sess_rx: la UI resta reattiva anche su file enormi */
+static void replay_step(session_t *s){
+    if (!s->rp.off){ clock_gettime(CLOCK_MONOTONIC, &s->rp.t0); s->rp.lines0 = stats.rx_lines; }
+    size_t end = s->rp.len - s->rp.off > RX_ROUND ? s->rp.off + RX_ROUND : s->rp.len;
+    while (s->rp.off < end){
+        size_t n = end - s->rp.off > 16384 ? 16384 : end - s->rp.off;
+        sess_rx_chunk(s, s->rp.data + s->rp.off, n);
+        s->rp.off += n;
+    }
+    if (s->rp.off < s->rp.len) return;
+    struct timespec now; clock_gettime(CLOCK_MONOTONIC,&now);
+    long ms = since_ms(s->rp.t0, now);
+    unsigned long long nl = (unsigned long long)(stats.rx_lines - s->rp.lines0);
+    wchar_t m[200];
+    swprintf(m, sizeof(m)/sizeof(m[0]), L"*** replay finito: %zu byte, %llu righe in %ld ms (%.0f righe/s)",
+             s->rp.len, nl, ms, ms>0 ? (double)nl*1000.0/(double)ms : 0.0);
+    add_logical_line_w(s, m, is_following(s));
+}
+
+static double bench_secs(uint64_t t0){ return (double)(now_ns() - t0)/1e9; }
+/* Disegno senza ncurses: ogni segmento di wrap passa da line_wcs come per waddnwstr */
+static uint64_t bench_sink(session_t *s, int width, uint64_t *rows){
+    uint64_t sum=0;
+    for (int i=0;i<s->store_count;i++){
+        line_t *L = &STORE_AT(s, i);
+        size_t pos=0, o, l;
+        *rows += (uint64_t)line_rows(L, width);
+        while (wrap_next(L, width, &pos, &o, &l)){
+            const wchar_t *w = line_wcs(L, o, l);
+            if (w) for (size_t k=0;k<l;k++) sum += (uint64_t)w[k];
+        }
     }
-    const char *host=argv[1], *port=argv[2];
+    return sum;
+}
+/* --bench: RX di iter copie del file, poi reflow + disegno dell'intero store a tre larghezze */
+static int bench_run(const char *path, int width, int iter){
+    size_t len=0;
+    unsigned char *data = (unsigned char*)map_file(path, &len);
+    if (!data){ fprintf(stderr,"%s: %s\n", path, strerror(errno)); return 1; }
+    session_t *s = sess_new("bench", path);
+    if (!s){ fprintf(stderr,"OOM\n"); return 1; }
+    sess[nsess++] = s;
+    cols = width+1; rows = 26; s->pane_h = 24;
+    s->opt.auto_help=0; s->opt.local_echo=0;
 
-    autologin_prompt_t alp; memset(&alp,0,sizeof alp);
-    autologin_blind_t  alb; memset(&alb,0,sizeof alb);
+    uint64_t a0 = n_allocs, t0 = now_ns();
+    for (int it=0; it<iter; it++)
+        for (size_t off=0; off<len; off+=16384) sess_rx_chunk(s, data+off, len-off > 16384 ? 16384 : len-off);
+    double t_rx = bench_secs(t0);
+    uint64_t a_rx = n_allocs - a0;
+    double mb = (double)len*iter/(1024.0*1024.0);
+    printf("bench %s: %zu byte x %d, %d colonne\n", path, len, iter, width);
+    printf("  RX  (telnet+CR/LF+UTF-8+TAB+store): %8.3f s  %9.1f MB/s  %11.0f righe/s  (%llu righe, %d in store)\n",
+           t_rx, t_rx>0 ? mb/t_rx : 0.0, t_rx>0 ? (double)stats.rx_lines/t_rx : 0.0, (unsigned long long)stats.rx_lines, s->store_count);
 
-    for (int i=3;i<argc;++i){
-        if (!strcmp(argv[i],"-u") && i+1<argc){ strncpy(alp.user,argv[++i],sizeof(alp.user)-1); strncpy(alb.user,alp.user,sizeof(alb.user)-1); alp.enabled=1; }
-        else if (!strcmp(argv[i],"-p") && i+1<argc){ strncpy(alp.pass,argv[++i],sizeof(alp.pass)-1); strncpy(alb.pass,alp.pass,sizeof(alb.pass)-1); alp.enabled=1; }
-        else if (!strcmp(argv[i],"--blind-auto")){ alb.enabled=1; }
-        else if (!strcmp(argv[i],"--cr-only")){ opt_cr_only=1; }
-        else if (!strcmp(argv[i],"--upper")){ opt_upper=1; }
-        else if (!strcmp(argv[i],"--no-auto-help")){ opt_auto_help=0; }
-        else if (!strcmp(argv[i],"--no-local-echo")){ opt_local_echo=0; }
-        else if (!strcmp(argv[i],"--no-pass-ctrl-z")){ opt_pass_ctrl_z=0; }
-        else if (!strcmp(argv[i],"--ctrl-z-cr")){ opt_ctrlz_append_cr=1; }
-        else if (!strcmp(argv[i],"--unlock-delay") && i+1<argc){ unlock_delay_ms=strtol(argv[++i],NULL,10); if (unlock_delay_ms<0) unlock_delay_ms=0; }
-        else if (!strcmp(argv[i],"--unlock-quiet") && i+1<argc){ unlock_quiet_ms=strtol(argv[++i],NULL,10); if (unlock_quiet_ms<0) unlock_quiet_ms=0; }
-        else if (!strcmp(argv[i],"--keepalive") && i+1<argc){ keepalive_secs = strtol(argv[++i],NULL,10); if (keepalive_secs<0) keepalive_secs=0; }
-        else { fprintf(stderr,"Opzione sconosciuta: %s\n", argv[i]); return 1; }
+    if (s->cold.n){
+        uint64_t t2 = now_ns(), sum=0;
+        for (unsigned long id=s->cold.first_id; id<s->store_first_id; id++) sum += (uint64_t)line_by_id(s, id)->len;
+        double t = bench_secs(t2);
+        unsigned long nl = s->store_first_id - s->cold.first_id;
+        printf("  scrollback freddo: %lu righe in %d blocchi, %.1f MiB -> %.1f MiB (%.1fx), lettura %.0f righe/s  (%llu char)\n",
+               nl, s->cold.n, (double)s->cold.rawbytes/1048576.0, (double)s->cold.zbytes/1048576.0,
+               s->cold.zbytes ? (double)s->cold.rawbytes/(double)s->cold.zbytes : 0.0, t>0 ? (double)nl/t : 0.0, (unsigned long long)sum);
     }
-    if ((alp.enabled||alb.enabled) && (alp.user[0]=='\0' || alp.pass[0]=='\0')){
-        fprintf(stderr,"Autologin: servono sia -u che -p.\n"); return 1;
+    const int widths[3] = { width, width*3/2, width/2 > 10 ? width/2 : 10 };
+    uint64_t chk=0;
+    for (int w=0; w<3; w++){
+        cols = widths[w]+1;
+        uint64_t a1 = n_allocs, vr=0, t1 = now_ns();
+        reflow(s, 1);
+        chk += bench_sink(s, widths[w], &vr);
+        double t = bench_secs(t1);
+        printf("  wrap+disegno a %3d colonne:           %8.3f s  %11.0f righe/s  (%llu righe visuali, %llu allocazioni)\n",
+               widths[w], t, t>0 ? (double)s->store_count/t : 0.0, (unsigned long long)vr, (unsigned long long)(n_allocs - a1));
     }
-    if (alb.enabled){ alb.du_ms=150; alb.dp_ms=1000; }
+    struct rusage ru; getrusage(RUSAGE_SELF, &ru);
+    printf("  allocazioni: %llu in RX (%.2f per 1000 righe), %llu totali; RSS massimo %ld KiB  [chk %llx]\n",
+           (unsigned long long)a_rx, stats.rx_lines ? (double)a_rx*1000.0/(double)stats.rx_lines : 0.0,
+           (unsigned long long)n_allocs, ru.ru_maxrss, (unsigned long long)chk);
+    munmap(data, len);
+    sess_free(s); nsess=0;
+    free(wb_row.buf); free(wb_disk.buf); free(wb_idx.buf); free(wb_echo.buf);
+    return 0;
+}
 
-    signal(SIGWINCH, on_winch);
-    ui_init();
+static void usage(const char *argv0){
+    fprintf(stderr,"Uso: %s <host> <port> [-u USER -p PASS] [--blind-auto] [--cr-only] [--upper] [--no-auto-help] [--no-local-echo] [--no-pass-ctrl-z] [--ctrl-z-cr] [--keepalive SECONDS] [--log-dir DIR] [--triggers FILE] [--connect-timeout SECONDS] [--reconnect] [--post-login CMD]... [--capture-dir DIR] [--send-file FILE] [--pace-bps N] [--pace-lps N] [--pace-prompt] [--history-dir DIR] [--cold N] [--filter PATTERN]... [--unlock-delay MS] [--unlock-quiet MS] [--max-fps N] [--control PATH] [--replay FILE] [-- <host> <port> [opzioni]]...\n       %s --replay FILE [opzioni] | --bench FILE [--bench-cols N] [--bench-iter N]\n", argv0, argv0);
+}
+int main(int argc, char **argv){
+    signal(SIGPIPE, SIG_IGN);   /* non morire su write dopo chiusura peer */
+    signal(SIGTSTP, SIG_IGN);   /* gestiamo ^Z manualmente (pass-thru) */
+    setlocale(LC_ALL, "");
+    wc_table_init();
 
-    sockfd = connect_tcp(host, port);
+    if (argc<3){ usage(argv[0]); return 1; }
 
-    /* Abilita SO_KEEPALIVE quando è richiesto keepalive applicativo */
-    if (keepalive_secs > 0){
-        set_tcp_keepalive(sockfd, keepalive_secs, keepalive_secs, 3);
+    if (!strcmp(argv[1],"--bench")){   /* senza terminale né rete */
+        int width=80, iter=1;
+        for (int i=3;i<argc;i++){
+            if (!strcmp(argv[i],"--bench-cols") && i+1<argc){ width=(int)strtol(argv[++i],NULL,10); if (width<10) width=10; }
+            else if (!strcmp(argv[i],"--bench-iter") && i+1<argc){ iter=(int)strtol(argv[++i],NULL,10); if (iter<1) iter=1; }
+            else { fprintf(stderr,"Opzione sconosciuta: %s\n", argv[i]); return 1; }
+        }
+        if (ac_build(&ac_prompt, prompt_pats, (int)(sizeof(prompt_pats)/sizeof(prompt_pats[0])), 1)<0){ fprintf(stderr,"OOM\n"); return 1; }
+        int r = bench_run(argv[2], width, iter);
+        prompt_matcher_free();
+        return r;
     }
 
-    telnet_parser_t tp={0};
+    /* Sessioni: <host> <port> [opzioni] (o --replay FILE [opzioni]) separate da "--" */
+    for (int i=1; i<argc; ){
+        int replay = !strcmp(argv[i],"--replay");
+        if (i+1>=argc || (argv[i][0]=='-' && !replay)){ usage(argv[0]); return 1; }
+        if (nsess>=SESS_MAX){ fprintf(stderr,"Troppe sessioni (max %d).\n", SESS_MAX); return 1; }
+        session_t *s = replay ? sess_new("replay", argv[i+1]) : sess_new(argv[i], argv[i+1]);
+        if (!s){ fprintf(stderr,"OOM\n"); return 1; }
+        if (replay) s->opt.replay=argv[i+1];
+        sess[nsess++] = s;
+        autologin_prompt_t *alp=&s->alp; autologin_blind_t *alb=&s->alb;
+        for (i+=2; i<argc; ++i){
+            if (!strcmp(argv[i],"--")){ i++; break; }
+            if (!strcmp(argv[i],"-u") && i+1<argc){ strncpy(alp->user,argv[++i],sizeof(alp->user)-1); strncpy(alb->user,alp->user,sizeof(alb->user)-1); alp->enabled=1; }
+            else if (!strcmp(argv[i],"-p") && i+1<argc){ strncpy(alp->pass,argv[++i],sizeof(alp->pass)-1); strncpy(alb->pass,alp->pass,sizeof(alb->pass)-1); alp->enabled=1; }
+            else if (!strcmp(argv[i],"--blind-auto")){ alb->enabled=1; }
+            else if (!strcmp(argv[i],"--cr-only")){ s->opt.cr_only=1; }
+            else if (!strcmp(argv[i],"--upper")){ s->opt.upper=1; }
+            else if (!strcmp(argv[i],"--no-auto-help")){ s->opt.auto_help=0; }
+            else if (!strcmp(argv[i],"--no-local-echo")){ s->opt.local_echo=0; }
+            else if (!strcmp(argv[i],"--no-pass-ctrl-z")){ s->opt.pass_ctrl_z=0; }
+            else if (!strcmp(argv[i],"--ctrl-z-cr")){ s->opt.ctrlz_append_cr=1; }
+            else if (!strcmp(argv[i],"--unlock-delay") && i+1<argc){ s->opt.unlock_delay_ms=strtol(argv[++i],NULL,10); if (s->opt.unlock_delay_ms<0) s->opt.unlock_delay_ms=0; }
+            else if (!strcmp(argv[i],"--unlock-quiet") && i+1<argc){ s->opt.unlock_quiet_ms=strtol(argv[++i],NULL,10); if (s->opt.unlock_quiet_ms<0) s->opt.unlock_quiet_ms=0; }
+            else if (!strcmp(argv[i],"--control") && i+1<argc){ ctl_path=argv[++i]; }
+            else if (!strcmp(argv[i],"--max-fps") && i+1<argc){ opt_max_fps=strtol(argv[++i],NULL,10); if (opt_max_fps<0) opt_max_fps=0; }
+            else if (!strcmp(argv[i],"--log-dir") && i+1<argc){ s->opt.log_dir=argv[++i]; }
+            else if (!strcmp(argv[i],"--triggers") && i+1<argc){ s->opt.triggers=argv[++i]; }
+            else if (!strcmp(argv[i],"--reconnect")){ s->opt.reconnect=1; }
+            else if (!strcmp(argv[i],"--capture-dir") && i+1<argc){ s->opt.capture_dir=argv[++i]; }
+            else if (!strcmp(argv[i],"--send-file") && i+1<argc){ s->opt.send_file=argv[++i]; }
+            else if (!strcmp(argv[i],"--pace-bps") && i+1<argc){ s->opt.pace_bps = strtol(argv[++i],NULL,10); if (s->opt.pace_bps<0) s->opt.pace_bps=0; }
+            else if (!strcmp(argv[i],"--pace-lps") && i+1<argc){ s->opt.pace_lps = strtol(argv[++i],NULL,10); if (s->opt.pace_lps<0) s->opt.pace_lps=0; }
+            else if (!strcmp(argv[i],"--pace-prompt")){ s->opt.pace_prompt=1; }
+            else if (!strcmp(argv[i],"--replay") && i+1<argc){ s->opt.replay=argv[++i]; }
+            else if (!strcmp(argv[i],"--history-dir") && i+1<argc){ s->opt.history_dir=argv[++i]; }
+            else if (!strcmp(argv[i],"--filter") && i+1<argc){ filt_add(s, argv[++i]); }
+            else if (!strcmp(argv[i],"--cold") && i+1<argc){ s->opt.cold_lines=strtol(argv[++i],NULL,10); if (s->opt.cold_lines<0) s->opt.cold_lines=0; }
+            else if (!strcmp(argv[i],"--post-login") && i+1<argc){
+                if (s->opt.npost==POST_LOGIN_MAX){ fprintf(stderr,"Troppi --post-login (max %d)\n", POST_LOGIN_MAX); return 1; }
+                s->opt.post_login[s->opt.npost++]=argv[++i];
+            }
+            else if (!strcmp(argv[i],"--connect-timeout") && i+1<argc){ s->opt.connect_timeout_ms = strtol(argv[++i],NULL,10)*1000L; if (s->opt.connect_timeout_ms<0) s->opt.connect_timeout_ms=0; }
+            else if (!strcmp(argv[i],"--keepalive") && i+1<argc){ s->opt.keepalive_secs = strtol(argv[++i],NULL,10); if (s->opt.keepalive_secs<0) s->opt.keepalive_secs=0; }
+            else { fprintf(stderr,"Opzione sconosciuta: %s\n", argv[i]); return 1; }
+        }
+        if ((alp->enabled||alb->enabled) && (alp->user[0]=='\0' || alp->pass[0]=='\0')){
+            fprintf(stderr,"Autologin (%s): servono sia -u che -p.\n", s->host); return 1;
+        }
+        if (alb->enabled){ alb->du_ms=150; alb->dp_ms=1000; }
+    }
 
-    /* Stato login/lock e recent */
-    char recent[8192]; size_t rlen=0; recent[0]='\0';
-    struct timespec last_rx; clock_gettime(CLOCK_MONOTONIC,&last_rx);
-    int input_locked = (alp.enabled||alb.enabled) ? 1 : 0;
-    int login_done_flag=0; struct timespec t_login_done; memset(&t_login_done,0,sizeof t_login_done);
-    int auto_help_sent=0;
-    if (alb.enabled) clock_gettime(CLOCK_MONOTONIC,&alb.t0);
+    if (ac_build(&ac_prompt, prompt_pats, (int)(sizeof(prompt_pats)/sizeof(prompt_pats[0])), 1)<0){ fprintf(stderr,"OOM\n"); return 1; }
+    for (int k=0;k<nsess;k++){
+        session_t *s = sess[k];
+        if (!s->opt.triggers) continue;
+        if (!(s->trig = trig_load(s->opt.triggers))) return 1;
+        if (!(s->tr_hit = (unsigned char*)calloc((size_t)(s->trig->n>0 ? s->trig->n : 1), 1))){ fprintf(stderr,"OOM\n"); return 1; }
+    }
+    for (int k=0;k<nsess;k++){
+        session_t *s = sess[k];
+        if (s->opt.replay && !(s->rp.data = (unsigned char*)map_file(s->opt.replay, &s->rp.len))){ fprintf(stderr,"%s: %s\n", s->opt.replay, strerror(errno)); return 1; }
+    }
+    for (int k=0;k<nsess;k++) if (sess[k]->opt.log_dir) slog_open(sess[k]);
+    winch_pipe_init();
+    {   /* sigaction: con _POSIX_C_SOURCE signal() ha semantica SysV (handler resettato dopo il primo SIGWINCH) */
+        struct sigaction sa; memset(&sa, 0, sizeof sa);
+        sa.sa_handler = on_winch; sigemptyset(&sa.sa_mask); sa.sa_flags = SA_RESTART;
+        sigaction(SIGWINCH, &sa, NULL);
+        sa.sa_handler = on_usr1;
+        sigaction(SIGUSR1, &sa, NULL);
+    }
+    if (ctl_path) ctl_init(ctl_path);
+    ui_init();
 
-    /* Input buffer (wide) */
-    wchar_t ibuf[4096]; size_t ilen=0; ibuf[0]=L'\0';
+    /* Connessioni in parallelo: la UI risponde (F10, resize) mentre si risolve e connette */
+    dns_pipe_init();
+    clock_gettime(CLOCK_MONOTONIC, &stats.t_start); stats.t_snap = stats.t_start;
+    io_start();
+    srand((unsigned)time(NULL) ^ (unsigned)getpid());   /* jitter delle riconnessioni */
+    for (int k=0;k<nsess;k++) if (!sess[k]->rp.data) conn_start(sess[k]);
+    ui_draw_status();
 
-    /* Track TX (inizializza) */
-    clock_gettime(CLOCK_MONOTONIC, &last_tx_ts);
+    wbuf_t pbuf={0}; size_t plen=0; int pasting=0;   /* testo fra \e[200~ e \e[201~ */
 
     /* Primo render */
-    render_out(); render_input(ibuf);
+    for (int k=0;k<nsess;k++) render_out(sess[k]);
+    render_input();
 
     for(;;){
         if (need_resize){
-            endwin(); refresh(); clear(); getmaxyx(stdscr, rows, cols);
-            ui_make_windows();
-            int visible = rows-2; if (visible<1) visible=1;
-            int keep_bottom = (view_top + visible >= vis_count-1);
-            reflow(keep_bottom);
-            render_out(); render_input(ibuf);
+            ui_relayout(1);
+            for (int k=0;k<nsess;k++) render_out(sess[k]);
+            render_input();
             need_resize=0;
         }
 
-        /* Socket RX con piccolo timeout */
-        fd_set rfds; FD_ZERO(&rfds); FD_SET(sockfd,&rfds);
-        struct timeval tv={0,50000};
-        int sr=select(sockfd+1,&rfds,NULL,NULL,&tv);
-        if (sr<0 && errno!=EINTR) die_cleanup("select: %s", strerror(errno));
-
-        if (alb.enabled && alb.stage<2) autologin_try_blind(&alb);
-
-        if (sr>0 && FD_ISSET(sockfd,&rfds)){
-            unsigned char in[4096], tmp[65536], out[65536];
-            ssize_t n = read(sockfd, in, sizeof in);
-            if (n==0) die_cleanup(NULL);
-            if (n<0)  die_cleanup("read(sock): %s", strerror(errno));
-            size_t o = telnet_filter_and_reply(&tp, in, (size_t)n, tmp, sizeof tmp);
-            size_t m = normalize_incoming(tmp, o, out, sizeof out);
-
-            if (m){
-                /* Accumula nel buffer RX persistente */
-                if (rx_len + m > rx_cap){
-                    size_t newcap = (rx_cap==0? (m+1024) : rx_cap);
-                    while (rx_len + m > newcap) newcap = newcap*2 + 1024;
-                    char *nbuf = (char*)realloc(rx_acc, newcap);
-                    if (!nbuf) die_cleanup("OOM RX");
-                    rx_acc = nbuf; rx_cap = newcap;
+        {   /* tempo per frame, e lettura->schermo per le sessioni appena disegnate */
+            uint64_t t0 = now_ns();
+            int work = ui_dirty || (out_pending() && frame_wait_ms()==0);
+            render_out_frame();
+            ui_flush();
+            if (work){
+                uint64_t t1 = now_ns();
+                hist_add(&stats.render, t1 - t0); stats.frames++;
+                for (int k=0;k<nsess;k++){
+                    session_t *s = sess[k];
+                    if (!s->lat_t0 || s->out_dirty) continue;
+                    if (s->win) hist_add(&stats.lat_screen, t1 - s->lat_t0);
+                    s->lat_t0=0;
                 }
-                memcpy(rx_acc + rx_len, out, m);
-                rx_len += m;
-
-                /* Estrai tutte le righe complete terminate da '\n' */
-                size_t consumed = 0;
-                for (;;){
-                    void *pos = memchr(rx_acc + consumed, '\n', rx_len - consumed);
-                    if (!pos) break;
-                    size_t linelen = (char*)pos - (rx_acc + consumed);
-
-                    /* Copia la riga (senza '\n') e processa */
-                    char *line8 = (char*)malloc(linelen + 1);
-                    if (!line8) die_cleanup("OOM line");
-                    memcpy(line8, rx_acc + consumed, linelen);
-                    line8[linelen] = '\0';
-
-                    int visible = rows-2; if (visible<1) visible=1;
-                    int follow = (view_top + visible >= vis_count-1);
-
-                    wchar_t *w = utf8_to_wcs_lossy(line8);
-                    if (w){
-                        wchar_t *wt = expand_tabs_wcs(w, TABSTOP);
-                        if (wt){ add_logical_line_w(wt, follow); free(wt); }
-                        free(w);
-                    }
-                    free(line8);
+            }
+        }
+        if (need_stats_dump){ need_stats_dump=0; stats_dump_json(); }
+        for (int k=0;k<nsess;k++) if (slog_flush(&sess[k]->log)<0) die_cleanup("log: %s", strerror(errno));
+        ctl_flush();
 
-                    consumed += linelen + 1; /* salta anche '\n' */
-                }
+        /* Attesa eventi: tastiera, self-pipe SIGWINCH, socket delle sessioni. Il timeout è la
+         * scadenza più vicina (frame, autologin cieco, sblocco, keepalive): da fermo si dorme e basta. */
+        long wait_ms = -1;
+        {
+            struct timespec now; clock_gettime(CLOCK_MONOTONIC,&now);
+            if (wrap_bg_pending() || idx_bg_pending()) deadline_min(&wait_ms, 0);
+            if (opt_hud) deadline_min(&wait_ms, 1000 - since_ms(stats.t_snap, now));
+            for (int k=0;k<nsess;k++) if (rxring_pending(sess[k]) || replay_pending(sess[k])) deadline_min(&wait_ms, 0);   /* resto oltre RX_ROUND */
+            if (out_pending()) deadline_min(&wait_ms, frame_wait_ms());
+            for (int k=0;k<nsess;k++) sess_deadline(sess[k], &wait_ms, now);
+        }
+        /* pfd[ps[k]..ps[k]+pn[k]): tentativi di connect della sessione k (i socket connessi li
+         * legge il thread I/O, che sveglia su io_wake) */
+        struct pollfd pfd[4+1+CTL_MAX+SESS_MAX*CONN_MAX_ADDR];
+        int ps[SESS_MAX], pn[SESS_MAX], np=4;
+        pfd[0].fd=STDIN_FILENO;  pfd[0].events=POLLIN; pfd[0].revents=0;
+        pfd[1].fd=winch_pipe[0]; pfd[1].events=POLLIN; pfd[1].revents=0;
+        pfd[2].fd=dns_pipe[0];   pfd[2].events=POLLIN; pfd[2].revents=0;
+        pfd[3].fd=io_wake[0];    pfd[3].events=POLLIN; pfd[3].revents=0;
+        int pc=np, nc=ctl_pollfds(&pfd[np]); np += nc;
+        for (int k=0;k<nsess;k++){
+            ps[k]=np;
+            pn[k]=conn_pollfds(sess[k], &pfd[np]);
+            np += pn[k];
+        }
+        int pr = poll(pfd, (nfds_t)np, (int)wait_ms); stats.sys_main++;
+        if (pr<0 && errno!=EINTR) die_cleanup("poll: %s", strerror(errno));
+        if (opt_hud){ struct timespec now; clock_gettime(CLOCK_MONOTONIC,&now); if (since_ms(stats.t_snap, now) >= 1000){ stats_tick(); ui_draw_status(); } }
+        if (pr>0 && (pfd[1].revents & POLLIN)){ char b[64]; while (read(winch_pipe[0], b, sizeof b) > 0) ; }
+        if (pr>0 && (pfd[2].revents & POLLIN)) conn_dns_events();
+        if (pr>0 && (pfd[3].revents & POLLIN)){ char b[256]; while (read(io_wake[0], b, sizeof b) > 0) ; }
+        if (pr>0 && nc) ctl_events(&pfd[pc], nc);
 
-                /* Sposta indietro l’eventuale coda parziale (senza '\n') */
-                if (consumed > 0){
-                    size_t rest = rx_len - consumed;
-                    memmove(rx_acc, rx_acc + consumed, rest);
-                    rx_len = rest;
-                }
+        /* Loop inattivo: avanza il wrap in background */
+        if (pr==0) for (int k=0;k<nsess;k++){ wrap_bg_step(sess[k], 2048); idx_bg_step(sess[k], 4096); ch_load(sess[k]); }
 
-                clock_gettime(CLOCK_MONOTONIC,&last_rx);
+        for (int k=0;k<nsess;k++){
+            session_t *s = sess[k];
+            if (pr>0 && s->conn.state==CS_CONNECTING) conn_events(s, &pfd[ps[k]], pn[k]);
+            else if (rxring_pending(s)) sess_rx(s);
+            else if (replay_pending(s)) replay_step(s);
+            sess_timers(s);
+        }
 
-                /* aggiorna recent (coda) */
-                size_t chunk = m > sizeof(recent) ? sizeof(recent) : m;
-                if (rlen + chunk > sizeof(recent)) {
-                    size_t sh = (rlen + chunk) - sizeof(recent);
-                    if (sh > rlen) sh = rlen;
-                    memmove(recent, recent + sh, rlen - sh);
-                    rlen -= sh;
-                }
-                memcpy(recent + rlen, out + (m - chunk), chunk); rlen += chunk;
-                recent[(rlen<sizeof(recent))?rlen:sizeof(recent)-1] = '\0';
+        /* Tastiera (wide): consuma tutto l'input pronto senza bloccare */
+        while (pr>0 && (pfd[0].revents & POLLIN)){
+            wint_t wch;
+            int ch = wget_wch(win_in, &wch);
+            if (ch == ERR) break;
+            if (ch == KEY_CODE_YES && wch == KEY_RESIZE){ need_resize=1; continue; }
+            session_t *s = CUR;
 
-                if (alp.enabled && alp.state<2) {
-                    autologin_try_prompt(&alp, recent);
-                    if (alp.state==2){ login_done_flag=1; clock_gettime(CLOCK_MONOTONIC,&t_login_done); }
-                }
-                if (input_locked && (strstr(recent, "} ")||strstr(recent, "> ")||strstr(recent, "# ")||strstr(recent, ": ")||istrstr(recent,"connected to bbs"))){
-                    struct timespec now; clock_gettime(CLOCK_MONOTONIC,&now);
-                    if (since_ms(last_rx, now) >= unlock_quiet_ms) input_locked=0;
+            /* Bracketed paste: una riga va nell'input, più righe all'invio a ritmo */
+            if (ch == KEY_CODE_YES && wch == KEY_PASTE_BEGIN){ pasting=1; plen=0; continue; }
+            if (pasting){
+                if (ch == KEY_CODE_YES && wch == KEY_PASTE_END){
+                    pasting=0;
+                    if (paste_finish(s, pbuf.buf, plen)){ hnav.on = 0; edit_saved = 0; }
+                    render_input();
                 }
-
-                render_out(); render_input(ibuf);
+                else if (ch == OK && wbuf_reserve(&pbuf, plen+1)) pbuf.buf[plen++] = (wch==L'\r') ? L'\n' : (wchar_t)wch;
+                continue;
             }
-        }
 
-        /* Sblocco input su timeout post-login */
-        if (input_locked && (login_done_flag || alb.stage==2)){
-            struct timespec now; clock_gettime(CLOCK_MONOTONIC,&now);
-            struct timespec t0 = login_done_flag ? t_login_done : alb.t_pass;
-            if (since_ms(t0, now) >= unlock_delay_ms) input_locked=0;
-        }
+            if (srch.mode && srch_key(s, ch, wch)) continue;
+            if (hrs.on && hrs_key(s, ch, wch)){ render_input(); continue; }
 
-        /* Auto "?" una volta sbloccato */
-        if (!input_locked && !auto_help_sent && opt_auto_help){
-            send_line_utf8_telnet_safe("?");
-            auto_help_sent=1;
-        }
+            if (wch == KEY_F(10) || wch == 3 /*Ctrl-C*/) die_cleanup(NULL);
 
-        /* Keepalive applicativo — invia TELNET NOP ogni keepalive_secs */
-        if (keepalive_secs > 0){
-            struct timespec now; clock_gettime(CLOCK_MONOTONIC,&now);
-            if (since_ms(last_tx_ts, now) >= keepalive_secs * 1000L){
-                telnet_send_nop();
+            /* Ricerca nello scrollback (Ctrl-R resta alla history, '/' è dei comandi BPQ) */
+            else if (ch == OK && wch == 6 /*Ctrl-F*/){ srch_start(s); render_input(); }
+            else if (ch == OK && wch == 18 /*Ctrl-R*/){ hrs_start(s); render_input(); }
+
+            /* Sessioni: F2 successiva, F3 split on/off */
+            else if (ch == KEY_CODE_YES && wch == KEY_F(2)){
+                if (nsess>1){
+                    if (srch.mode) srch_stop(s);
+                    hnav.on = 0; edit_saved = 0;    /* la history è del nodo */
+                    cur_sess = (cur_sess+1) % nsess;
+                    if (opt_split) ui_draw_status();
+                    else ui_relayout(0);
+                    for (int k=0;k<nsess;k++) render_out(sess[k]);
+                    render_input();
+                }
             }
-        }
+            /* F8: vista filtrata successiva del pane attivo */
+            else if (ch == KEY_CODE_YES && wch == KEY_F(8)){
+                if (s->nfilt){ if (srch.mode) srch_stop(s); filt_cycle(s); ui_draw_status(); render_out(s); render_input(); }
+            }
+            /* F7: HUD delle statistiche sulla barra di stato */
+            else if (ch == KEY_CODE_YES && wch == KEY_F(7)){ opt_hud=!opt_hud; stats_tick(); ui_draw_status(); render_input(); }
 
-        /* Tastiera (wide) */
-        wint_t wch;
-        int ch = get_wch(&wch);
-        if (ch != ERR){
-            if (wch == KEY_F(10) || wch == 3 /*Ctrl-C*/) die_cleanup(NULL);
+            /* F6: annulla l'invio a ritmo in corso */
+            else if (ch == KEY_CODE_YES && wch == KEY_F(6)){ upl_cancel(s, "annullato"); render_input(); }
+
+            /* F5: cattura grezza on/off; durante YAPP/7plus interrompe */
+            else if (ch == KEY_CODE_YES && wch == KEY_F(5)){
+                if (s->xf.mode==XF_YAPP){ yapp_abort(s, "F5"); tx_flush(s); }
+                else if (s->xf.mode==XF_7PLUS) xfer_stop(s, "F5");
+                else if (s->xf.mode==XF_RAW) xfer_stop(s, NULL);
+                else if (s->sockfd>=0){ char name[300]; xfer_auto_name(s, name, sizeof name, "cap"); xfer_start(s, XF_RAW, name); }
+                render_input();
+            }
+            else if (ch == KEY_CODE_YES && wch == KEY_F(3)){
+                if (nsess>1){
+                    opt_split = !opt_split;
+                    ui_relayout(0);
+                    for (int k=0;k<nsess;k++) render_out(sess[k]);
+                    render_input();
+                }
+            }
 
             /* Ctrl-Z handling */
             else if (wch == 26
@@ -736,73 +4418,69 @@ int main(int argc, char **argv){
                      || wch == KEY_SUSPEND
 #endif
             ){
-                if (opt_pass_ctrl_z){
-                    if (opt_local_echo) local_echo_line(L"^Z");
+                if (s->opt.pass_ctrl_z){
+                    if (sess_local_echo(s)) local_echo_line(s, L"^Z");
                     unsigned char sub = 0x1A;
-                    write_telnet_safe(&sub, 1);
-                    if (opt_ctrlz_append_cr) send_eol();
+                    if (s->opt.ctrlz_append_cr) send_line_telnet_safe(s, &sub, 1);
+                    else write_telnet_safe(s, &sub, 1);
                 } else {
                     /* sospensione UNIX standard */
-                    endwin();
+                    paste_mode(0); endwin();
                     signal(SIGTSTP, SIG_DFL);
                     raise(SIGTSTP);    /* sospendi: riprende con 'fg' */
 
                     /* ripresa */
                     signal(SIGTSTP, SIG_IGN);
-                    refresh(); clear(); getmaxyx(stdscr, rows, cols);
-                    ui_make_windows();
-                    int visible = rows-2; if (visible<1) visible=1;
-                    int keep_bottom = (view_top + visible >= vis_count-1);
-                    reflow(keep_bottom);
-                    render_out(); render_input(ibuf);
+                    paste_mode(1);
+                    ui_relayout(1);
+                    for (int k=0;k<nsess;k++) render_out(sess[k]);
+                    render_input();
                 }
             }
 
-            /* Scroll output su PgUp/PgDn/Home/End (invariato) */
-            else if (wch == KEY_PPAGE){ int vis=rows-2; if (vis<1) vis=1; view_top -= vis/2; if (view_top<0) view_top=0; render_out(); render_input(ibuf); }
-            else if (wch == KEY_NPAGE){ int vis=rows-2; if (vis<1) vis=1; view_top += vis/2; int max_top=vis_count-vis; if (max_top<0) max_top=0; if (view_top>max_top) view_top=max_top; render_out(); render_input(ibuf); }
-            else if (wch == KEY_HOME){ view_top=0; render_out(); render_input(ibuf); }
-            else if (wch == KEY_END){ int vis=rows-2; if (vis<1) vis=1; view_top = vis_count - vis; if (view_top<0) view_top=0; render_out(); render_input(ibuf); }
+            /* Scroll output su PgUp/PgDn/Home/End (sessione attiva) */
+            else if (wch == KEY_PPAGE){ view_scroll(s, -(visible_rows(s)/2)); wrap_bg_start(s, -1); render_out(s); render_input(); }
+            else if (wch == KEY_NPAGE){ view_scroll(s, visible_rows(s)/2); render_out(s); render_input(); }
+            else if (wch == KEY_HOME){ s->view_id=first_id(s); s->view_row=0; s->out_dirty=1; wrap_bg_start(s, +1); render_out(s); render_input(); }
+            else if (wch == KEY_END){ view_set_bottom(s); render_out(s); render_input(); }
 
             /* History su Freccia Su/Giù */
             else if (wch == KEY_UP){
-                if (!edit_saved){ /* salva la riga in editing la prima volta */
-                    wcsncpy(edit_backup, ibuf, (sizeof(edit_backup)/sizeof(edit_backup[0]))-1);
-                    edit_backup[(sizeof(edit_backup)/sizeof(edit_backup[0]))-1]=L'\0';
+                if (!edit_saved){ /* salva la riga in editing la prima volta: è anche il prefisso */
+                    free(edit_backup); edit_backup = wcsdup(ed_text());
                     edit_saved = 1;
                 }
-                if (history_prev(ibuf, sizeof(ibuf)/sizeof(ibuf[0]))){
-                    ilen = wcslen(ibuf);
-                    render_input(ibuf);
-                }
+                const wchar_t *h = history_prev(s);
+                if (h){ ed_set(h); render_input(); }
             }
             else if (wch == KEY_DOWN){
-                if (history_next(ibuf, sizeof(ibuf)/sizeof(ibuf[0]))){
-                    if (hist_pos == -1 && edit_saved){
+                const wchar_t *h = history_next(s);
+                if (h){
+                    if (!hnav.on && edit_saved){
                         /* uscito dalla history: ripristina l'editing salvato */
-                        wcsncpy(ibuf, edit_backup, (sizeof(ibuf)/sizeof(ibuf[0]))-1);
-                        ibuf[(sizeof(ibuf)/sizeof(ibuf[0]))-1]=L'\0';
+                        h = edit_backup ? edit_backup : L"";
                         edit_saved = 0;
                     }
-                    ilen = wcslen(ibuf);
-                    render_input(ibuf);
+                    ed_set(h);
+                    render_input();
                 }
             }
 
             else if (wch == '\n' || wch == '\r'){
-                /* invio comando */
-                ibuf[ilen]=L'\0';
-                if (!input_locked){
+                /* invio comando alla sessione attiva */
+                uint64_t t_key = now_ns();
+                const wchar_t *line = ed_text();
+                if (!s->input_locked && s->sockfd>=0){
                     /* upper opzionale */
                     wchar_t *tmp = NULL;
-                    const wchar_t *src = ibuf;
-                    if (opt_upper){
-                        tmp = wcsdup(ibuf);
+                    const wchar_t *src = line;
+                    if (s->opt.upper){
+                        tmp = wcsdup(line);
                         if (tmp){ for (size_t i=0; tmp[i]; ++i) tmp[i] = towupper(tmp[i]); src = tmp; }
                     }
                     /* echo locale */
-                    if (opt_local_echo){
-                        local_echo_line(src);
+                    if (sess_local_echo(s)){
+                        local_echo_line(s, src);
                     }
                     /* wide -> utf8 e TX */
                     mbstate_t st; memset(&st,0,sizeof st);
@@ -818,30 +4496,24 @@ int main(int argc, char **argv){
                             memcpy(p, buf, r); p += r; left -= r;
                         }
                         *p='\0';
-                        write_telnet_safe((unsigned char*)out8, strlen(out8));
-                        send_eol();
+                        send_line_telnet_safe(s, (unsigned char*)out8, (size_t)(p - out8));
+                        hist_add(&stats.lat_key, now_ns() - t_key);
                         free(out8);
                     }
                     /* salva in history */
-                    history_push(src);
-                    hist_pos = -1;   /* reset navigazione history */
+                    history_push(s, src);
+                    hnav.on = 0;     /* reset navigazione history */
                     edit_saved = 0;  /* backup consumato */
                     free(tmp);
                 }
-                ilen=0; ibuf[ilen]=L'\0'; render_input(ibuf);
-            } else if (wch == KEY_BACKSPACE || wch == 127 || wch == 8){
-                if (ilen>0) { ilen--; ibuf[ilen]=L'\0'; }
-                hist_pos = -1; edit_saved = 0;
-                render_input(ibuf);
-            } else if (wch == KEY_DC){
-                if (ilen>0) { ilen--; ibuf[ilen]=L'\0'; }
-                hist_pos = -1; edit_saved = 0;
-                render_input(ibuf);
-            } else if (iswprint(wch)){
-                if (ilen < (sizeof(ibuf)/sizeof(ibuf[0]))-1) ibuf[ilen++]=(wchar_t)wch, ibuf[ilen]=L'\0';
-                hist_pos = -1; /* digitando, esci da navigazione history */
-                edit_saved = 0; /* e invalida l'eventuale backup */
-                render_input(ibuf);
+                ed_set(NULL); render_input();
+            } else {
+                /* editing della riga: cursore, parole, taglia/incolla, caratteri */
+                int edit;
+                if (ed_key(ch, wch, &edit)){
+                    if (edit){ hnav.on = 0; edit_saved = 0; }   /* digitando, esci dalla history e invalida il backup */
+                    render_input();
+                }
             }
         }
     }